@@ -0,0 +1,610 @@
+//
+// Benchmark suite.
+//
+// Runs a fixed set of micro- and macrobenchmarks, each on a fresh tstate with the same
+// inputs every time, and writes the results as JSON to stdout so that runs can be
+// compared between commits. Every benchmark is run once to warm up and then timed for
+// a number of samples, of which we report the median, percentiles and extremes (in
+// nanoseconds per sample).
+//
+// usage: tet_bench [filter] [samples]
+//
+// Only benchmarks whose name contains 'filter' are run, if it is given.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../tet.h"
+
+#define BENCH_SAMPLES 31
+
+typedef struct bench {
+    char *name;
+    tsize arg;
+    void (*setup)(tstate *s, tsize arg);
+    void (*run)(tstate *s, tsize arg);
+} bench;
+
+static uint64_t bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+//
+// Builtins the language doesn't have (yet), but the recursive benchmarks need.
+//
+
+static tsize bench_lt(tframe *f) {
+    tnum b = tet_popnumber(f);
+    tnum a = tet_popnumber(f);
+    tet_pushnumber(f, a < b);
+    return 1;
+}
+
+static tsize bench_eq(tframe *f) {
+    tnum b = tet_popnumber(f);
+    tnum a = tet_popnumber(f);
+    tet_pushnumber(f, a == b);
+    return 1;
+}
+
+// (if c a b) is a if c is non-zero and b otherwise. Both are evaluated, so to branch
+// they should be lambdas without parameters, and the result invoked: ((if c a b)).
+static tsize bench_if(tframe *f) {
+    tval *b = tframe_pop(f);
+    tval *a = tframe_pop(f);
+    tnum c = tet_popnumber(f);
+    tframe_push(f, c ? a : b);
+    return 1;
+}
+
+static void bench_builtins(tstate *s) {
+    tenv *e = s->env;
+    tenv_put(e, tval_sym(s, "car"), tval_fast(tval_pure(s, builtin_car), &tfast_car));
+    tenv_put(e, tval_sym(s, "cdr"), tval_fast(tval_pure(s, builtin_cdr), &tfast_cdr));
+    tenv_put(e, tval_sym(s, "lambda"), tval_builtin(s, builtin_lambda));
+    tenv_put(e, tval_sym(s, "+"), tval_fast(tval_pure(s, builtin_add), &tfast_add));
+    tenv_put(e, tval_sym(s, "-"), tval_fast(tval_pure(s, builtin_sub), &tfast_sub));
+    tenv_put(e, tval_sym(s, "*"), tval_fast(tval_pure(s, builtin_mul), &tfast_mul));
+    tenv_put(e, tval_sym(s, "/"), tval_fast(tval_pure(s, builtin_div), &tfast_div));
+    tenv_put(e, tval_sym(s, "map"), tval_builtin(s, builtin_map));
+    tenv_put(e, tval_sym(s, "vec"), tval_pure(s, builtin_vec));
+    tenv_put(e, tval_sym(s, "vec-sum"), tval_pure(s, builtin_vec_sum));
+    tenv_put(e, tval_sym(s, "vec-max"), tval_pure(s, builtin_vec_max));
+    tenv_put(e, tval_sym(s, "vec-dot"), tval_pure(s, builtin_vec_dot));
+    tenv_put(e, tval_sym(s, "vec+"), tval_pure(s, builtin_vec_add));
+    tenv_put(e, tval_sym(s, "get"), tval_pure(s, builtin_get));
+    tenv_put(e, tval_sym(s, "range"), tval_pure(s, builtin_range));
+    tenv_put(e, tval_sym(s, "take"), tval_pure(s, builtin_take));
+    tenv_put(e, tval_sym(s, "lazy-map"), tval_builtin(s, builtin_lazy_map));
+    tenv_put(e, tval_sym(s, "reduce"), tval_builtin(s, builtin_reduce));
+    tenv_put(e, tval_sym(s, "seq-list"), tval_builtin(s, builtin_seq_list));
+    tenv_put(e, tval_sym(s, "bytes-len"), tval_pure(s, builtin_bytes_len));
+    tenv_put(e, tval_sym(s, "bytes-count"), tval_pure(s, builtin_bytes_count));
+    tenv_put(e, tval_sym(s, "lines"), tval_pure(s, builtin_lines));
+    tenv_put(e, tval_sym(s, "<"), tval_pure(s, bench_lt));
+    tenv_put(e, tval_sym(s, "="), tval_pure(s, bench_eq));
+    tenv_put(e, tval_sym(s, "if"), tval_builtin(s, bench_if));
+}
+
+//
+// Helpers to set up and run programs. Programs are parsed once, kept in the global env
+// (so they aren't collected) under the name "bench", and evaluated in a new frame.
+//
+
+static tval *bench_eval_src(tstate *s, char *src) {
+    tframe *f = tet_read(s, src);
+    tval *err = tet_eval(s, f);
+    if (err) {
+        fprintf(stderr, "error: %s\n", err->err);
+        exit(1);
+    }
+    return tframe_pop(f);
+}
+
+static void bench_define(tstate *s, char *name, char *src) {
+    tenv_put(s->env, tval_sym(s, name), bench_eval_src(s, src));
+}
+
+static void bench_program(tstate *s, char *src) {
+    tsize i = 0;
+    tenv_put(s->env, tval_sym(s, "bench"), tet_parse(s, src, &i));
+}
+
+static void bench_run_program(tstate *s, tsize arg) {
+    (void) arg;
+    tframe *f = tframe_new(s->env);
+    f->vp = tenv_get(s->env, tval_sym(s, "bench"));
+    tval *err = tet_eval(s, f);
+    if (err) {
+        fprintf(stderr, "error: %s\n", err->err);
+        exit(1);
+    }
+}
+
+// Appends to a growing string.
+typedef struct bench_buf {
+    char *str;
+    tsize len;
+    tsize cap;
+} bench_buf;
+
+static void bench_append(bench_buf *b, char *str) {
+    tsize l = strlen(str);
+    if (b->len + l + 1 > b->cap) {
+        b->cap = (b->len + l + 1) * 2;
+        b->str = realloc(b->str, b->cap);
+    }
+    memcpy(b->str + b->len, str, l + 1);
+    b->len += l;
+}
+
+//
+// Allocation churn: short-lived numbers, collected as a script would (see tsched_step).
+//
+
+static void bench_alloc_run(tstate *s, tsize arg) {
+    for (tsize i = 0; i < arg; i++) {
+        tval_num(s, (tnum) i);
+        if (i % TET_SCHED_GC == 0) {
+            tstate_gc(s);
+        }
+    }
+}
+
+//
+// Collection of a live heap of 'arg' objects: lists of numbers, like bench/gc.c.
+//
+
+static void bench_gc_setup(tstate *s, tsize arg) {
+    tval *outer = NULL;
+    for (tsize n = 0; n < arg; n += 2001) {
+        tval *inner = NULL;
+        for (tsize i = 0; i < 1000; i++) {
+            inner = tval_sexpr(s, tval_num(s, (tnum) i), inner);
+        }
+        outer = tval_sexpr(s, inner, outer);
+    }
+    tenv_put(s->env, tval_sym(s, "heap"), outer);
+}
+
+static void bench_gc_run(tstate *s, tsize arg) {
+    (void) arg;
+    tstate_gc(s);
+    tstate_sweep(s, 0);
+}
+
+//
+// Ten short requests next to a live heap of 'arg' objects, each one cleaned up after in a
+// region, or by a collection.
+//
+
+#define BENCH_REQUESTS 10
+
+static void bench_request_setup(tstate *s, tsize arg) {
+    bench_gc_setup(s, arg);
+    bench_define(s, "inc", "(lambda {x} {+ x 1})");
+    bench_program(s, "(map inc {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16})");
+}
+
+static void bench_region_run(tstate *s, tsize arg) {
+    for (tsize i = 0; i < BENCH_REQUESTS; i++) {
+        tstate_region_enter(s);
+        bench_run_program(s, arg);
+        tstate_region_exit(s, NULL);
+    }
+}
+
+static void bench_request_gc_run(tstate *s, tsize arg) {
+    for (tsize i = 0; i < BENCH_REQUESTS; i++) {
+        bench_run_program(s, arg);
+        tstate_gc(s);
+        tstate_sweep(s, 0);
+    }
+}
+
+//
+// Symbol lookup with 'arg' globals, looking up every tenth of them.
+//
+
+static void bench_env_setup(tstate *s, tsize arg) {
+    char name[32];
+    for (tsize i = 0; i < arg; i++) {
+        snprintf(name, sizeof(name), "global%zu", i);
+        tenv_put(s->env, tval_sym(s, name), tval_num(s, (tnum) i));
+    }
+
+    bench_buf b = {0};
+    bench_append(&b, "(+");
+    for (tsize i = 0; i < arg; i += 10) {
+        snprintf(name, sizeof(name), " global%zu", i);
+        bench_append(&b, name);
+    }
+    bench_append(&b, ")");
+    bench_program(s, b.str);
+    free(b.str);
+}
+
+//
+// Parsing a (quoted) list of 'arg' lists of numbers, symbols, strings and nested lists.
+//
+
+static char *bench_parse_src;
+
+static void bench_parse_setup(tstate *s, tsize arg) {
+    (void) s;
+    bench_buf b = {0};
+    bench_append(&b, "{");
+    for (tsize i = 0; i < arg; i++) {
+        bench_append(&b, "(define item {12345 \"a string\" (nested list 1 2 3) sym-bol} 67890)\n");
+    }
+    bench_append(&b, "}");
+    free(bench_parse_src);
+    bench_parse_src = b.str;
+}
+
+static void bench_parse_run(tstate *s, tsize arg) {
+    (void) arg;
+    tet_read(s, bench_parse_src);
+}
+
+// Printing what parse/ parses, back into the same text.
+static void bench_print_setup(tstate *s, tsize arg) {
+    bench_parse_setup(s, arg);
+    bench_program(s, bench_parse_src);
+}
+
+static void bench_print_run(tstate *s, tsize arg) {
+    (void) arg;
+    tprinter p;
+    tprinter_init(&p, NULL, NULL);
+    tprinter_val(&p, tenv_get(s->env, tval_sym(s, "bench")));
+    tprinter_del(&p);
+}
+
+//
+// Recursive calls.
+//
+
+static void bench_fib_setup(tstate *s, tsize arg) {
+    bench_define(s, "fib", "(lambda {n} {(if (< n 2) (lambda {} {+ n}) "
+                           "(lambda {} {+ (fib (- n 1)) (fib (- n 2))}))})");
+    char src[64];
+    snprintf(src, sizeof(src), "(fib %zu)", arg);
+    bench_program(s, src);
+}
+
+static void bench_ack_setup(tstate *s, tsize arg) {
+    bench_define(s, "ack", "(lambda {m n} {(if (= m 0) (lambda {} {+ n 1}) "
+                           "(if (= n 0) (lambda {} {ack (- m 1) 1}) "
+                           "(lambda {} {ack (- m 1) (ack m (- n 1))})))})");
+    char src[64];
+    snprintf(src, sizeof(src), "(ack 2 %zu)", arg);
+    bench_program(s, src);
+}
+
+//
+// Calling a lambda from C 'arg' times: through a tcall handle, and by reading and
+// evaluating a call every time, as was the only way before.
+//
+
+static tcall *bench_handle;
+
+static void bench_host_setup(tstate *s, tsize arg) {
+    (void) arg;
+    bench_define(s, "inc", "(lambda {x} {+ x 1})");
+}
+
+static void bench_tcall_setup(tstate *s, tsize arg) {
+    bench_host_setup(s, arg);
+    bench_handle = tcall_new(s, tenv_get(s->env, tval_sym(s, "inc")));
+}
+
+static void bench_tcall_run(tstate *s, tsize arg) {
+    tval *r;
+    for (tsize i = 0; i < arg; i++) {
+        tval *a = tval_num(s, (tnum) i);
+        if (tcall_run(bench_handle, &a, 1, &r)) {
+            fprintf(stderr, "error: call failed\n");
+            exit(1);
+        }
+    }
+}
+
+static void bench_reeval_run(tstate *s, tsize arg) {
+    char src[64];
+    for (tsize i = 0; i < arg; i++) {
+        snprintf(src, sizeof(src), "(inc %zu)", i);
+        if (tet_eval(s, tet_read(s, src))) {
+            fprintf(stderr, "error: call failed\n");
+            exit(1);
+        }
+    }
+}
+
+//
+// List processing: mapping over, and taking apart, a list of 'arg' numbers.
+//
+
+static void bench_list_setup(tstate *s, tsize arg) {
+    tval *l = NULL;
+    for (tsize i = arg; i > 0; i--) {
+        l = tval_sexpr(s, tval_num(s, (tnum) i), l);
+    }
+    tenv_put(s->env, tval_sym(s, "list"), l);
+}
+
+static void bench_map_setup(tstate *s, tsize arg) {
+    bench_list_setup(s, arg);
+    bench_program(s, "(map (lambda {x} {+ (* x x) 1}) list)");
+}
+
+static void bench_cdr_setup(tstate *s, tsize arg) {
+    bench_list_setup(s, arg);
+
+    // (car (cdr (cdr ... list))), 'arg' - 1 times cdr.
+    bench_buf b = {0};
+    bench_append(&b, "(car");
+    for (tsize i = 1; i < arg; i++) {
+        bench_append(&b, " (cdr");
+    }
+    bench_append(&b, " list");
+    for (tsize i = 0; i < arg; i++) {
+        bench_append(&b, ")");
+    }
+    bench_program(s, b.str);
+    free(b.str);
+}
+
+//
+// Vectors, against the same numbers in a list where there is an equivalent: summing them
+// as the arguments of +, and adding them up elementwise with map.
+//
+
+static void bench_sum_setup(tstate *s, tsize arg) {
+    bench_list_setup(s, arg);
+    tenv_put(s->env, tval_sym(s, "bench"), tval_sexpr(s, tval_sym(s, "+"),
+                                                      tenv_get(s->env, tval_sym(s, "list"))));
+}
+
+static void bench_vec_setup(tstate *s, tsize arg) {
+    tval *v = tval_vector(s, tvec_new(s, arg));
+    for (tsize i = 0; i < arg; i++) {
+        v->vec->d[i] = (tnum) i + 1;
+    }
+    tenv_put(s->env, tval_sym(s, "vector"), v);
+}
+
+static void bench_vec_sum_setup(tstate *s, tsize arg) {
+    bench_vec_setup(s, arg);
+    bench_program(s, "(vec-sum vector)");
+}
+
+static void bench_add_setup(tstate *s, tsize arg) {
+    bench_list_setup(s, arg);
+    bench_program(s, "(map (lambda {x} {+ x x}) list)");
+}
+
+static void bench_vec_add_setup(tstate *s, tsize arg) {
+    bench_vec_setup(s, arg);
+    bench_program(s, "(vec+ vector vector)");
+}
+
+static void bench_vec_max_setup(tstate *s, tsize arg) {
+    bench_vec_setup(s, arg);
+    bench_program(s, "(vec-max vector)");
+}
+
+static void bench_vec_dot_setup(tstate *s, tsize arg) {
+    bench_vec_setup(s, arg);
+    bench_program(s, "(vec-dot vector vector)");
+}
+
+//
+// Maps of 'arg' numbers: built up one key at a time, persistently and with a transient,
+// and looking up a thousand of them (so that lookups can be compared between sizes).
+//
+
+static void bench_map_assoc_run(tstate *s, tsize arg) {
+    tval *m = tval_map(s);
+    for (tsize i = 0; i < arg; i++) {
+        m = tmap_put(s, m, tval_num(s, (tnum) i), tval_num(s, (tnum) i));
+    }
+}
+
+static void bench_map_build_run(tstate *s, tsize arg) {
+    tval *t = tmap_transient(s, tval_map(s));
+    for (tsize i = 0; i < arg; i++) {
+        tmap_put(s, t, tval_num(s, (tnum) i), tval_num(s, (tnum) i));
+    }
+    tmap_persistent(t);
+}
+
+static void bench_map_get_setup(tstate *s, tsize arg) {
+    tval *t = tmap_transient(s, tval_map(s));
+    for (tsize i = 0; i < arg; i++) {
+        tmap_put(s, t, tval_num(s, (tnum) i * 7), tval_num(s, (tnum) i));
+    }
+    tenv_put(s->env, tval_sym(s, "hmap"), tmap_persistent(t));
+
+    // (+ (get hmap k) ...), for a thousand keys spread over the map.
+    bench_buf b = {0};
+    char buf[64];
+    bench_append(&b, "(+");
+    for (tsize i = 0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), " (get hmap %zu)", (i * arg / 1000) * 7);
+        bench_append(&b, buf);
+    }
+    bench_append(&b, ")");
+    bench_program(s, b.str);
+    free(b.str);
+}
+
+//
+// Sequences: reducing over 'arg' squares, pulled lazily from a range against mapped over
+// a list first, and taking the first ten of a million without computing the rest.
+//
+
+static void bench_reduce_setup(tstate *s, tsize arg) {
+    bench_list_setup(s, arg);
+    bench_program(s, "(reduce + 0 (map (lambda {x} {* x x}) list))");
+}
+
+static void bench_seq_reduce_setup(tstate *s, tsize arg) {
+    char src[96];
+    snprintf(src, sizeof(src), "(reduce + 0 (lazy-map (lambda {x} {* x x}) (range 1 %zu)))",
+             arg + 1);
+    bench_program(s, src);
+}
+
+static void bench_seq_take_setup(tstate *s, tsize arg) {
+    char src[96];
+    snprintf(src, sizeof(src), "(seq-list (take 10 (lazy-map (lambda {x} {* x x}) (range %zu))))",
+             arg);
+    bench_program(s, src);
+}
+
+//
+// Byte buffers: a mapped file of 'arg' lines of log, counting its lines without making
+// values for them, and going through them as slices of the mapping.
+//
+
+static void bench_log_setup(tstate *s, tsize arg) {
+    char path[] = "/tmp/tet_bench_XXXXXX";
+    int fd = mkstemp(path);
+    FILE *out = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!out) {
+        fprintf(stderr, "error: cannot create %s\n", path);
+        exit(1);
+    }
+    for (tsize i = 0; i < arg; i++) {
+        fprintf(out, "2024-01-01T00:00:%02zu host%zu request %zu took %zu ms\n", i % 60, i % 16,
+                i, i * 7 % 1000);
+    }
+    fclose(out);
+
+    // The mapping outlives the file.
+    tenv_put(s->env, tval_sym(s, "log"), tval_mmap(s, path));
+    unlink(path);
+}
+
+static void bench_log_count_setup(tstate *s, tsize arg) {
+    bench_log_setup(s, arg);
+    bench_program(s, "(bytes-count log 10)");
+}
+
+static void bench_log_lines_setup(tstate *s, tsize arg) {
+    bench_log_setup(s, arg);
+    bench_program(s, "(reduce + 0 (lazy-map bytes-len (lines log)))");
+}
+
+static bench benches[] = {
+    {"alloc/churn", 100000, NULL, bench_alloc_run},
+    {"gc/10k", 10000, bench_gc_setup, bench_gc_run},
+    {"gc/100k", 100000, bench_gc_setup, bench_gc_run},
+    {"gc/1m", 1000000, bench_gc_setup, bench_gc_run},
+    {"region/requests-10k", 10000, bench_request_setup, bench_region_run},
+    {"region/requests-1m", 1000000, bench_request_setup, bench_region_run},
+    {"region/requests-gc-10k", 10000, bench_request_setup, bench_request_gc_run},
+    {"region/requests-gc-1m", 1000000, bench_request_setup, bench_request_gc_run},
+    {"env/lookup-100", 100, bench_env_setup, bench_run_program},
+    {"env/lookup-1k", 1000, bench_env_setup, bench_run_program},
+    {"env/lookup-10k", 10000, bench_env_setup, bench_run_program},
+    {"parse/1k", 1000, bench_parse_setup, bench_parse_run},
+    {"print/1k", 1000, bench_print_setup, bench_print_run},
+    {"call/fib-15", 15, bench_fib_setup, bench_run_program},
+    {"call/ack-2-8", 8, bench_ack_setup, bench_run_program},
+    {"call/host-tcall-1k", 1000, bench_tcall_setup, bench_tcall_run},
+    {"call/host-reeval-1k", 1000, bench_host_setup, bench_reeval_run},
+    {"list/map-1k", 1000, bench_map_setup, bench_run_program},
+    {"list/cdr-1k", 1000, bench_cdr_setup, bench_run_program},
+    {"list/sum-10k", 10000, bench_sum_setup, bench_run_program},
+    {"list/add-10k", 10000, bench_add_setup, bench_run_program},
+    {"vec/sum-10k", 10000, bench_vec_sum_setup, bench_run_program},
+    {"vec/add-10k", 10000, bench_vec_add_setup, bench_run_program},
+    {"vec/max-10k", 10000, bench_vec_max_setup, bench_run_program},
+    {"vec/dot-10k", 10000, bench_vec_dot_setup, bench_run_program},
+    {"vec/sum-1m", 1000000, bench_vec_sum_setup, bench_run_program},
+    {"map/assoc-10k", 10000, NULL, bench_map_assoc_run},
+    {"map/build-10k", 10000, NULL, bench_map_build_run},
+    {"map/get-10k", 10000, bench_map_get_setup, bench_run_program},
+    {"map/get-1m", 1000000, bench_map_get_setup, bench_run_program},
+    {"list/reduce-10k", 10000, bench_reduce_setup, bench_run_program},
+    {"seq/reduce-10k", 10000, bench_seq_reduce_setup, bench_run_program},
+    {"seq/take-1m", 1000000, bench_seq_take_setup, bench_run_program},
+    {"bytes/count-1m", 1000000, bench_log_count_setup, bench_run_program},
+    {"bytes/lines-100k", 100000, bench_log_lines_setup, bench_run_program},
+};
+
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of sorted samples.
+static uint64_t bench_pct(uint64_t *t, tsize n, tsize p) {
+    tsize i = (p * n + 99) / 100;
+    return t[i ? i - 1 : 0];
+}
+
+int main(int argc, char **argv) {
+    char *filter = argc > 1 ? argv[1] : NULL;
+    // Volatile, as it lives across the handler of every benchmark.
+    volatile tsize samples = argc > 2 ? (tsize) atol(argv[2]) : BENCH_SAMPLES;
+    if (!samples) samples = 1;
+    uint64_t *t = malloc(samples * sizeof(uint64_t));
+
+    printf("{\n  \"samples\": %zu,\n  \"benchmarks\": [", samples);
+    tsize printed = 0;
+    for (tsize b = 0; b < sizeof(benches) / sizeof(bench); b++) {
+        bench *k = &benches[b];
+        if (filter && !strstr(k->name, filter)) continue;
+
+        tstate *s = tstate_new();
+        TET_CATCH(s, err, {
+            fprintf(stderr, "%s: error: %s\n", k->name, err->err);
+            return 1;
+        });
+        bench_builtins(s);
+        if (k->setup) {
+            k->setup(s, k->arg);
+        }
+
+        // Warm up, then take our samples. Garbage left by a sample is collected before
+        // the next one, so no sample pays for the ones before it.
+        k->run(s, k->arg);
+        for (tsize i = 0; i < samples; i++) {
+            tstate_gc(s);
+            tstate_sweep(s, 0);
+            uint64_t start = bench_now();
+            k->run(s, k->arg);
+            t[i] = bench_now() - start;
+        }
+        TET_UNCATCH(s);
+        tstate_del(s);
+
+        qsort(t, samples, sizeof(uint64_t), bench_cmp);
+        uint64_t sum = 0;
+        for (tsize i = 0; i < samples; i++) {
+            sum += t[i];
+        }
+        printf("%s\n    {\"name\": \"%s\", \"arg\": %zu, \"unit\": \"ns\", \"min\": %llu, "
+               "\"median\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu, \"mean\": %llu}",
+               printed++ ? "," : "", k->name, k->arg, (unsigned long long) t[0],
+               (unsigned long long) bench_pct(t, samples, 50),
+               (unsigned long long) bench_pct(t, samples, 90),
+               (unsigned long long) bench_pct(t, samples, 99),
+               (unsigned long long) t[samples - 1], (unsigned long long) (sum / samples));
+        fflush(stdout);
+    }
+    printf("\n  ]\n}\n");
+
+    free(t);
+    free(bench_parse_src);
+    return 0;
+}
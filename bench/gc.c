@@ -0,0 +1,67 @@
+//
+// Garbage collection pause benchmark.
+//
+// Builds a heap of lists of lists (reachable from the global env, so nothing is
+// swept) and measures how long tstate_gc takes to mark it, first on a single thread
+// and then with an increasing number of marking threads.
+//
+// usage: tet_bench_gc [max threads] [objects] [rounds]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "../tet.h"
+
+// Elements per inner list.
+#define BENCH_WIDTH 1000
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static double bench_gc(tstate *s, tsize threads, tsize rounds) {
+    s->gcthreads = threads;
+    double start = bench_now();
+    for (tsize i = 0; i < rounds; i++) {
+        if (tstate_gc(s)) {
+            printf("error: live objects were collected\n");
+            exit(1);
+        }
+    }
+    return (bench_now() - start) / (double) rounds;
+}
+
+int main(int argc, char **argv) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    tsize max = argc > 1 ? (tsize) atol(argv[1]) : (tsize) (cores > 0 ? cores : 1);
+    tsize objects = argc > 2 ? (tsize) atol(argv[2]) : 2000000;
+    tsize rounds = argc > 3 ? (tsize) atol(argv[3]) : 5;
+
+    tstate *s = tstate_new();
+
+    // Every element is a cons and a number, every inner list adds a cons of its own.
+    tval *outer = NULL;
+    for (tsize n = 0; n < objects; n += BENCH_WIDTH * 2 + 1) {
+        tval *inner = NULL;
+        for (tsize i = 0; i < BENCH_WIDTH; i++) {
+            inner = tval_sexpr(s, tval_num(s, (tnum) i), inner);
+        }
+        outer = tval_sexpr(s, inner, outer);
+    }
+    tenv_put(s->env, tval_sym(s, "heap"), outer);
+    printf("heap: %zu objects\n", s->obji);
+
+    double base = bench_gc(s, 1, rounds);
+    printf("mark threads=1   %8.2f ms\n", base * 1e3);
+    for (tsize n = 2; n <= max; n++) {
+        double t = bench_gc(s, n, rounds);
+        printf("mark threads=%-3zu %8.2f ms  speedup %.2f\n", n, t * 1e3, base / t);
+    }
+
+    tstate_del(s);
+    return 0;
+}
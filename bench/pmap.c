@@ -0,0 +1,89 @@
+//
+// Parallel map benchmark.
+//
+// Scores a list of records with a moderately expensive lambda, first with the
+// sequential map builtin and then with pmap for a range of pool sizes and chunk
+// sizes, reporting the speedup of each over the sequential run.
+//
+// usage: tet_bench_pmap [max threads] [elements] [rounds]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../tet.h"
+
+// Per-element work: a few dozen arithmetic builtin calls.
+#define BENCH_SCORE "(lambda {x} {+ (* x x) (* 3 x) (- x 7) (/ (* x x x) 5) " \
+                    "(* (+ x 1) (+ x 2) (+ x 3)) (- (* x 11) (/ x 3)) " \
+                    "(+ (* x 2) (* x 4) (* x 8) (* x 16)) (/ (+ x 100) 7)})"
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static double bench_eval(tstate *s, char *src, tsize rounds) {
+    double start = bench_now();
+    for (tsize i = 0; i < rounds; i++) {
+        tframe *f = tet_read(s, src);
+        tval *err = tet_eval(s, f);
+        if (err) {
+            printf("error: %s\n", err->err);
+            exit(1);
+        }
+        tstate_gc(s);
+    }
+    return (bench_now() - start) / (double) rounds;
+}
+
+int main(int argc, char **argv) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    tsize max = argc > 1 ? (tsize) atol(argv[1]) : (tsize) (cores > 0 ? cores : 1);
+    tsize len = argc > 2 ? (tsize) atol(argv[2]) : 1000;
+    tsize rounds = argc > 3 ? (tsize) atol(argv[3]) : 3;
+
+    tstate *s = tstate_new();
+    tenv *e = s->env;
+    tenv_put(e, tval_sym(s, "lambda"), tval_builtin(s, builtin_lambda));
+    tenv_put(e, tval_sym(s, "+"), tval_builtin(s, builtin_add));
+    tenv_put(e, tval_sym(s, "-"), tval_builtin(s, builtin_sub));
+    tenv_put(e, tval_sym(s, "*"), tval_builtin(s, builtin_mul));
+    tenv_put(e, tval_sym(s, "/"), tval_builtin(s, builtin_div));
+    tenv_put(e, tval_sym(s, "map"), tval_builtin(s, builtin_map));
+    tenv_put(e, tval_sym(s, "pmap"), tval_builtin(s, builtin_pmap));
+
+    // Build the list of records: {1 2 3 ... len}.
+    char *list = malloc(len * 12 + 3);
+    tsize o = 0;
+    list[o++] = '{';
+    for (tsize i = 1; i <= len; i++) {
+        o += (tsize) sprintf(list + o, i == 1 ? "%zu" : " %zu", i % 1000);
+    }
+    list[o++] = '}';
+    list[o] = '\0';
+
+    char *src = malloc(o + 256);
+    sprintf(src, "(map %s %s)", BENCH_SCORE, list);
+    double base = bench_eval(s, src, rounds);
+    printf("map                    %8.2f ms\n", base * 1e3);
+
+    tsize chunks[] = {0, 1, 64};
+    for (tsize n = 1; n <= max; n++) {
+        for (tsize c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+            tstate_pool(s, n, chunks[c]);
+            sprintf(src, "(pmap %s %s)", BENCH_SCORE, list);
+            double t = bench_eval(s, src, rounds);
+            printf("pmap threads=%-2zu chunk=%-3zu %8.2f ms  speedup %.2f\n",
+                   n, chunks[c], t * 1e3, base / t);
+        }
+    }
+
+    free(src);
+    free(list);
+    tstate_del(s);
+    return 0;
+}
@@ -0,0 +1,126 @@
+//
+// Sequence memory benchmark.
+//
+// Consumes ever longer lazy sequences, lambdas mapped over a range and the lines and
+// words of a mapped file, and reports the peak resident set size of each (run in a
+// process of its own). Consuming a sequence should take the same memory however long
+// it is, so the peak should stay flat: we fail if it ends up more than twice what the
+// shortest took.
+//
+// usage: tet_bench_seq [max elements]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../tet.h"
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void bench_builtins(tstate *s) {
+    tenv *e = s->env;
+    tenv_put(e, tval_sym(s, "lambda"), tval_builtin(s, builtin_lambda));
+    tenv_put(e, tval_sym(s, "+"), tval_fast(tval_pure(s, builtin_add), &tfast_add));
+    tenv_put(e, tval_sym(s, "*"), tval_fast(tval_pure(s, builtin_mul), &tfast_mul));
+    tenv_put(e, tval_sym(s, "range"), tval_pure(s, builtin_range));
+    tenv_put(e, tval_sym(s, "lazy-map"), tval_builtin(s, builtin_lazy_map));
+    tenv_put(e, tval_sym(s, "reduce"), tval_builtin(s, builtin_reduce));
+    tenv_put(e, tval_sym(s, "bytes-len"), tval_pure(s, builtin_bytes_len));
+    tenv_put(e, tval_sym(s, "lines"), tval_pure(s, builtin_lines));
+    tenv_put(e, tval_sym(s, "split"), tval_pure(s, builtin_split));
+}
+
+// Writes 'n' lines of log to a new temporary file, whose path is left in 'path', and
+// returns its size in kilobytes.
+static long bench_log(char *path, tsize n) {
+    int fd = mkstemp(path);
+    FILE *out = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!out) {
+        fprintf(stderr, "error: cannot create %s\n", path);
+        exit(1);
+    }
+    for (tsize i = 0; i < n; i++) {
+        fprintf(out, "request %zu took %zu ms\n", i, i * 7 % 1000);
+    }
+    long size = ftell(out);
+    fclose(out);
+    return size / 1024;
+}
+
+// Evaluates 'src' in a child process, with 'log' mapped if it's given, and returns the
+// peak resident set size of the child, less the mapped file (which is resident too once
+// it's been read, but isn't ours).
+static long bench_run(char *name, char *src, tsize n, char *log, long logsize) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "error: cannot fork\n");
+        exit(1);
+    }
+    if (pid == 0) {
+        tstate *s = tstate_new();
+        bench_builtins(s);
+        if (log) {
+            tenv_put(s->env, tval_sym(s, "log"), tval_mmap(s, log));
+        }
+
+        double start = bench_now();
+        tframe *f = tet_read(s, src);
+        tval *err = tet_eval(s, f);
+        if (err) {
+            fprintf(stderr, "%s: error: %s\n", name, err->err);
+            _exit(1);
+        }
+        printf("%-8s n=%-9zu %8.2f ms", name, n, (bench_now() - start) * 1e3);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    int status;
+    struct rusage u;
+    if (wait4(pid, &status, 0, &u) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        exit(1);
+    }
+    long peak = u.ru_maxrss - logsize;
+    printf("  peak rss %8ld kB\n", peak);
+    return peak;
+}
+
+int main(int argc, char **argv) {
+    tsize max = argc > 1 ? (tsize) atol(argv[1]) : 3000000;
+
+    char src[128];
+    long first = 0, last = 0;
+    for (tsize n = max / 100 ? max / 100 : 1; n <= max; n *= 10) {
+        snprintf(src, sizeof(src), "(reduce + 0 (lazy-map (lambda {x} {* x 2}) (range 0 %zu 1)))", n);
+        long range = bench_run("range", src, n, NULL, 0);
+
+        char path[] = "/tmp/tet_bench_XXXXXX";
+        long size = bench_log(path, n);
+        long lines = bench_run("lines", "(reduce + 0 (lazy-map bytes-len (lines log)))",
+                               n, path, size);
+        long split = bench_run("split",
+                               "(reduce (lambda {a w} {+ a (bytes-len w)}) 0 (split log \" \"))",
+                               n, path, size);
+        unlink(path);
+
+        last = range > lines ? range : lines;
+        last = last > split ? last : split;
+        if (!first) {
+            first = last;
+        }
+    }
+
+    if (last > first * 2) {
+        printf("error: peak rss grew from %ld kB to %ld kB\n", first, last);
+        return 1;
+    }
+    return 0;
+}
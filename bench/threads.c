@@ -0,0 +1,99 @@
+//
+// Multi-threaded scaling benchmark.
+//
+// Runs one independent tstate per thread, each repeatedly parsing, evaluating and
+// collecting a small program, and reports the combined throughput for 1..N threads.
+// Since tstates share nothing, throughput should grow near-linearly with the number
+// of threads until we run out of cores.
+//
+// usage: tet_bench_threads [max threads] [iterations per thread]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "../tet.h"
+
+#define BENCH_PROGRAM "((lambda {a b} {+ a b (+ a b) (+ a (+ b a))}) 1 2)"
+#define BENCH_GC_EVERY 64
+
+typedef struct bench_worker {
+    pthread_t thread;
+    tsize iterations;
+    tsize failures;
+} bench_worker;
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void *bench_run(void *arg) {
+    bench_worker *w = arg;
+
+    tstate *s = tstate_new();
+    if (!s) {
+        w->failures = w->iterations;
+        return NULL;
+    }
+
+    tenv *e = s->env;
+    tenv_put(e, tval_sym(s, "lambda"), tval_builtin(s, builtin_lambda));
+    tenv_put(e, tval_sym(s, "+"), tval_builtin(s, builtin_add));
+
+    for (tsize i = 0; i < w->iterations; i++) {
+        tframe *f = tet_read(s, BENCH_PROGRAM);
+        if (tet_eval(s, f)) {
+            w->failures++;
+        }
+        if (i % BENCH_GC_EVERY == 0) {
+            tstate_gc(s);
+        }
+    }
+
+    tstate_del(s);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    tsize max = argc > 1 ? (tsize) atol(argv[1]) : (tsize) (cores > 0 ? cores : 1);
+    tsize iterations = argc > 2 ? (tsize) atol(argv[2]) : 200000;
+
+    bench_worker *workers = calloc(max, sizeof(bench_worker));
+    if (!workers) {
+        return 1;
+    }
+
+    printf("threads  evals/s       speedup  efficiency\n");
+    double base = 0;
+    for (tsize n = 1; n <= max; n++) {
+        double start = bench_now();
+        for (tsize i = 0; i < n; i++) {
+            workers[i].iterations = iterations;
+            workers[i].failures = 0;
+            pthread_create(&workers[i].thread, NULL, bench_run, &workers[i]);
+        }
+
+        tsize failures = 0;
+        for (tsize i = 0; i < n; i++) {
+            pthread_join(workers[i].thread, NULL);
+            failures += workers[i].failures;
+        }
+        double elapsed = bench_now() - start;
+
+        double rate = (double) (n * iterations) / elapsed;
+        if (n == 1) base = rate;
+        printf("%-8zu %-13.0f %-8.2f %.0f%%\n", n, rate, rate / base,
+               100.0 * rate / base / (double) n);
+        if (failures) {
+            printf("  (%zu evaluations failed)\n", failures);
+        }
+    }
+
+    free(workers);
+    return 0;
+}
@@ -3,6 +3,7 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "tet.h"
 
 int main() {
@@ -16,19 +17,91 @@ int main() {
     printf("\n");
 
     printf("tenv initializing\n");
-    tenv_put(e, tval_sym(s, "car"), tval_builtin(s, builtin_car));
-    tenv_put(e, tval_sym(s, "cdr"), tval_builtin(s, builtin_cdr));
+    tenv_put(e, tval_sym(s, "car"), tval_fast(tval_pure(s, builtin_car), &tfast_car));
+    tenv_put(e, tval_sym(s, "cdr"), tval_fast(tval_pure(s, builtin_cdr), &tfast_cdr));
     tenv_put(e, tval_sym(s, "lambda"), tval_builtin(s, builtin_lambda));
-    tenv_put(e, tval_sym(s, "+"), tval_builtin(s, builtin_add));
-    tenv_put(e, tval_sym(s, "-"), tval_builtin(s, builtin_sub));
-    tenv_put(e, tval_sym(s, "*"), tval_builtin(s, builtin_mul));
-    tenv_put(e, tval_sym(s, "/"), tval_builtin(s, builtin_div));
+    tenv_put(e, tval_sym(s, "+"), tval_fast(tval_pure(s, builtin_add), &tfast_add));
+    tenv_put(e, tval_sym(s, "-"), tval_fast(tval_pure(s, builtin_sub), &tfast_sub));
+    tenv_put(e, tval_sym(s, "*"), tval_fast(tval_pure(s, builtin_mul), &tfast_mul));
+    tenv_put(e, tval_sym(s, "/"), tval_fast(tval_pure(s, builtin_div), &tfast_div));
+    tenv_put(e, tval_sym(s, "map"), tval_builtin(s, builtin_map));
+    tenv_put(e, tval_sym(s, "pmap"), tval_builtin(s, builtin_pmap));
+    tenv_put(e, tval_sym(s, "freeze"), tval_builtin(s, builtin_freeze));
+    tenv_put(e, tval_sym(s, "spawn"), tval_builtin(s, builtin_spawn));
+    tenv_put(e, tval_sym(s, "join"), tval_builtin(s, builtin_join));
+    tenv_put(e, tval_sym(s, "yield"), tval_builtin(s, builtin_yield));
+    tenv_put(e, tval_sym(s, "mailbox"), tval_builtin(s, builtin_mailbox));
+    tenv_put(e, tval_sym(s, "send"), tval_builtin(s, builtin_send));
+    tenv_put(e, tval_sym(s, "recv"), tval_builtin(s, builtin_recv));
+    tenv_put(e, tval_sym(s, "listen"), tval_builtin(s, builtin_listen));
+    tenv_put(e, tval_sym(s, "connect"), tval_builtin(s, builtin_connect));
+    tenv_put(e, tval_sym(s, "listen-unix"), tval_builtin(s, builtin_listen_unix));
+    tenv_put(e, tval_sym(s, "connect-unix"), tval_builtin(s, builtin_connect_unix));
+    tenv_put(e, tval_sym(s, "accept"), tval_builtin(s, builtin_accept));
+    tenv_put(e, tval_sym(s, "open"), tval_builtin(s, builtin_open));
+    tenv_put(e, tval_sym(s, "pipe"), tval_builtin(s, builtin_pipe));
+    tenv_put(e, tval_sym(s, "read"), tval_builtin(s, builtin_read));
+    tenv_put(e, tval_sym(s, "write"), tval_builtin(s, builtin_write));
+    tenv_put(e, tval_sym(s, "close"), tval_builtin(s, builtin_close));
+    tenv_put(e, tval_sym(s, "vec"), tval_pure(s, builtin_vec));
+    tenv_put(e, tval_sym(s, "vec-list"), tval_pure(s, builtin_vec_list));
+    tenv_put(e, tval_sym(s, "vec-len"), tval_pure(s, builtin_vec_len));
+    tenv_put(e, tval_sym(s, "vec-sum"), tval_pure(s, builtin_vec_sum));
+    tenv_put(e, tval_sym(s, "vec-min"), tval_pure(s, builtin_vec_min));
+    tenv_put(e, tval_sym(s, "vec-max"), tval_pure(s, builtin_vec_max));
+    tenv_put(e, tval_sym(s, "vec-dot"), tval_pure(s, builtin_vec_dot));
+    tenv_put(e, tval_sym(s, "vec+"), tval_pure(s, builtin_vec_add));
+    tenv_put(e, tval_sym(s, "vec-"), tval_pure(s, builtin_vec_sub));
+    tenv_put(e, tval_sym(s, "vec*"), tval_pure(s, builtin_vec_mul));
+    tenv_put(e, tval_sym(s, "hash-map"), tval_pure(s, builtin_hash_map));
+    tenv_put(e, tval_sym(s, "assoc"), tval_pure(s, builtin_assoc));
+    tenv_put(e, tval_sym(s, "dissoc"), tval_pure(s, builtin_dissoc));
+    tenv_put(e, tval_sym(s, "get"), tval_pure(s, builtin_get));
+    tenv_put(e, tval_sym(s, "contains"), tval_pure(s, builtin_contains));
+    tenv_put(e, tval_sym(s, "count"), tval_pure(s, builtin_count));
+    tenv_put(e, tval_sym(s, "keys"), tval_pure(s, builtin_keys));
+    tenv_put(e, tval_sym(s, "vals"), tval_pure(s, builtin_vals));
+    tenv_put(e, tval_sym(s, "transient"), tval_builtin(s, builtin_transient));
+    tenv_put(e, tval_sym(s, "assoc!"), tval_builtin(s, builtin_assoc_mut));
+    tenv_put(e, tval_sym(s, "dissoc!"), tval_builtin(s, builtin_dissoc_mut));
+    tenv_put(e, tval_sym(s, "persistent!"), tval_builtin(s, builtin_persistent));
+    tenv_put(e, tval_sym(s, "range"), tval_pure(s, builtin_range));
+    tenv_put(e, tval_sym(s, "take"), tval_pure(s, builtin_take));
+    tenv_put(e, tval_sym(s, "lazy-map"), tval_builtin(s, builtin_lazy_map));
+    tenv_put(e, tval_sym(s, "lazy-filter"), tval_builtin(s, builtin_lazy_filter));
+    tenv_put(e, tval_sym(s, "reduce"), tval_builtin(s, builtin_reduce));
+    tenv_put(e, tval_sym(s, "seq-list"), tval_builtin(s, builtin_seq_list));
+    tenv_put(e, tval_sym(s, "mmap"), tval_builtin(s, builtin_mmap));
+    tenv_put(e, tval_sym(s, "bytes"), tval_pure(s, builtin_bytes));
+    tenv_put(e, tval_sym(s, "bytes-len"), tval_pure(s, builtin_bytes_len));
+    tenv_put(e, tval_sym(s, "bytes-str"), tval_pure(s, builtin_bytes_str));
+    tenv_put(e, tval_sym(s, "bytes-slice"), tval_pure(s, builtin_bytes_slice));
+    tenv_put(e, tval_sym(s, "bytes-count"), tval_pure(s, builtin_bytes_count));
+    tenv_put(e, tval_sym(s, "lines"), tval_pure(s, builtin_lines));
+    tenv_put(e, tval_sym(s, "split"), tval_pure(s, builtin_split));
+    tenv_put(e, tval_sym(s, "repr"), tval_pure(s, builtin_repr));
     printf("tenv initialized\n\n");
 
+    // TET_HEAPPROF=<bytes> profiles the heap and TET_CPUPROF=<hz> the CPU, writing the
+    // profiles to stderr when done.
+    char *heapprof = getenv("TET_HEAPPROF");
+    if (heapprof) {
+        tsize rate = (tsize) strtoul(heapprof, NULL, 10);
+        tstate_heapprof(s, rate ? rate : TET_HEAPPROF_RATE);
+    }
+    char *cpuprof = getenv("TET_CPUPROF");
+    if (cpuprof) {
+        tsize hz = (tsize) strtoul(cpuprof, NULL, 10);
+        tstate_cpuprof(s, hz ? hz : TET_CPUPROF_HZ);
+    }
+
     printf("evaluating\n");
     tframe *f = tet_read(s, "((lambda {a b} {+ a b}) 1 2)");
     printf("input: ");
     tval_print(f->vp);
+    tet_optimize(s, f);
+    printf("\noptimized: ");
+    tval_print(f->vp);
     printf("\noutput:\n");
     tval *r = tet_eval(s, f);
     if (r) {
@@ -40,12 +113,30 @@ int main() {
     tval_print(r);
     printf("\nevaluating finished\n\n");
 
+    if (s->heapprof) {
+        theapprof_dump(s->heapprof, stderr, false);
+    }
+    if (s->cpuprof) {
+        tcpuprof_dump(s->cpuprof, stderr);
+    }
+
     printf("used: %zu\n", s->obji);
     printf("gc: %zu\n", tstate_gc(s));
+    tstate_sweep(s, 0);
 
     printf("used: %zu\n", s->obji);
     printf("gc: %zu\n", tstate_gc(s));
 
+    tstats st;
+    tstate_stats(s, &st);
+    printf("\nallocs: %zu, gcs: %zu, max pause: %llu ns\n",
+           st.allocs, st.gcs, (unsigned long long) st.pausemax);
+    for (tvaltype t = 0; t < TVAL_TYPES; t++) {
+        if (st.values[t]) {
+            printf("%s: %zu (%zu bytes)\n", tvaltype_print(t), st.values[t], st.valuebytes[t]);
+        }
+    }
+
     tstate_del(s);
 
     return 0;
@@ -2,13 +2,38 @@
 // Created by joris on 6/23/18.
 //
 
+#define _GNU_SOURCE // accept4, pipe2
+
 #include <stdarg.h>
 #include <stdlib.h>
 #include <memory.h>
 #include <stdio.h>
 #include <err.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <limits.h>
 #include "tet.h"
 
+#if TET_SIMD
+#include <immintrin.h>
+#endif
+
 //    ____ _     ___  ____    _    _     ____
 //   / ___| |   / _ \| __ )  / \  | |   / ___|
 //  | |  _| |  | | | |  _ \ / _ \ | |   \___ \
@@ -16,13 +41,6 @@
 //   \____|_____\___/|____/_/   \_\_____|____/
 //
 
-// @formatter:off because CLion wants to remove the indents
-static tval tet_memerr = {
-    .type = TVAL_ERROR,
-    .err = "out of memory"
-};
-// @formatter:on
-
 // Primitive memory functions.
 inline void *talloc(tsize l) {
     return malloc(l);
@@ -40,7 +58,7 @@ inline void tfree(void *p) {
 void *tealloc(tstate *s, tsize l) {
     void *p = talloc(l);
     if (!p) {
-        TET_THROWRAW(s, &tet_memerr);
+        TET_THROWRAW(s, s->memerr);
     }
     return p;
 }
@@ -48,7 +66,7 @@ void *tealloc(tstate *s, tsize l) {
 void *terealloc(tstate *s, void *p, tsize l) {
     void *n = trealloc(p, l);
     if (!n) {
-        TET_THROWRAW(s, &tet_memerr);
+        TET_THROWRAW(s, s->memerr);
     }
     return n;
 }
@@ -93,6 +111,22 @@ char *tvaltype_print(tvaltype t) {
             return "BUILTIN";
         case TVAL_LAMBDA:
             return "LAMBDA";
+        case TVAL_TASK:
+            return "TASK";
+        case TVAL_MAILBOX:
+            return "MAILBOX";
+        case TVAL_BIGNUM:
+            return "BIGNUM";
+        case TVAL_VECTOR:
+            return "VECTOR";
+        case TVAL_MAP:
+            return "MAP";
+        case TVAL_SEQ:
+            return "SEQ";
+        case TVAL_BYTES:
+            return "BYTES";
+        case TVAL_TYPES:
+            break;
     }
     return 0;
 }
@@ -104,6 +138,25 @@ char *tvaltype_print(tvaltype t) {
 //  |____/ |_/_/   \_\_| |_____|
 //
 
+static void tstate_free(tstate *s, tobj *o);
+static void tstate_shrink(tstate *s);
+static void tstate_gc_pause(tstate *s, struct timespec *t0);
+static void theapprof_sample(tstate *s, tobj *o, tsize l);
+static void theapprof_free(theapprof *p, tobj *o);
+static void theapprof_del(theapprof *p);
+static void tcpuprof_del(tcpuprof *p);
+static bool tcpuprof_start(tcpuprof *p);
+static void tcpuprof_tick(tstate *s);
+static tbig *tbig_copy(tstate *s, tbig *b);
+static tbig *tbig_parse(tstate *s, char *in, tsize l);
+static void tbig_print(tprinter *p, tbig *b);
+static tsize tmapnode_mark(tmapnode *x, tmark m);
+static void tmapnode_release(tmapnode *x);
+static tmapnode *tmapnode_copy_from(tstate *s, tmapnode *x, tfrozen *z);
+static void tmapnode_print(tprinter *p, tmapnode *x, bool *first);
+static void tbuf_release(tbuf *b);
+static tval *tbytes_new(tstate *s, tbuf *buf, char *ptr, tsize len);
+
 tstate *tstate_new() {
     // The only allocation that does not jmp on failure within tet.
     tstate *s = talloc(sizeof(tstate));
@@ -114,13 +167,63 @@ tstate *tstate_new() {
     // Properly null-initialize critical fields.
     s->env = NULL;
     s->frame = NULL;
+    s->memerr = NULL;
+    s->pool = NULL;
+    s->held = NULL;
+    s->heldi = 0;
+    s->heldl = 0;
+    s->sched = NULL;
+    s->task = NULL;
+    s->yield = false;
+    s->depth = 0;
+    s->gcthreads = TET_GC_THREADS;
+    s->sweepi = 0;
+    s->sweepj = 0;
+    s->sweepn = 0;
+    s->allocs = 0;
+    s->gcs = 0;
+    s->pausetotal = 0;
+    s->pausemax = 0;
+    memset(s->pauses, 0, sizeof(s->pauses));
+    s->heapprof = NULL;
+    s->cpuprof = NULL;
+    s->running = NULL;
+    s->jit = TET_JIT;
+    s->jitted = NULL;
+    memset(s->shadowed, 0, sizeof(s->shadowed));
+    s->envver = 0;
+    s->nums = NULL;
+#if TET_TRACE
+    s->trace = NULL;
+    s->tracei = 0;
+#endif
+    s->pins = NULL;
+    s->pini = 0;
+    s->pinl = 0;
+    s->pinfree = NULL;
+    s->pinfreei = 0;
+    s->regions = 0;
+    s->regioni = 0;
+    s->remembered = NULL;
+    s->rememberedi = 0;
+    s->rememberedl = 0;
     s->jmpi = 0;
     s->ptri = 0;
 
+    // The first block of the jump stack, for the handler below (and the outermost handler
+    // of the user) to go in.
+    memset(s->jmps, 0, sizeof(s->jmps));
+    s->jmps[0] = talloc(TET_STATE_JMPS_LEN * sizeof(struct tjmp));
+    if (!s->jmps[0]) {
+        tfree(s);
+        return NULL;
+    }
+
     // Once we've allocated the tstate struct, we can now use it to store our pointers to
     // non-collected memory. Then, should an error occur (e.g. allocation failure),
     // we can easily free the memory again. This is done by the TET_CATCH macro.
     TET_CATCH(s, e, {
+        tfree(s->jmps[0]);
         tfree(s); // Primitive free(), the only case of this happening.
         return NULL;
     });
@@ -130,6 +233,13 @@ tstate *tstate_new() {
     s->obji = 0;
     s->objl = TET_STATE_OBJS_LEN;
 
+    // The out of memory error. Should this allocation fail we simply longjmp with a NULL
+    // error, which is fine since the handler above doesn't look at it anyway.
+    s->memerr = tralloc(s, sizeof(tval));
+    SETMARKTYPE(s->memerr, TMARK_VALUE);
+    s->memerr->type = TVAL_ERROR;
+    s->memerr->err = "out of memory";
+
     // Somewhat pointless as nothing will try to GC this object (would it be garbage
     // collecting itself?), but for correctness we will include this.
     SETMARKTYPE(s, TMARK_STATE);
@@ -141,19 +251,87 @@ tstate *tstate_new() {
     // handler here. It is the users' responsibility to specify a top-level error handler
     // if they perform any unsafe operations (e.g. defining builtins, parsing, ...).
     TET_UNCATCH(s);
-    trforget(s, 1); // s->objs
+    trforget(s, 2); // s->objs, s->memerr
+
+    // Without memory for the small numbers, tval_num allocates every number it returns.
+    tsize nums = TET_STATE_NUMS_MAX - TET_STATE_NUMS_MIN;
+    s->nums = talloc(nums * sizeof(tval));
+    for (tsize i = 0; s->nums && i < nums; i++) {
+        tval *v = &s->nums[i];
+        SETMARKTYPE(v, TMARK_VALUE);
+        v->flags = TOBJ_FLAG_STATIC;
+        v->type = TVAL_NUMBER;
+        v->car = NULL;
+        v->cdr = NULL;
+        v->num = (tnum) i + TET_STATE_NUMS_MIN;
+    }
+
+#if TET_TRACE
+    // Tracing is best effort, without memory for a trace we just don't record any.
+    s->trace = talloc(TET_TRACE_LEN * sizeof(ttrace_event));
+    if (s->trace) {
+        memset(s->trace, 0, TET_TRACE_LEN * sizeof(ttrace_event));
+    }
+#endif
     return s;
 }
 
+void tstate_jmps_room(tstate *s, tsize n) {
+    if (s->jmpi + n > TET_STATE_JMPS_MAX) {
+        TET_THROW(s, "too deeply nested");
+    }
+    tsize last = (s->jmpi + n - 1) / TET_STATE_JMPS_LEN;
+    for (tsize i = s->jmpi / TET_STATE_JMPS_LEN; i <= last; i++) {
+        if (!s->jmps[i]) {
+            s->jmps[i] = tealloc(s, TET_STATE_JMPS_LEN * sizeof(struct tjmp));
+        }
+    }
+}
+
 void tstate_del(tstate *s) {
+    // Stop our workers (and delete their states) first, if we ever started any.
+    if (s->sched && s->sched->owner == s) {
+        tsched_del(s->sched);
+    }
+    if (s->pool) {
+        tpool_del(s->pool);
+    }
+
     // Delete every object (which can all be garbage-collected!) known to this tstate.
     // This actually includes s->frame and s->env.
-    while (s->obji) {
-        tstate_gc_obj(s, s->objs[0]);
+    tstate_heapprof(s, 0);
+    tstate_cpuprof(s, 0);
+#if TET_JIT
+    if (s->jitted) {
+        tjit_del(s->jitted);
+        s->jitted = NULL;
+    }
+#endif
+    tstate_sweep(s, 0);
+    for (tsize i = 0; i < s->obji; i++) {
+        tstate_free(s, s->objs[i]);
+    }
+    s->obji = 0;
+
+    // Let go of the frozen regions we were referencing.
+    while (s->heldi) {
+        tfrozen_release(s->held[--s->heldi]);
     }
 
-    // Free the only remaining array, and lastly the tstate itself.
+    // Free the only remaining allocations, and lastly the tstate itself.
+    tfree(s->pins);
+    tfree(s->pinfree);
+    tfree(s->remembered);
+    tfree(s->held);
     tfree(s->objs);
+    tfree(s->memerr);
+    tfree(s->nums);
+    for (tsize i = 0; i < TET_STATE_JMPS_MAX / TET_STATE_JMPS_LEN; i++) {
+        tfree(s->jmps[i]);
+    }
+#if TET_TRACE
+    tfree(s->trace);
+#endif
     tfree(s);
 }
 
@@ -175,51 +353,531 @@ tsize tstate_mark(tstate *s, tmark m) {
         c += tframe_mark(s->frame, m);
     }
 
+    // And everything that has been pinned.
+    for (tsize i = 0; i < s->pini; i++) {
+        tobj *o = s->pins[i];
+        if (!o) continue;
+        switch (GETMARKTYPE(o)) {
+            case TMARK_ENV:
+                c += tenv_mark((tenv *) o, m);
+                break;
+            case TMARK_FRAME:
+                c += tframe_mark((tframe *) o, m);
+                break;
+            case TMARK_VALUE:
+                c += tval_mark((tval *) o, m);
+                break;
+            default:
+                break;
+        }
+    }
+
+    return c;
+}
+
+// Parallel marking. Every thread has a private stack of objects it has marked but not
+// scanned yet, and a deque through which it offers part of that work to the others.
+// Threads that run out of work steal from the deques of others, and marking is done
+// once all of them are out of work. Marks are set with a compare and swap, so every
+// object is scanned (and counted) exactly once.
+typedef struct tmarker tmarker;
+
+struct tmarker_thread {
+    tmarker *mk;
+    pthread_t thread;
+
+    tobj **stack;
+    tsize stacki;
+    tsize stackl;
+
+    pthread_mutex_t lock;
+    tobj **deque;
+    tsize top;
+    tsize bottom;
+    tsize cap;
+
+    tsize count; // objects marked
+    tsize seed; // for picking victims to steal from
+};
+
+struct tmarker {
+    tmark m;
+    tsize n;
+    struct tmarker_thread *threads;
+    tsize active; // atomic, threads that (may) have work
+};
+
+static void tmarker_scan(struct tmarker_thread *t, tobj *o);
+static void tmarker_mark(struct tmarker_thread *t, tobj *o);
+
+// Map nodes aren't objects of their own, we scan them along with the map. Their marks
+// are swapped in, so that nodes shared by maps are still scanned just once.
+static void tmarker_mark_map(struct tmarker_thread *t, tmapnode *x) {
+    tmark m = t->mk->m;
+    if (!x || !x->refs || __atomic_exchange_n(&x->mark, m, __ATOMIC_RELAXED) == m) {
+        return;
+    }
+    for (uint32_t i = 0; i < x->n; i++) {
+        tmapentry *e = &x->e[i];
+        if (e->node) {
+            tmarker_mark_map(t, e->node);
+        } else {
+            tmarker_mark(t, (tobj *) e->key);
+            tmarker_mark(t, (tobj *) e->val);
+        }
+    }
+}
+
+static void tmarker_mark(struct tmarker_thread *t, tobj *o) {
+    // Frozen values are immutable and not ours to collect, static ones are never garbage.
+    if (!o || (o->flags & (TOBJ_FLAG_FROZEN | TOBJ_FLAG_STATIC))) return;
+
+    tmark m = t->mk->m;
+    tmark old = __atomic_load_n(&o->mark, __ATOMIC_RELAXED);
+    do {
+        if ((old & TOBJ_MARK_VALUE) == m) return;
+    } while (!__atomic_compare_exchange_n(&o->mark, &old, (tmark) ((old & TOBJ_MARK_TYPE) + m),
+                                          true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    t->count++;
+
+    if (t->stacki >= t->stackl) {
+        tsize l = t->stackl ? t->stackl * 2 : 256;
+        tobj **stack = trealloc(t->stack, l * sizeof(tobj *));
+        if (!stack) {
+            // We can't defer it, so we scan it right away.
+            tmarker_scan(t, o);
+            return;
+        }
+        t->stack = stack;
+        t->stackl = l;
+    }
+    t->stack[t->stacki++] = o;
+}
+
+static void tmarker_scan(struct tmarker_thread *t, tobj *o) {
+    switch (GETMARKTYPE(o)) {
+        case TMARK_ENV: {
+            tenv *e = (tenv *) o;
+            tmarker_mark(t, (tobj *) e->vars);
+            tmarker_mark(t, (tobj *) e->prev);
+            break;
+        }
+        case TMARK_FRAME: {
+            tframe *f = (tframe *) o;
+            for (tsize i = 0; i < f->obji; i++) {
+                tmarker_mark(t, (tobj *) f->objs[i]);
+            }
+            tmarker_mark(t, (tobj *) f->ip);
+            tmarker_mark(t, (tobj *) f->vp);
+            tmarker_mark(t, (tobj *) f->env);
+            tmarker_mark(t, (tobj *) f->orig);
+            tmarker_mark(t, (tobj *) f->prev);
+            break;
+        }
+        case TMARK_VALUE: {
+            tval *v = (tval *) o;
+            switch (v->type) {
+                case TVAL_SEXPR:
+                case TVAL_QEXPR:
+                    tmarker_mark(t, (tobj *) v->car);
+                    tmarker_mark(t, (tobj *) v->cdr);
+                    break;
+                case TVAL_ENV:
+                    tmarker_mark(t, (tobj *) v->env);
+                    break;
+                case TVAL_FRAME:
+                    tmarker_mark(t, (tobj *) v->frame);
+                    break;
+                case TVAL_LAMBDA:
+                    tmarker_mark(t, (tobj *) v->pars);
+                    tmarker_mark(t, (tobj *) v->body);
+                    break;
+                case TVAL_MAP:
+                    tmarker_mark_map(t, v->node);
+                    break;
+                case TVAL_SEQ:
+                    tmarker_mark(t, (tobj *) v->seq->fn);
+                    tmarker_mark(t, (tobj *) v->seq->src);
+                    break;
+                default:
+                    break;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// Move the older half of our stack to our deque, if nobody has taken up our last offer
+// yet we keep it to ourselves.
+static void tmarker_share(struct tmarker_thread *t) {
+    tsize k = t->stacki / 2;
+    if (!k) return;
+
+    pthread_mutex_lock(&t->lock);
+    if (t->bottom == t->top) {
+        __atomic_store_n(&t->top, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&t->bottom, 0, __ATOMIC_RELAXED);
+        if (t->cap < k) {
+            tobj **deque = trealloc(t->deque, k * sizeof(tobj *));
+            if (!deque) {
+                pthread_mutex_unlock(&t->lock);
+                return;
+            }
+            t->deque = deque;
+            t->cap = k;
+        }
+        memcpy(t->deque, t->stack, k * sizeof(tobj *));
+        __atomic_store_n(&t->bottom, k, __ATOMIC_RELAXED);
+        memmove(t->stack, t->stack + k, (t->stacki - k) * sizeof(tobj *));
+        t->stacki -= k;
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+// Take up to half of v's deque (but at least one object) onto t's stack.
+static bool tmarker_take(struct tmarker_thread *t, struct tmarker_thread *v) {
+    pthread_mutex_lock(&v->lock);
+    tsize k = v->bottom - v->top;
+    if (t != v) k = (k + 1) / 2;
+    if (k && t->stacki + k > t->stackl) {
+        tsize l = t->stackl ? t->stackl : 256;
+        while (l < t->stacki + k) l *= 2;
+        tobj **stack = trealloc(t->stack, l * sizeof(tobj *));
+        if (!stack) {
+            k = t->stackl - t->stacki;
+        } else {
+            t->stack = stack;
+            t->stackl = l;
+        }
+    }
+    if (k) {
+        memcpy(t->stack + t->stacki, v->deque + v->top, k * sizeof(tobj *));
+        t->stacki += k;
+        __atomic_store_n(&v->top, v->top + k, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&v->lock);
+    return k > 0;
+}
+
+static bool tmarker_steal(struct tmarker_thread *t) {
+    tmarker *mk = t->mk;
+
+    // Start at a random victim, so thieves don't all go after the same thread.
+    t->seed ^= t->seed << 13;
+    t->seed ^= t->seed >> 7;
+    t->seed ^= t->seed << 17;
+    for (tsize i = 0; i < mk->n; i++) {
+        struct tmarker_thread *v = &mk->threads[(t->seed + i) % mk->n];
+        if (v == t || __atomic_load_n(&v->bottom, __ATOMIC_RELAXED) ==
+                      __atomic_load_n(&v->top, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (tmarker_take(t, v)) return true;
+    }
+    return false;
+}
+
+static void *tmarker_main(void *arg) {
+    struct tmarker_thread *t = arg;
+    tmarker *mk = t->mk;
+
+    while (1) {
+        while (t->stacki) {
+            tmarker_scan(t, t->stack[--t->stacki]);
+            if (t->stacki > TET_GC_SHARE && __atomic_load_n(&t->bottom, __ATOMIC_RELAXED) ==
+                                            __atomic_load_n(&t->top, __ATOMIC_RELAXED)) {
+                tmarker_share(t);
+            }
+        }
+
+        // Whatever we offered and nobody took is still ours to do.
+        if (tmarker_take(t, t)) continue;
+
+        // Out of work. Only threads with work can give others work, so once none of
+        // us has any we are done. Until then we try to steal some.
+        __atomic_sub_fetch(&mk->active, 1, __ATOMIC_SEQ_CST);
+        while (1) {
+            if (!__atomic_load_n(&mk->active, __ATOMIC_SEQ_CST)) {
+                return NULL;
+            }
+            __atomic_add_fetch(&mk->active, 1, __ATOMIC_SEQ_CST);
+            if (tmarker_steal(t)) break;
+            __atomic_sub_fetch(&mk->active, 1, __ATOMIC_SEQ_CST);
+            sched_yield();
+        }
+    }
+}
+
+tsize tstate_mark_parallel(tstate *s, tmark m, tsize threads) {
+    if (!s) return 0;
+    if (threads < 2) {
+        return tstate_mark(s, m);
+    }
+    if (GETMARK(s) == m) {
+        return 0;
+    }
+
+    tmarker mk;
+    mk.m = m;
+    mk.n = threads;
+    mk.active = threads;
+    mk.threads = talloc(threads * sizeof(struct tmarker_thread));
+    if (!mk.threads) {
+        return tstate_mark(s, m);
+    }
+    for (tsize i = 0; i < threads; i++) {
+        struct tmarker_thread *t = &mk.threads[i];
+        t->mk = &mk;
+        t->stack = NULL;
+        t->stacki = 0;
+        t->stackl = 0;
+        t->deque = NULL;
+        t->top = 0;
+        t->bottom = 0;
+        t->cap = 0;
+        t->count = 0;
+        t->seed = i * 2654435761u + 1;
+        pthread_mutex_init(&t->lock, NULL);
+    }
+
+    SETMARK(s, m);
+
+    // The first thread starts out with the roots, the others steal them from it.
+    struct tmarker_thread *first = &mk.threads[0];
+    tmarker_mark(first, (tobj *) s->env);
+    tmarker_mark(first, (tobj *) s->frame);
+    for (tsize i = 0; i < s->pini; i++) {
+        tmarker_mark(first, s->pins[i]);
+    }
+    tmarker_share(first);
+
+    // A thread we fail to start simply never has any work.
+    tsize started = 1;
+    for (tsize i = 1; i < threads; i++) {
+        if (pthread_create(&mk.threads[i].thread, NULL, tmarker_main, &mk.threads[i])) {
+            __atomic_sub_fetch(&mk.active, threads - i, __ATOMIC_SEQ_CST);
+            break;
+        }
+        started++;
+    }
+    tmarker_main(first);
+
+    tsize c = 1;
+    for (tsize i = 0; i < threads; i++) {
+        struct tmarker_thread *t = &mk.threads[i];
+        if (i && i < started) {
+            pthread_join(t->thread, NULL);
+        }
+        c += t->count;
+        tfree(t->stack);
+        tfree(t->deque);
+        pthread_mutex_destroy(&t->lock);
+    }
+    tfree(mk.threads);
     return c;
 }
 
 tsize tstate_gc(tstate *s) {
 
+    // Finish the previous sweep first, so the only unswept objects are the ones we are
+    // about to mark. (Marks wrap around, old garbage might look alive otherwise.)
+    tstate_sweep(s, 0);
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
     // Pick the new mark.
     tmark nm = (tmark) (GETMARK(s) + (tmark) 1) & TOBJ_MARK_VALUE;
 
-    // Mark objects.
-    tsize c = tstate_mark(s, nm);
+    // Mark objects, in parallel if there are many of them.
+    tsize c;
+    if (s->obji >= TET_GC_PARALLEL && s->gcthreads != 1) {
+        tsize threads = s->gcthreads;
+        if (!threads) {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            threads = n > 0 ? (tsize) n : 1;
+        }
+        c = tstate_mark_parallel(s, nm, threads);
+    } else {
+        c = tstate_mark(s, nm);
+    }
+
+    tstate_gc_pause(s, &t0);
 
     // If we marked as many as we expected, then we need not sweep.
-    if (c == s->obji + 1) {
+    c = s->obji + 1 - c;
+    if (!c) {
         return 0;
     }
 
-    // Otherwise, sweep.
-    c = 0;
-    for (tsize i = 0; i < s->obji; i++) {
+    // Otherwise, the objects we have now are to be swept. We leave that to tstate_sweep,
+    // which allocations call to sweep a few objects at a time.
+    s->sweepi = 0;
+    s->sweepj = 0;
+    s->sweepn = s->obji;
+
+    TET_TRACE_EVENT(s, TET_TRACE_GC, TTRACE_GC, s->obji - c, c);
+
+    // Except in a region, which has to stay at the end of objs. The older objects written
+    // to in it that are garbage now need not be remembered any longer.
+    if (s->regions) {
+        tsize j = 0;
+        for (tsize i = 0; i < s->rememberedi; i++) {
+            if (GETMARK(s->remembered[i]) == nm) {
+                s->remembered[j++] = s->remembered[i];
+            }
+        }
+        s->rememberedi = j;
+        tstate_sweep(s, 0);
+    }
+    return c;
+}
+
+bool tstate_sweep(tstate *s, tsize n) {
+    if (s->sweepi == s->sweepn) {
+        return true;
+    }
+
+    // Keep the survivors at the front, freeing the rest.
+    tmark m = GETMARK(s);
+    tsize end = n && s->sweepn - s->sweepi > n ? s->sweepi + n : s->sweepn;
+    for (tsize i = s->sweepi; i < end; i++) {
         tobj *o = s->objs[i];
-        tmark om = GETMARK(o);
-        if (om == nm) continue;
-        tstate_gc_obj(s, o);
-        c++;
-        i--;
+        if (i == s->regioni && s->regions) {
+            s->regioni = s->sweepj;
+        }
+        if (GETMARK(o) == m) {
+            s->objs[s->sweepj++] = o;
+        } else {
+            tstate_free(s, o);
+        }
+    }
+    s->sweepi = end;
+    if (end < s->sweepn) {
+        return false;
     }
 
-    printf("gc: %zu\n", c);
-    return c;
+    // Close the gap between the survivors and whatever was allocated while sweeping.
+    tsize tail = s->obji - s->sweepn;
+    memmove(s->objs + s->sweepj, s->objs + s->sweepn, tail * sizeof(tobj *));
+    if (s->regions && s->regioni >= s->sweepn) {
+        s->regioni -= s->sweepn - s->sweepj;
+    }
+    s->obji = s->sweepj + tail;
+    s->sweepi = 0;
+    s->sweepj = 0;
+    s->sweepn = 0;
+    tstate_shrink(s);
+
+    TET_TRACE_EVENT(s, TET_TRACE_GC, TTRACE_SWEEP, s->obji, 0);
+    return true;
+}
+
+static void tstate_gc_pause(tstate *s, struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t ns = (uint64_t) (t1.tv_sec - t0->tv_sec) * 1000000000 + t1.tv_nsec - t0->tv_nsec;
+
+    s->gcs++;
+    s->pausetotal += ns;
+    if (ns > s->pausemax) {
+        s->pausemax = ns;
+    }
+
+    // Find the bucket: the number of bits in the pause in microseconds.
+    tsize b = 0;
+    for (uint64_t us = ns / 1000; us && b < TET_GC_PAUSES - 1; us >>= 1) {
+        b++;
+    }
+    s->pauses[b]++;
+}
+
+static tsize tstate_objsize(tobj *o) {
+    switch (GETMARKTYPE(o)) {
+        case TMARK_ENV:
+            return sizeof(tenv);
+        case TMARK_FRAME:
+            return sizeof(tframe) + ((tframe *) o)->objl * sizeof(tval *);
+        case TMARK_VALUE: {
+            tval *v = (tval *) o;
+            switch (v->type) {
+                case TVAL_ERROR:
+                    return sizeof(tval) + strlen(v->err) + 1;
+                case TVAL_SYMBOL:
+                    return sizeof(tval) + strlen(v->sym) + 1 +
+                           (v->cache ? sizeof(tsymcache) : 0);
+                case TVAL_STRING:
+                    return sizeof(tval) + strlen(v->str) + 1;
+                case TVAL_BIGNUM:
+                    return sizeof(tval) + sizeof(tbig) + v->big->n * sizeof(uint32_t);
+                case TVAL_VECTOR:
+                    return sizeof(tval) + TET_SIMD_ALIGN + v->vec->n * sizeof(tnum);
+                case TVAL_SEQ:
+                    return sizeof(tval) + sizeof(tseq);
+                case TVAL_BYTES:
+                    // The buffer is shared by its slices, and not counted.
+                    return sizeof(tval) + sizeof(tbytes);
+                default:
+                    return sizeof(tval);
+            }
+        }
+        default:
+            return 0;
+    }
+}
+
+void tstate_stats(tstate *s, tstats *st) {
+    memset(st, 0, sizeof(tstats));
+    st->allocs = s->allocs;
+    st->gcs = s->gcs;
+    st->pausetotal = s->pausetotal;
+    st->pausemax = s->pausemax;
+    memcpy(st->pauses, s->pauses, sizeof(st->pauses));
+
+    // Walk the heap, skipping the free slots and the garbage of a sweep in progress.
+    tmark m = GETMARK(s);
+    for (tsize i = 0; i < s->obji; i++) {
+        if (s->sweepi != s->sweepn) {
+            if (i == s->sweepj) {
+                i = s->sweepi;
+                if (i == s->obji) break;
+            }
+            if (i < s->sweepn && GETMARK(s->objs[i]) != m) continue;
+        }
+
+        tobj *o = s->objs[i];
+        tmark t = GETMARKTYPE(o);
+        tsize l = tstate_objsize(o);
+        st->objects[t]++;
+        st->bytes[t] += l;
+        if (t == TMARK_VALUE) {
+            st->values[((tval *) o)->type]++;
+            st->valuebytes[((tval *) o)->type] += l;
+        }
+    }
 }
 
 void tstate_gc_obj(tstate *s, tobj *o) {
+    tstate_free(s, o);
+    tstate_untrack(s, o);
+}
+
+static void tstate_free(tstate *s, tobj *o) {
+    if ((o->flags & TOBJ_FLAG_SAMPLED) && s->heapprof) {
+        theapprof_free(s->heapprof, o);
+    }
+
     tmark t = GETMARKTYPE(o);
     switch (t) {
         case TMARK_ENV:
             tenv_del((tenv *) o);
-            tstate_untrack(s, o);
             break;
         case TMARK_FRAME:
             tframe_del((tframe *) o);
-            tstate_untrack(s, o);
             break;
         case TMARK_VALUE:
             tval_del(s, (tval *) o);
-            tstate_untrack(s, o);
             break;
         default: TET_THROW(s, "bad marker type: %u", t);
     }
@@ -233,131 +891,570 @@ void tstate_track(tstate *s, tobj *o) {
         s->objl *= 2;
     }
 
-    // Insert into the array.
+    // Insert into the array. New objects carry the current mark, which the next collection
+    // won't take for marked. (Any fixed mark would be the next one every so often, as
+    // marks wrap around, and what the object refers to would never get marked then.)
+    SETMARK(o, GETMARK(s));
     s->objs[s->obji++] = o;
+    s->allocs++;
+    if (s->regions) {
+        o->flags |= TOBJ_FLAG_REGION;
+    }
+
+    // Pay for the allocation by sweeping a little, if there is anything to sweep.
+    if (s->sweepi != s->sweepn) {
+        tstate_sweep(s, TET_GC_SWEEP);
+    }
 }
 
 void tstate_untrack(tstate *s, tobj *o) {
-    tsize half;
-    tsize quarter;
+    // Moving objects around would upset a sweep in progress.
+    tstate_sweep(s, 0);
 
     // Loop the array until we find o.
     for (tsize i = 0; i < s->obji; i++) {
         if (s->objs[i] == o) {
+            // An older object is replaced by the last older one, whose slot the region
+            // shifts down into.
+            if (s->regions && i < s->regioni) {
+                s->objs[i] = s->objs[--s->regioni];
+                i = s->regioni;
+            }
+
             // Swap the last item into this slot, and decrement
             // the index pointer. This way we don't get gaps.
             s->objs[i] = s->objs[--s->obji];
-            goto shrink;
+            tstate_shrink(s);
+            return;
         }
     }
 
     // We don't really care if we didn't find it.
-    return;
+}
 
+static void tstate_shrink(tstate *s) {
     // We may want to shrink. We do this if we're using <= two shrinks (assuming default
     // growth/shrink multipliers) of our allocated space, assuming that one shrink is
     // greater than or equal to the initial capacity.
-    shrink:
-    half = TET_STATE_OBJS_SHRINK(s->objl);
-    quarter = TET_STATE_OBJS_SHRINK(half);
-    if (half >= TET_STATE_OBJS_LEN && quarter >= s->obji) {
+    tsize half = TET_STATE_OBJS_SHRINK(s->objl);
+    tsize quarter = TET_STATE_OBJS_SHRINK(half);
+    while (half >= TET_STATE_OBJS_LEN && quarter >= s->obji) {
         s->objs = terealloc(s, s->objs, half * sizeof(tobj *));
         s->objl = half;
+        half = TET_STATE_OBJS_SHRINK(s->objl);
+        quarter = TET_STATE_OBJS_SHRINK(half);
     }
 }
 
 
-//   _____ _   ___     __
-//  | ____| \ | \ \   / /
-//  |  _| |  \| |\ \ / /
-//  | |___| |\  | \ V /
-//  |_____|_| \_|  \_/
-//
-
-tenv *tenv_new(tstate *s) {
-    tenv *e = tralloc(s, sizeof(tenv));
-
-    SETMARKTYPE(e, TMARK_ENV);
-    e->state = s;
-    e->prev = NULL;
-    e->vars = NULL;
+tpool *tstate_pool(tstate *s, tsize threads, tsize chunk) {
+    // Replace any existing pool, its workers may be sized differently.
+    if (s->pool) {
+        tpool_del(s->pool);
+        s->pool = NULL;
+    }
 
-    tstate_track(s, (tobj *) e);
-    trforget(s, 1); // e
-    return e;
+    s->pool = tpool_new(threads, chunk);
+    if (!s->pool) {
+        TET_THROWRAW(s, s->memerr);
+    }
+    return s->pool;
 }
 
-void tenv_del(tenv *e) {
-    // TODO: Check if this is correct
-    tstate_untrack(e->state, (tobj *) e);
-    tfree(e);
+tsched *tstate_sched(tstate *s, tsize threads) {
+    // Replace any existing scheduler, abandoning the tasks it hasn't finished.
+    if (s->sched && s->sched->owner == s) {
+        tsched_del(s->sched);
+    }
+    s->sched = NULL;
+
+    s->sched = tsched_new(s, threads);
+    return s->sched;
 }
 
-tsize tenv_mark(tenv *e, tmark m) {
-    if (!e) return 0;
-    if (GETMARK(e) == m) {
-        return 0;
+tsize tstate_pin(tstate *s, tobj *o) {
+    // Reuse a free slot if there is one.
+    if (s->pinfreei) {
+        tsize i = s->pinfree[--s->pinfreei];
+        s->pins[i] = o;
+        return i;
     }
 
-    SETMARK(e, m);
-    tmark c = 0;
-    while (e) {
-        if (e->vars) {
-            c += tval_mark(e->vars, m);
-        }
-        e = e->prev;
-        c++;
+    if (s->pini >= s->pinl) {
+        tsize l = s->pinl ? s->pinl * 2 : TET_STATE_PINS_LEN;
+        s->pinfree = terealloc(s, s->pinfree, l * sizeof(tsize));
+        s->pins = terealloc(s, s->pins, l * sizeof(tobj *));
+        s->pinl = l;
     }
-    return c;
+    s->pins[s->pini] = o;
+    return s->pini++;
 }
 
-tval *tenv_get(tenv *e, tval *k) {
-    tval *p = tenv_getpair(e, k);
-    if (!p) {
-        return tval_err(e->state, "undefined symbol: %s", k->sym);
-    }
-    return p->cdr;
+void tstate_repin(tstate *s, tsize i, tobj *o) {
+    s->pins[i] = o;
 }
 
-tval *tenv_getpair(tenv *e, tval *k) {
-    while (e) {
-        for (tval *c = e->vars; c != NULL; c = c->cdr) {
-            tval *kv = c->car;
-            if (strcmp(kv->car->sym, k->sym) == 0) {
-                return kv;
-            }
-        }
-        e = e->prev;
+void tstate_unpin(tstate *s, tsize i) {
+    // The free stack is as large as the pins array, so this can't overflow.
+    s->pins[i] = NULL;
+    s->pinfree[s->pinfreei++] = i;
+}
+
+// Remember that an object older than the open region, if any, is being written to (see
+// tstate_region_exit). Objects already remembered are flagged like those of the region.
+static inline void tstate_remember(tstate *s, tobj *o) {
+    if (!s->regions || (o->flags & (TOBJ_FLAG_REGION | TOBJ_FLAG_FROZEN | TOBJ_FLAG_STATIC))) {
+        return;
     }
-    return NULL;
+    if (s->rememberedi >= s->rememberedl) {
+        tsize l = s->rememberedl ? s->rememberedl * 2 : TET_STATE_REMEMBERED_LEN;
+        s->remembered = terealloc(s, s->remembered, l * sizeof(tobj *));
+        s->rememberedl = l;
+    }
+    o->flags |= TOBJ_FLAG_REGION;
+    s->remembered[s->rememberedi++] = o;
 }
 
-tval *tenv_set(tenv *e, tval *k, tval *v) {
-    // Find a pair to modify in ANY env.
-    tval *p = tenv_getpair(e, k);
-    if (p) {
-        p->car->cdr = v;
-        return v;
+void tstate_region_enter(tstate *s) {
+    if (s->regions++) {
+        return;
     }
 
-    // Create a new pair locally otherwise.
-    return tenv_put(e, k, v);
+    // The region starts out at the end of objs, and stays there.
+    tstate_sweep(s, 0);
+    s->regioni = s->obji;
 }
 
-tval *tenv_put(tenv *e, tval *k, tval *v) {
+// Marking the objects of a region that are still reachable. Only objects flagged
+// TOBJ_FLAG_REGION are followed, anything else can only reach the region through an
+// object that was remembered.
+typedef struct tregion {
+    tmark m;
+    bool failed; // couldn't allocate, so everything is kept
+
+    tobj **stack;
+    tsize stacki;
+    tsize stackl;
+
+    // Map nodes are marked with TREGION_NODE while we scan, so shared nodes are scanned
+    // once, and then given the state's mark back.
+    tmapnode **nodes;
+    tsize nodei;
+    tsize nodel;
+} tregion;
+
+#define TREGION_NODE ((tmark) 0xFF)
+
+static bool tregion_grow(tregion *r, void **a, tsize *l, tsize size) {
+    tsize nl = *l ? *l * 2 : 256;
+    void *na = trealloc(*a, nl * size);
+    if (!na) {
+        r->failed = true;
+        return false;
+    }
+    *a = na;
+    *l = nl;
+    return true;
+}
 
-    // Overwrite if a pair in this env exists.
-    for (tval *c = e->vars; c != NULL; c = c->cdr) {
-        tval *kv = c->car;
-        if (strcmp(kv->car->sym, k->sym) == 0) {
-            kv->cdr = v;
-            return v;
-        }
+static void tregion_mark(tregion *r, tobj *o) {
+    if (!o || !(o->flags & TOBJ_FLAG_REGION) || GETMARK(o) == r->m) {
+        return;
+    }
+    if (r->stacki >= r->stackl && !tregion_grow(r, (void **) &r->stack, &r->stackl,
+                                                 sizeof(tobj *))) {
+        return;
+    }
+    SETMARK(o, r->m);
+    r->stack[r->stacki++] = o;
+}
+
+static void tregion_mark_map(tregion *r, tmapnode *x) {
+    if (!x || !x->refs || x->mark == TREGION_NODE) {
+        return;
+    }
+    if (r->nodei < r->nodel || tregion_grow(r, (void **) &r->nodes, &r->nodel,
+                                            sizeof(tmapnode *))) {
+        x->mark = TREGION_NODE;
+        r->nodes[r->nodei++] = x;
+    }
+    for (uint32_t i = 0; i < x->n; i++) {
+        tmapentry *e = &x->e[i];
+        if (e->node) {
+            tregion_mark_map(r, e->node);
+        } else {
+            tregion_mark(r, (tobj *) e->key);
+            tregion_mark(r, (tobj *) e->val);
+        }
+    }
+}
+
+static void tregion_scan(tregion *r, tobj *o) {
+    switch (GETMARKTYPE(o)) {
+        case TMARK_ENV: {
+            tenv *e = (tenv *) o;
+            tregion_mark(r, (tobj *) e->vars);
+            tregion_mark(r, (tobj *) e->prev);
+            break;
+        }
+        case TMARK_FRAME: {
+            tframe *f = (tframe *) o;
+            for (tsize i = 0; i < f->obji; i++) {
+                tregion_mark(r, (tobj *) f->objs[i]);
+            }
+            tregion_mark(r, (tobj *) f->ip);
+            tregion_mark(r, (tobj *) f->vp);
+            tregion_mark(r, (tobj *) f->env);
+            tregion_mark(r, (tobj *) f->orig);
+            tregion_mark(r, (tobj *) f->prev);
+            break;
+        }
+        case TMARK_VALUE: {
+            tval *v = (tval *) o;
+            switch (v->type) {
+                case TVAL_SEXPR:
+                case TVAL_QEXPR:
+                    tregion_mark(r, (tobj *) v->car);
+                    tregion_mark(r, (tobj *) v->cdr);
+                    break;
+                case TVAL_ENV:
+                    tregion_mark(r, (tobj *) v->env);
+                    break;
+                case TVAL_FRAME:
+                    tregion_mark(r, (tobj *) v->frame);
+                    break;
+                case TVAL_LAMBDA:
+                    tregion_mark(r, (tobj *) v->pars);
+                    tregion_mark(r, (tobj *) v->body);
+                    break;
+                case TVAL_MAP:
+                    tregion_mark_map(r, v->node);
+                    break;
+                case TVAL_SEQ:
+                    tregion_mark(r, (tobj *) v->seq->fn);
+                    tregion_mark(r, (tobj *) v->seq->src);
+                    break;
+                default:
+                    break;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// A root is marked if it is in the region. Frames are pushed to without being
+// remembered, so an older frame is scanned, along with the frames it returns to.
+static void tregion_root(tregion *r, tobj *o) {
+    if (!o || (o->flags & TOBJ_FLAG_REGION)) {
+        tregion_mark(r, o);
+        return;
+    }
+    if (GETMARKTYPE(o) != TMARK_FRAME) {
+        return;
+    }
+    for (tframe *f = (tframe *) o; f && !(f->flags & TOBJ_FLAG_REGION); f = f->prev) {
+        tregion_scan(r, (tobj *) f);
+        tregion_root(r, (tobj *) f->orig);
+    }
+}
+
+tsize tstate_region_exit(tstate *s, tobj *keep) {
+    if (!s->regions || --s->regions) {
+        return 0;
+    }
+
+    // The objects of the region are unmarked to begin with, with a mark that is neither
+    // the current one nor the one the next collection will use.
+    tregion r = {0};
+    r.m = GETMARK(s);
+    tmark unmarked = (tmark) (r.m + 2) & TOBJ_MARK_VALUE;
+    for (tsize i = s->regioni; i < s->obji; i++) {
+        SETMARK(s->objs[i], unmarked);
+    }
+
+    // Mark what the roots and the remembered objects reach.
+    tregion_root(&r, keep);
+    tregion_root(&r, (tobj *) s->env);
+    tregion_root(&r, (tobj *) s->frame);
+    for (tsize i = 0; i < s->pini; i++) {
+        tregion_root(&r, s->pins[i]);
+    }
+    for (tsize i = 0; i < s->rememberedi; i++) {
+        SETMARK(s->remembered[i], r.m);
+        tregion_scan(&r, s->remembered[i]);
+    }
+    while (r.stacki) {
+        tregion_scan(&r, r.stack[--r.stacki]);
+    }
+    for (tsize i = 0; i < r.nodei; i++) {
+        r.nodes[i]->mark = r.m;
+    }
+    tfree(r.stack);
+    tfree(r.nodes);
+
+    // Free the rest, the survivors are older objects like any other from now on.
+    tsize j = s->regioni;
+    for (tsize i = s->regioni; i < s->obji; i++) {
+        tobj *o = s->objs[i];
+        if (GETMARK(o) == unmarked && !r.failed) {
+            tstate_free(s, o);
+        } else {
+            SETMARK(o, r.m);
+            o->flags &= (tmark) ~TOBJ_FLAG_REGION;
+            s->objs[j++] = o;
+        }
+    }
+    tsize c = s->obji - j;
+    s->obji = j;
+    for (tsize i = 0; i < s->rememberedi; i++) {
+        s->remembered[i]->flags &= (tmark) ~TOBJ_FLAG_REGION;
+    }
+    s->rememberedi = 0;
+    tstate_shrink(s);
+
+    TET_TRACE_EVENT(s, TET_TRACE_GC, TTRACE_SWEEP, s->obji, 0);
+    return c;
+}
+
+tval *tstate_freeze(tstate *s, tval *v) {
+    if (!v || TOBJ_FROZEN(v)) return v;
+
+    tfrozen *z = tfrozen_new(s, v);
+    tstate_hold(s, z);
+    tfrozen_release(z); // Our hold is the only reference we need.
+    return z->root;
+}
+
+void tstate_heapprof(tstate *s, tsize rate) {
+    if (s->heapprof) {
+        theapprof_del(s->heapprof);
+        s->heapprof = NULL;
+    }
+    if (!rate) return;
+
+    theapprof *p = tealloc(s, sizeof(theapprof));
+    p->rate = rate;
+    p->next = rate;
+    p->seed = (uint64_t) (uintptr_t) s | 1;
+    p->sites = NULL;
+    p->sitei = 0;
+    p->sitel = 0;
+    p->objs = NULL;
+    p->obji = 0;
+    p->objl = 0;
+    s->heapprof = p;
+}
+
+void tstate_cpuprof(tstate *s, tsize hz) {
+    if (s->cpuprof) {
+        tcpuprof_del(s->cpuprof);
+        s->cpuprof = NULL;
+    }
+    if (!hz) return;
+
+    tcpuprof *p = tealloc(s, sizeof(tcpuprof));
+    p->hz = hz;
+    p->sites = NULL;
+    p->sitei = 0;
+    p->sitel = 0;
+    if (!tcpuprof_start(p)) {
+        tfree(p);
+        TET_THROW(s, "could not start cpu profile: %s", strerror(errno));
+    }
+    s->cpuprof = p;
+}
+
+void tstate_hold(tstate *s, tfrozen *z) {
+    // States typically hold only a handful of regions, a linear search will do.
+    for (tsize i = 0; i < s->heldi; i++) {
+        if (s->held[i] == z) return;
+    }
+
+    if (s->heldi >= s->heldl) {
+        tsize l = s->heldl ? s->heldl * 2 : 4;
+        s->held = terealloc(s, s->held, l * sizeof(tfrozen *));
+        s->heldl = l;
+    }
+    tfrozen_retain(z);
+    s->held[s->heldi++] = z;
+}
+
+
+//   _____ _   ___     __
+//  | ____| \ | \ \   / /
+//  |  _| |  \| |\ \ / /
+//  | |___| |\  | \ V /
+//  |_____|_| \_|  \_/
+//
+
+// Hash of a name into the bits of the shadowed bitmap of tstate.
+static inline tsize tenv_hash(char *sym) {
+    tsize h = 5381;
+    for (; *sym; sym++) {
+        h = h * 33 + (unsigned char) *sym;
+    }
+    return h % 256;
+}
+
+tenv *tenv_new(tstate *s) {
+    tenv *e = tralloc(s, sizeof(tenv));
+
+    SETMARKTYPE(e, TMARK_ENV);
+    e->state = s;
+    e->prev = NULL;
+    e->root = e;
+    e->vars = NULL;
+
+    tstate_track(s, (tobj *) e);
+    trforget(s, 1); // e
+
+    if (s->heapprof) {
+        theapprof_sample(s, (tobj *) e, sizeof(tenv));
+    }
+    return e;
+}
+
+void tenv_del(tenv *e) {
+    // Symbols may still remember bindings in a global env, and a new one could end up at
+    // the same address.
+    if (!e->prev) {
+        e->state->envver++;
+    }
+
+    // Untracking is left to tstate_gc_obj, since the state may be sweeping.
+    tfree(e);
+}
+
+tsize tenv_mark(tenv *e, tmark m) {
+    // Mark every env up the chain, stopping at the first one we've already seen.
+    tsize c = 0;
+    while (e && GETMARK(e) != m) {
+        SETMARK(e, m);
+        c++;
+        if (e->vars) {
+            c += tval_mark(e->vars, m);
+        }
+        e = e->prev;
+    }
+    return c;
+}
+
+tval *tenv_get(tenv *e, tval *k) {
+    tval *p = tenv_getpair(e, k);
+    if (!p) {
+        return tval_err(e->state, "undefined symbol: %s", k->sym);
+    }
+    return p->cdr;
+}
+
+tval *tenv_lookup(tenv *e, tval *k) {
+    tstate *s = e->state;
+    tsymcache *c = k->cache;
+    if (c && c->env == e->root && c->ver == s->envver) {
+        return c->pair->cdr;
+    }
+
+    // Find the pair ourselves, and the env it is in.
+    tval *p = NULL;
+    tenv *pe = e;
+    while (pe) {
+        for (tval *l = pe->vars; l != NULL && !p; l = l->cdr) {
+            if (strcmp(l->car->car->sym, k->sym) == 0) {
+                p = l->car;
+            }
+        }
+        if (p) break;
+        pe = pe->prev;
+    }
+    if (!p) {
+        return tval_err(s, "undefined symbol: %s", k->sym);
+    }
+
+    // Only a binding in the outermost env that no inner env may shadow can be
+    // remembered. Frozen symbols are never written to, so they don't remember anything.
+    tsize h = tenv_hash(k->sym);
+    if (pe == e->root && !pe->prev && !(s->shadowed[h / 64] & (1ull << (h % 64))) &&
+        !TOBJ_FROZEN(k)) {
+        if (!c) {
+            // Best effort, without memory we just don't remember.
+            c = talloc(sizeof(tsymcache));
+            k->cache = c;
+        }
+        if (c) {
+            c->env = pe;
+            c->ver = s->envver;
+            c->pair = p;
+        }
+    }
+    return p->cdr;
+}
+
+tval *tenv_getpair(tenv *e, tval *k) {
+    while (e) {
+        for (tval *c = e->vars; c != NULL; c = c->cdr) {
+            tval *kv = c->car;
+            if (strcmp(kv->car->sym, k->sym) == 0) {
+                return kv;
+            }
+        }
+        e = e->prev;
+    }
+    return NULL;
+}
+
+tval *tenv_set(tenv *e, tval *k, tval *v) {
+    // Find a pair to modify in ANY env.
+    tval *p = tenv_getpair(e, k);
+    if (p) {
+        tstate_remember(e->state, (tobj *) p);
+        p->cdr = v;
+        return v;
+    }
+
+    // Create a new pair locally otherwise.
+    return tenv_put(e, k, v);
+}
+
+void tenv_copy(tenv *e, tenv *from) {
+    // Copy the chain outermost first, so that inner definitions shadow outer ones just
+    // like they do in the original.
+    tsize depth = 0;
+    for (tenv *p = from; p; p = p->prev) depth++;
+    for (tsize d = depth; d > 0; d--) {
+        tenv *p = from;
+        for (tsize i = 1; i < d; i++) p = p->prev;
+        for (tval *c = p->vars; c != NULL; c = c->cdr) {
+            tenv_put(e, tval_copy(e->state, c->car->car), tval_copy(e->state, c->car->cdr));
+        }
+    }
+}
+
+tval *tenv_put(tenv *e, tval *k, tval *v) {
+
+    // Overwrite if a pair in this env exists.
+    for (tval *c = e->vars; c != NULL; c = c->cdr) {
+        tval *kv = c->car;
+        if (strcmp(kv->car->sym, k->sym) == 0) {
+            tstate_remember(e->state, (tobj *) kv);
+            kv->cdr = v;
+            return v;
+        }
+    }
+
+    // A name bound in an inner env may shadow what symbols remember of the outer ones.
+    tstate *s = e->state;
+    tsize h = tenv_hash(k->sym);
+    if (e->prev && !(s->shadowed[h / 64] & (1ull << (h % 64)))) {
+        s->shadowed[h / 64] |= 1ull << (h % 64);
+        s->envver++;
     }
 
     // Otherwise, prepend a pair.
     tval *kv = tval_sexpr(e->state, k, v);
     tval *p = tval_sexpr(e->state, kv, e->vars);
+    tstate_remember(s, (tobj *) e);
     e->vars = p;
 
     return v;
@@ -388,11 +1485,16 @@ tframe *tframe_new(tenv *e) {
 
     tstate_track(e->state, (tobj *) f);
     trforget(e->state, 2); // f, f->stack
+
+    if (e->state->heapprof) {
+        theapprof_sample(e->state, (tobj *) f, sizeof(tframe) + f->objl * sizeof(tval *));
+    }
     return f;
 }
 
 void tframe_del(tframe *f) {
-    tstate_untrack(f->env->state, (tobj *) f);
+    // Untracking is left to tstate_gc_obj: f->env may already have been swept, so we
+    // cannot reach the state through it.
     tfree(f->objs);
     tfree(f);
 }
@@ -409,10 +1511,14 @@ tsize tframe_mark(tframe *f, tmark m) {
         c++;
         SETMARK(f, m);
 
-        // Mark all values stored in this stack frame.
+        // Mark all values stored in this stack frame, the code it is evaluating and
+        // the env it is evaluating it in.
         for (tsize i = 0; i < f->obji; i++) {
             c += tval_mark(f->objs[i], m);
         }
+        c += tval_mark(f->ip, m);
+        c += tval_mark(f->vp, m);
+        c += tenv_mark(f->env, m);
 
         // If we have an initiating stack frame, mark that too.
         if (f->orig) {
@@ -511,23 +1617,57 @@ tval *tval_new(tstate *s, tvaltype t) {
     tstate_track(s, (tobj *) v);
 
     trforget(s, 1); // v
+
+    if (s->heapprof) {
+        theapprof_sample(s, (tobj *) v, sizeof(tval));
+    }
     return v;
 }
 
 void tval_del(tstate *s, tval *v) {
-    tstate_untrack(s, (tobj *) v);
     switch (v->type) {
         case TVAL_STRING:
             tfree(v->str);
             break;
         case TVAL_ERROR:
-            // Don't delete the memory error! TODO Determine if this check is necessary
-            // if (v == &tet_memerr) return;
+            // The memory error (s->memerr) is never tracked, so it never ends up here.
             tfree(v->err);
             break;
         case TVAL_SYMBOL:
             tfree(v->sym);
+            tfree(v->cache);
+            break;
+        case TVAL_TASK:
+            ttask_release(v->task);
+            break;
+        case TVAL_MAILBOX:
+            tmailbox_release(v->mailbox);
+            break;
+        case TVAL_BIGNUM:
+            tfree(v->big);
+            break;
+        case TVAL_VECTOR:
+            tfree(v->vec);
+            break;
+        case TVAL_MAP:
+            tmapnode_release(v->node);
+            break;
+        case TVAL_SEQ:
+            tfree(v->seq);
+            break;
+        case TVAL_BYTES:
+            if (v->bytes) {
+                tbuf_release(v->bytes->buf);
+                tfree(v->bytes);
+            }
+            break;
+#if TET_JIT
+        case TVAL_LAMBDA:
+            if (s->jitted && (v->flags & TOBJ_FLAG_CALLED)) {
+                tjit_forget(s->jitted, v);
+            }
             break;
+#endif
         default:
             break;
     }
@@ -536,6 +1676,11 @@ void tval_del(tstate *s, tval *v) {
 
 tsize tval_mark(tval *v, tmark m) {
     if (!v) return 0;
+    if (v->flags & (TOBJ_FLAG_FROZEN | TOBJ_FLAG_STATIC)) {
+        // Frozen values are immutable and not ours to collect, static ones are never
+        // garbage.
+        return 0;
+    }
     if (GETMARK(v) == m) {
         return 0;
     }
@@ -551,6 +1696,10 @@ tsize tval_mark(tval *v, tmark m) {
             return 1 + tframe_mark(v->frame, m);
         case TVAL_LAMBDA:
             return 1 + tval_mark(v->pars, m) + tval_mark(v->body, m);
+        case TVAL_MAP:
+            return 1 + tmapnode_mark(v->node, m);
+        case TVAL_SEQ:
+            return 1 + tval_mark(v->seq->fn, m) + tval_mark(v->seq->src, m);
         default:
             return 1;
     }
@@ -562,18 +1711,23 @@ tval *tval_err(tstate *s, char *fmt, ...) {
     // Format the string.
     va_list va;
     va_start(va, fmt);
-    vsnprintf(tet_strbuf, TET_STRBUF_LEN - 1, fmt, va);
+    vsnprintf(s->strbuf, TET_STRBUF_LEN - 1, fmt, va);
     va_end(va);
 
     // Copy the formatted error string.
-    char *err = tealloc(s, strlen(tet_strbuf) + 1);
-    strcpy(err, tet_strbuf);
+    char *err = tealloc(s, strlen(s->strbuf) + 1);
+    strcpy(err, s->strbuf);
     v->err = err;
 
     return v;
 }
 
 tval *tval_num(tstate *s, tnum num) {
+    // Small numbers are shared, numbers are never changed after all.
+    if (num >= TET_STATE_NUMS_MIN && num < TET_STATE_NUMS_MAX && s->nums) {
+        return &s->nums[num - TET_STATE_NUMS_MIN];
+    }
+
     tval *v = tval_new(s, TVAL_NUMBER);
     v->num = num;
     return v;
@@ -615,6 +1769,17 @@ tval *tval_builtin(tstate *s, tbuiltin builtin) {
     return v;
 }
 
+tval *tval_pure(tstate *s, tbuiltin builtin) {
+    tval *v = tval_builtin(s, builtin);
+    v->flags |= TOBJ_FLAG_PURE;
+    return v;
+}
+
+tval *tval_fast(tval *v, const tfast *fast) {
+    v->fast = fast;
+    return v;
+}
+
 tval *tval_lambda(tstate *s, tval *pars, tval *body) {
     tval *v = tval_new(s, TVAL_LAMBDA);
     v->pars = pars;
@@ -622,93 +1787,658 @@ tval *tval_lambda(tstate *s, tval *pars, tval *body) {
     return v;
 }
 
-void tval_print(tval *v) {
-    if (!v) {
-        printf("nil");
-        return;
+tval *tval_task(tstate *s, ttask *task) {
+    tval *v = tval_new(s, TVAL_TASK);
+    ttask_retain(task);
+    v->task = task;
+    return v;
+}
+
+tval *tval_mailbox(tstate *s, tmailbox *mailbox) {
+    tval *v = tval_new(s, TVAL_MAILBOX);
+    tmailbox_retain(mailbox);
+    v->mailbox = mailbox;
+    return v;
+}
+
+// Copy v into s. Frozen values are shared rather than copied, unless they belong to
+// region z, which allows copying values out of a region that is about to go away.
+static tval *tval_copy_from(tstate *s, tval *v, tfrozen *z) {
+    if (!v) return NULL;
+
+    // Frozen values can be shared as they are, we just need to keep them alive.
+    if (TOBJ_FROZEN(v) && tfrozen_of(v) != z) {
+        tstate_hold(s, tfrozen_of(v));
+        return v;
     }
 
+    tval *r;
     switch (v->type) {
-        case TVAL_SYMBOL:
         case TVAL_ERROR:
-            printf("%s", v->str);
-            break;
-        case TVAL_STRING:
-            printf("\"%s\"", v->str);
-            break;
+            return tval_err(s, "%s", v->err);
         case TVAL_NUMBER:
-            printf("%u", v->num);
-            break;
-        case TVAL_SEXPR:
-            printf("(");
-            while (v) {
-                tval_print(v->car);
-                v = v->cdr;
-                if (v) printf(" ");
+            return tval_num(s, v->num);
+        case TVAL_SYMBOL:
+            return tval_sym(s, v->sym);
+        case TVAL_STRING:
+            return tval_str(s, v->str);
+        case TVAL_BUILTIN:
+            r = tval_builtin(s, v->builtin);
+            r->fast = v->fast;
+            r->flags |= v->flags & TOBJ_FLAG_PURE;
+            return r;
+        case TVAL_TASK:
+            return tval_task(s, v->task);
+        case TVAL_MAILBOX:
+            return tval_mailbox(s, v->mailbox);
+        case TVAL_BIGNUM:
+            r = tval_bignum(s, NULL);
+            r->big = tbig_copy(s, v->big);
+            return r;
+        case TVAL_VECTOR:
+            r = tval_vector(s, NULL);
+            r->vec = tvec_new(s, v->vec->n);
+            memcpy(r->vec->d, v->vec->d, v->vec->n * sizeof(tnum));
+            return r;
+        case TVAL_MAP:
+            // Nodes are only shared within a state, so we copy them all.
+            r = tval_map(s);
+            r->node = tmapnode_copy_from(s, v->node, z);
+            r->count = v->count;
+            return r;
+        case TVAL_SEQ:
+            r = tval_seq(s, v->seq->kind);
+            *r->seq = *v->seq;
+            r->seq->fn = tval_copy_from(s, v->seq->fn, z);
+            r->seq->src = tval_copy_from(s, v->seq->src, z);
+            return r;
+        case TVAL_BYTES:
+            // Buffers may be shared between states, but bytes in a frozen region are
+            // only as safe to use as their region is held, so we copy those.
+            if (!v->bytes->buf) {
+                return tval_bytes(s, v->bytes->ptr, v->bytes->len);
             }
-            printf(")");
-            break;
+            return tbytes_new(s, v->bytes->buf, v->bytes->ptr, v->bytes->len);
+        case TVAL_LAMBDA:
+            r = tval_lambda(s, NULL, NULL);
+            r->pars = tval_copy_from(s, v->pars, z);
+            r->body = tval_copy_from(s, v->body, z);
+            return r;
+        case TVAL_SEXPR:
         case TVAL_QEXPR:
-            printf("{");
-            while (v) {
-                tval_print(v->car);
+            // Recurse into the cars, but walk down the cdrs so long lists don't
+            // exhaust the C stack.
+            r = tval_new(s, v->type);
+            tval *c = r;
+            while (1) {
+                c->car = tval_copy_from(s, v->car, z);
                 v = v->cdr;
-                if (v) printf(" ");
+                if (!v) break;
+                c->cdr = tval_new(s, v->type);
+                c = c->cdr;
             }
-            printf("}");
-            break;
-        case TVAL_BUILTIN:
-            printf("<builtin>");
-            break;
-        case TVAL_LAMBDA:
-            printf("<lambda ");
-            tval_print(v->pars);
-            printf(" ");
-            tval_print(v->body);
-            printf(">");
-            break;
-        default:
-            break;
+            return r;
+        default: TET_THROW(s, "cannot copy value of type %s", tvaltype_print(v->type));
     }
 }
 
-//   _______     ___    _
-//  | ____\ \   / / \  | |
-//  |  _|  \ \ / / _ \ | |
-//  | |___  \ V / ___ \| |___
-//  |_____|  \_/_/   \_\_____|
-//
+tval *tval_bignum(tstate *s, tbig *big) {
+    tval *v = tval_new(s, TVAL_BIGNUM);
+    v->big = big;
+    return v;
+}
 
-tval *tet_eval(tstate *s, tframe *f) {
+tval *tval_vector(tstate *s, tvec *vec) {
+    tval *v = tval_new(s, TVAL_VECTOR);
+    v->vec = vec;
+    return v;
+}
 
-    // Catch any errors that may arise.
-    TET_CATCH(s, err, {
+tval *tval_copy(tstate *s, tval *v) {
+    return tval_copy_from(s, v, NULL);
+}
 
-        printf("caught %p\n", err);
+//   ____  ____  ___ _   _ _____
+//  |  _ \|  _ \|_ _| \ | |_   _|
+//  | |_) | |_) || ||  \| | | |
+//  |  __/|  _ < | || |\  | | |
+//  |_|   |_| \_\___|_| \_| |_|
+//
 
-        // Since we've left half-way through, we want to clean up our mess first.
-        // The TET_CATCH macro already handles 'dangling memory' for us. Garbage collect!
-        //tstate_gc(s);
+// A list being printed: the cell we're at, and where Brent's cycle detection is at.
+struct tprintframe {
+    tval *head;
+    tval *cur;
+    tval *tort; // stays put for 'pow' cells, then jumps to 'cur' and 'pow' doubles
+    tsize lam;
+    tsize pow;
+};
 
-        // TET_THROW always throws tvals of type TVAL_ERROR. We just return those.
-        return err;
+void tprinter_init(tprinter *p, tsink sink, void *ctx) {
+    p->sink = sink;
+    p->ctx = ctx;
+    p->buf = NULL;
+    p->len = 0;
+    p->cap = 0;
+    p->mark = 0;
+    p->iovi = 0;
+    p->failed = false;
+    p->open = NULL;
+    p->openi = 0;
+    p->openl = 0;
+    p->stack = NULL;
+    p->stacki = 0;
+    p->stackl = 0;
+}
+
+void tprinter_del(tprinter *p) {
+    tfree(p->buf);
+    tfree(p->open);
+    tfree(p->stack);
+}
+
+static void tprinter_piece(tprinter *p, const char *data, tsize len) {
+    p->iov[p->iovi].iov_base = (void *) data;
+    p->iov[p->iovi].iov_len = len;
+    p->iovi++;
+}
+
+// Ends the run of bytes buffered since the last piece with a piece of its own.
+static void tprinter_cut(tprinter *p) {
+    if (p->len > p->mark) {
+        tprinter_piece(p, p->buf + p->mark, p->len - p->mark);
+        p->mark = p->len;
+    }
+}
+
+bool tprinter_flush(tprinter *p) {
+    if (p->sink) {
+        tprinter_cut(p);
+        if (p->iovi && !p->failed && !p->sink(p->ctx, p->iov, (int) p->iovi)) {
+            p->failed = true;
+        }
+        p->iovi = 0;
+        p->len = 0;
+        p->mark = 0;
+    }
+    return !p->failed;
+}
+
+// Makes room for 'len' more bytes and a terminating zero, flushing the buffer if it is
+// as large as it gets (or there are pieces in it, which growing it would move).
+static bool tprinter_room(tprinter *p, tsize len) {
+    if (p->failed) {
+        return false;
+    }
+    if (p->sink && (p->mark || p->cap >= TET_PRINT_BUF)) {
+        if (!tprinter_flush(p)) {
+            return false;
+        }
+        if (len + 1 <= p->cap) {
+            return true;
+        }
+    }
+
+    tsize cap = p->cap ? p->cap : 256;
+    while (cap < p->len + len + 1) {
+        cap *= 2;
+    }
+    char *b = trealloc(p->buf, cap);
+    if (!b) {
+        p->failed = true;
+        return false;
+    }
+    p->buf = b;
+    p->cap = cap;
+    return true;
+}
+
+void tprinter_put(tprinter *p, const char *data, tsize len) {
+    if (p->sink && len >= TET_PRINT_DIRECT) {
+        // What was buffered before it and it, leaving room for what is buffered after.
+        if (p->iovi + 3 > TET_PRINT_IOV) {
+            tprinter_flush(p);
+        }
+        tprinter_cut(p);
+        tprinter_piece(p, data, len);
+        return;
+    }
+    if (p->len + len + 1 > p->cap && !tprinter_room(p, len)) {
+        return;
+    }
+    memcpy(p->buf + p->len, data, len);
+    p->len += len;
+}
+
+static inline void tprinter_char(tprinter *p, char c) {
+    if (p->len + 2 > p->cap && !tprinter_room(p, 1)) {
+        return;
+    }
+    p->buf[p->len++] = c;
+}
+
+static void tprinter_str(tprinter *p, const char *str) {
+    tprinter_put(p, str, strlen(str));
+}
+
+static void tprinter_num(tprinter *p, tnum n) {
+    char d[24];
+    char *e = d + sizeof(d);
+    char *c = e;
+    uint64_t u = n < 0 ? -(uint64_t) n : (uint64_t) n;
+    do {
+        *--c = (char) ('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (n < 0) {
+        *--c = '-';
+    }
+    tprinter_put(p, c, (tsize) (e - c));
+}
+
+static tsize tprinter_slot(tprinter *p, tval *v) {
+    return ((uintptr_t) v >> 4) * 2654435761u & (p->openl - 1);
+}
+
+// Whether 'v' wasn't being printed already, in which case it is now (until we leave it).
+// Values that contain themselves are printed up to where they do.
+static bool tprinter_enter(tprinter *p, tval *v) {
+    // Grow (and rehash) once the set is half full.
+    if ((p->openi + 1) * 2 > p->openl) {
+        tsize l = p->openl ? p->openl * 2 : 64;
+        tval **open = talloc(l * sizeof(tval *));
+        if (!open) {
+            p->failed = true;
+            return false;
+        }
+        memset(open, 0, l * sizeof(tval *));
+        tval **old = p->open;
+        tsize oldl = p->openl;
+        p->open = open;
+        p->openl = l;
+        for (tsize i = 0; i < oldl; i++) {
+            if (!old[i]) continue;
+            tsize j = tprinter_slot(p, old[i]);
+            while (open[j]) j = (j + 1) & (l - 1);
+            open[j] = old[i];
+        }
+        tfree(old);
+    }
+
+    tsize m = p->openl - 1;
+    tsize i = tprinter_slot(p, v);
+    for (; p->open[i]; i = (i + 1) & m) {
+        if (p->open[i] == v) return false;
+    }
+    p->open[i] = v;
+    p->openi++;
+    return true;
+}
+
+static void tprinter_leave(tprinter *p, tval *v) {
+    tsize m = p->openl - 1;
+    tsize i = tprinter_slot(p, v);
+    while (p->open[i] != v) {
+        i = (i + 1) & m;
+    }
+
+    // Close the hole by moving up the entries after it that may go there, which are
+    // those whose slot isn't in between.
+    for (tsize j = (i + 1) & m; p->open[j]; j = (j + 1) & m) {
+        tsize k = tprinter_slot(p, p->open[j]);
+        if (j > i ? (k <= i || k > j) : (k <= i && k > j)) {
+            p->open[i] = p->open[j];
+            i = j;
+        }
+    }
+    p->open[i] = NULL;
+    p->openi--;
+}
+
+static void tprinter_any(tprinter *p, tval *v);
+
+// Everything but the lists that have elements, which tprinter_any goes through itself.
+static void tprinter_atom(tprinter *p, tval *v) {
+    if (!v) {
+        tprinter_put(p, "nil", 3);
+        return;
+    }
+
+    switch (v->type) {
+        case TVAL_SYMBOL:
+        case TVAL_ERROR:
+            tprinter_str(p, v->str);
+            break;
+        case TVAL_STRING:
+            tprinter_char(p, '"');
+            tprinter_str(p, v->str);
+            tprinter_char(p, '"');
+            break;
+        case TVAL_NUMBER:
+            tprinter_num(p, v->num);
+            break;
+        case TVAL_BIGNUM:
+            tbig_print(p, v->big);
+            break;
+        case TVAL_VECTOR:
+            tprinter_char(p, '[');
+            for (tsize i = 0; i < v->vec->n; i++) {
+                if (i) tprinter_char(p, ' ');
+                tprinter_num(p, v->vec->d[i]);
+            }
+            tprinter_char(p, ']');
+            break;
+        case TVAL_MAP: {
+            if (!tprinter_enter(p, v)) {
+                tprinter_put(p, "...", 3);
+                break;
+            }
+            bool first = true;
+            tprinter_put(p, "#{", 2);
+            tmapnode_print(p, v->node, &first);
+            tprinter_char(p, '}');
+            tprinter_leave(p, v);
+            break;
+        }
+        case TVAL_SEQ:
+            tprinter_put(p, "<seq>", 5);
+            break;
+        case TVAL_BYTES:
+            tprinter_put(p, "#b\"", 3);
+            tprinter_put(p, v->bytes->ptr, v->bytes->len);
+            tprinter_char(p, '"');
+            break;
+        case TVAL_SEXPR:
+            tprinter_put(p, "()", 2);
+            break;
+        case TVAL_QEXPR:
+            tprinter_put(p, "{}", 2);
+            break;
+        case TVAL_BUILTIN:
+            tprinter_put(p, "<builtin>", 9);
+            break;
+        case TVAL_TASK:
+            tprinter_put(p, "<task>", 6);
+            break;
+        case TVAL_MAILBOX:
+            tprinter_put(p, "<mailbox>", 9);
+            break;
+        case TVAL_LAMBDA:
+            if (!tprinter_enter(p, v)) {
+                tprinter_put(p, "...", 3);
+                break;
+            }
+            tprinter_put(p, "<lambda ", 8);
+            tprinter_any(p, v->pars);
+            tprinter_char(p, ' ');
+            tprinter_any(p, v->body);
+            tprinter_char(p, '>');
+            tprinter_leave(p, v);
+            break;
+        default:
+            break;
+    }
+}
+
+// Lists are gone through, rather than recursed into: the lists being printed are on the
+// printer's stack, of which those above 'base' are this call's.
+static void tprinter_any(tprinter *p, tval *v) {
+    tsize base = p->stacki;
+    for (;;) {
+        bool list = v && (v->type == TVAL_SEXPR || v->type == TVAL_QEXPR) && (v->car || v->cdr);
+        if (!list) {
+            tprinter_atom(p, v);
+        } else if (!tprinter_enter(p, v)) {
+            tprinter_put(p, "...", 3);
+        } else {
+            if (p->stacki == p->stackl) {
+                tsize l = p->stackl ? p->stackl * 2 : 16;
+                struct tprintframe *stack = trealloc(p->stack, l * sizeof(*stack));
+                if (!stack) {
+                    p->failed = true;
+                    tprinter_leave(p, v);
+                    return;
+                }
+                p->stack = stack;
+                p->stackl = l;
+            }
+            struct tprintframe *fr = &p->stack[p->stacki++];
+            fr->head = v;
+            fr->cur = v;
+            fr->tort = v;
+            fr->lam = 0;
+            fr->pow = 1;
+            tprinter_char(p, v->type == TVAL_SEXPR ? '(' : '{');
+            v = v->car;
+            continue;
+        }
+
+        // On to the next element of the innermost list, closing the lists that end.
+        for (;;) {
+            if (p->stacki == base) {
+                return;
+            }
+            struct tprintframe *fr = &p->stack[p->stacki - 1];
+            tval *next = fr->cur->cdr;
+            if (next == fr->tort) {
+                tprinter_put(p, " ...", 4);
+                next = NULL;
+            } else if (++fr->lam == fr->pow) {
+                fr->tort = next;
+                fr->pow *= 2;
+                fr->lam = 0;
+            }
+            if (next) {
+                fr->cur = next;
+                tprinter_char(p, ' ');
+                v = next->car;
+                break;
+            }
+            tprinter_char(p, fr->head->type == TVAL_SEXPR ? ')' : '}');
+            tprinter_leave(p, fr->head);
+            p->stacki--;
+        }
+    }
+}
+
+void tprinter_val(tprinter *p, tval *v) {
+    tprinter_any(p, v);
+    if (p->buf) {
+        p->buf[p->len] = '\0';
+    }
+}
+
+bool tsink_fd(void *ctx, const struct iovec *iov, int n) {
+    int fd = (int) (intptr_t) ctx;
+    struct iovec rest[TET_PRINT_IOV];
+    memcpy(rest, iov, (size_t) n * sizeof(struct iovec));
+
+    // writev may write less than all, in which case we go on from where it stopped.
+    int i = 0;
+    while (i < n) {
+        ssize_t l = writev(fd, rest + i, n - i);
+        if (l < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return false;
+        }
+        size_t u = (size_t) l;
+        while (i < n && u >= rest[i].iov_len) {
+            u -= rest[i].iov_len;
+            i++;
+        }
+        if (i < n) {
+            rest[i].iov_base = (char *) rest[i].iov_base + u;
+            rest[i].iov_len -= u;
+        }
+    }
+    return true;
+}
+
+bool tsink_file(void *ctx, const struct iovec *iov, int n) {
+    FILE *f = ctx;
+    for (int i = 0; i < n; i++) {
+        if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, f) != iov[i].iov_len) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void tval_print(tval *v) {
+    tprinter p;
+    tprinter_init(&p, tsink_file, stdout);
+    tprinter_val(&p, v);
+    tprinter_flush(&p);
+    tprinter_del(&p);
+}
+
+//   _______     ___    _
+//  | ____\ \   / / \  | |
+//  |  _|  \ \ / / _ \ | |
+//  | |___  \ V / ___ \| |___
+//  |_____|  \_/_/   \_\_____|
+//
+
+tval *tet_eval(tstate *s, tframe *f) {
+    // Without a scheduler to switch to, there is nothing better to do when the chain
+    // yields than to resume it right away.
+    tframe *cur = f;
+    tval *err = NULL;
+    while (cur && !err) {
+        err = tet_run(s, f, &cur, 0);
+    }
+    return err;
+}
+
+// Forget the frame tet_run was at as it returns, charging it the time since we last
+// looked if we're profiling. (The time before it started was charged to 'outer'.) A
+// run that finished has no frame left, so its last steps are charged to 'outer' too.
+// The run's nesting depth is dropped back to 'depth' as well.
+static inline void tet_leave(tstate *s, tframe **outer, tsize depth) {
+    if (s->cpuprof) {
+        if (!*s->running) {
+            s->running = outer;
+        }
+        tcpuprof_tick(s);
+    }
+    s->running = outer;
+    s->depth = depth;
+}
+
+static inline targ tet_unbox(tval *v) {
+    return v->type == TVAL_NUMBER ? (targ) {.num = v->num} : (targ) {.val = v};
+}
+
+// Call the fast path of a builtin if f has the arguments it declared, leaving the result
+// on the stack of f like a builtin returning a single value would.
+static inline bool tet_fastcall(tstate *s, tframe *f, const tfast *fast) {
+    if (f->obji != fast->arity + 1) {
+        return false;
+    }
+
+    // Check every argument once, from the last, and unbox it.
+    tval **v = f->objs + 1;
+    targ a = {0}, b = {0};
+    switch (fast->arity) {
+        case 2:
+            if (!v[1] || v[1]->type != fast->args[1]) return false;
+            b = tet_unbox(v[1]);
+            // fallthrough
+        case 1:
+            if (!v[0] || v[0]->type != fast->args[0]) return false;
+            a = tet_unbox(v[0]);
+            // fallthrough
+        default:
+            break;
+    }
+
+    // The result takes the place of the first argument, which there is always room for.
+    targ r;
+    if (!fast->fn(s, a, b, &r)) {
+        return false;
+    }
+    f->objs[1] = fast->ret == TVAL_NUMBER ? tval_num(s, r.num) : r.val;
+    f->obji = 2;
+    return true;
+}
+
+tval *tet_run(tstate *s, tframe *root, tframe **cur, tsize steps) {
+
+    // Values returned from the outermost frame end up on the root frame's stack, even
+    // if the outermost frame was substituted by a lambda invocation along the way.
+    tframe *f = *cur;
+
+    // Let the profilers find the frame we are at. Builtins may run frames of their own
+    // (see tet_eval), so we put back whatever was running before whenever we return.
+    tframe **outer = s->running;
+    if (s->cpuprof) {
+        tcpuprof_tick(s);
+    }
+    s->running = &f;
+
+    // Builtins running frames of their own nest runs one in another (see tet_can_yield).
+    tsize depth = s->depth++;
+
+    // Number of steps left before we suspend. Without a limit we start at the largest
+    // value, which won't run out any time soon. (The limit is read through a volatile so
+    // that the argument isn't kept across the handler below.)
+    volatile tsize limit = steps;
+    tsize left = limit ? limit : (tsize) -1;
+
+    // While profiling we stop every so often to see if a sample is due, keeping the
+    // steps we have left after that in 'rest'.
+    tsize rest = 0;
+    if (s->cpuprof && left > TET_CPUPROF_STEPS) {
+        rest = left - TET_CPUPROF_STEPS;
+        left = TET_CPUPROF_STEPS;
+    }
+
+    // Catch any errors that may arise.
+    TET_CATCH(s, err, {
+
+        TET_TRACE_EVENT(s, TET_TRACE_ERROR, TTRACE_CATCH, 0, err);
+
+        // Since we've left half-way through, we want to clean up our mess first.
+        // The TET_CATCH macro already handles 'dangling memory' for us. Garbage collect!
+        //tstate_gc(s);
+
+        // TET_THROW always throws tvals of type TVAL_ERROR. We just return those.
+        tet_leave(s, outer, depth);
+        return err;
     });
 
     // Predeclare some intermediary variables. Nothing persistent.
     tenv *ne;
     tframe *nf;
-    tval *nvr;
-    tval *nvc;
 
     // Keep going at the current stack until it's completely unwound.
     while (f) {
 
         // Evaluate all values in this instruction.
         while (f->vp) {
+            // Suspend once we've used up our steps. Everything we need to continue is
+            // in the frames, so all we need to remember is where we were. While
+            // profiling, running out may just mean it's time to look for a sample.
+            if (!--left) {
+                if (rest) {
+                    tcpuprof_tick(s);
+                    left = rest > TET_CPUPROF_STEPS ? TET_CPUPROF_STEPS : rest;
+                    rest -= left;
+                } else {
+                    *cur = f;
+                    tet_leave(s, outer, depth);
+                    TET_UNCATCH(s);
+                    return NULL;
+                }
+            }
+
             tval *v = f->vp->car;
-            printf("evaluating: ");
-            tval_print(v);
-            printf("\n");
+            TET_TRACE_EVENT(s, TET_TRACE_EVAL, TTRACE_EVAL, v ? v->type : 0, v);
 
             // Throw an error if the SEXPR is malformed.
             if (!v) {
@@ -720,9 +2450,16 @@ tval *tet_eval(tstate *s, tframe *f) {
                 case TVAL_ERROR:
                     // If we somehow encounter an ERROR object, throw all protocol out the
                     // window and straight up return it. TODO Clean error handling
+                    tet_leave(s, outer, depth);
+                    TET_UNCATCH(s);
                     return v;
 
                 case TVAL_NUMBER:
+                case TVAL_BIGNUM:
+                case TVAL_VECTOR:
+                case TVAL_MAP:
+                case TVAL_SEQ:
+                case TVAL_BYTES:
                 case TVAL_STRING:
                 case TVAL_BUILTIN:
                 case TVAL_LAMBDA:
@@ -732,7 +2469,7 @@ tval *tet_eval(tstate *s, tframe *f) {
 
                 case TVAL_SYMBOL:
                     // Symbols are to be resolved in the current environment.
-                    tframe_push(f, tenv_get(f->env, v));
+                    tframe_push(f, tenv_lookup(f->env, v));
                     break;
 
                 case TVAL_SEXPR:
@@ -754,16 +2491,8 @@ tval *tet_eval(tstate *s, tframe *f) {
                     // the contents, since we don't care (it's quoted!). We push the new
                     // SEXPR on the value stack.
 
-                    // Loop over the QEXPR converting every part to SEXPR.
-                    nvr = tval_sexpr(s, v->car, NULL);
-                    nvc = nvr;
-                    for (tval *c = v->cdr; c != NULL; c = c->cdr) {
-                        nvc->cdr = tval_sexpr(s, c->car, NULL);
-                        nvc = nvc->cdr;
-                    }
-
                     // Push it on the stack et voila!
-                    tframe_push(f, nvr);
+                    tframe_push(f, tet_unquote(s, v));
                     break;
 
                 default: TET_THROW(s, "illegal type: %u", v->type);
@@ -782,17 +2511,32 @@ tval *tet_eval(tstate *s, tframe *f) {
         // list to the callee.
         if (!fn) {
             if (!f->prev) {
-                f->objs[0] = tval_sexpr(s, NULL, NULL);
-                f->obji = 1;
+                root->obji = 0;
+                tet_pushsexpr(root, NULL, NULL);
             } else {
                 tet_pushsexpr(f->prev, NULL, NULL);
             }
+            f = f->prev;
             continue;
         }
 
+        TET_TRACE_EVENT(s, TET_TRACE_CALL, TTRACE_CALL, f->obji - 1, fn);
+
         if (fn->type == TVAL_BUILTIN) {
-            // Fetch and invoke the builtin.
-            tsize c = fn->builtin(f);
+            // Fetch and invoke the builtin, through its fast path if it has a usable one.
+            tsize c = fn->fast && tet_fastcall(s, f, fn->fast) ? 1 : fn->builtin(f);
+
+            // The builtin may have asked us to suspend, in which case we invoke it again
+            // (with the same arguments) when we are resumed.
+            if (s->yield) {
+                s->yield = false;
+                f->flags |= TOBJ_FLAG_YIELDED;
+                *cur = f;
+                tet_leave(s, outer, depth);
+                TET_UNCATCH(s);
+                return NULL;
+            }
+            f->flags &= ~TOBJ_FLAG_YIELDED;
 
             // Check if there actually are 'c' values to return.
             if (f->obji < c) {
@@ -804,13 +2548,20 @@ tval *tet_eval(tstate *s, tframe *f) {
             if (c) {
                 if (!f->prev) {
                     // If there's no previous frame to push the return values on, then we
-                    // will just use the current frame instead. We do this by moving the
-                    // returned values to the front of the stack, overwriting the
+                    // will just use the root frame instead. We do this by moving the
+                    // returned values to the front of its stack, overwriting the
                     // function and its arguments.
-                    for (tsize i = 0; i < c; i++) {
-                        f->objs[i] = f->objs[f->obji - c + i];
+                    if (f == root) {
+                        for (tsize i = 0; i < c; i++) {
+                            f->objs[i] = f->objs[f->obji - c + i];
+                        }
+                        f->obji = c;
+                    } else {
+                        root->obji = 0;
+                        for (tsize i = f->obji - c; i < f->obji; i++) {
+                            tframe_push(root, f->objs[i]);
+                        }
                     }
-                    f->obji = c;
                 } else {
                     // If there *is* a previous frame, then we happily push our results
                     // onto their value stack.
@@ -829,6 +2580,7 @@ tval *tet_eval(tstate *s, tframe *f) {
             // builtin invocation, where only the stack is used to communicate values.
             ne = tenv_new(s);
             ne->prev = f->env;
+            ne->root = f->env->root;
 
             // With the environment created, we need to bind the arguments. We don't check
             // if there are too few or too many values provided for the number of expected
@@ -853,6 +2605,14 @@ tval *tet_eval(tstate *s, tframe *f) {
             nf->vp = body;
             f = nf;
 
+#if TET_JIT
+            // If the body is compiled, it is evaluated right away. All that is left for
+            // us is to invoke whatever it evaluated to.
+            if (s->jit && !s->task && tjit_run(s, fn, f)) {
+                f->vp = NULL;
+            }
+#endif
+
             // This is important, since just below this if/else block we would normally
             // go up one stack frame to the previous frame.
             continue;
@@ -866,12 +2626,38 @@ tval *tet_eval(tstate *s, tframe *f) {
     }
 
     // Remove our error handler again.
+    tet_leave(s, outer, depth);
     TET_UNCATCH(s);
 
     // Return victiously! (NULL on success, error tvals otherwise.)
+    *cur = NULL;
     return NULL;
 }
 
+tval *tet_unquote(tstate *s, tval *v) {
+    // Loop over the QEXPR converting every part to SEXPR.
+    tval *r = tval_sexpr(s, v->car, NULL);
+    tval *c = r;
+    for (tval *n = v->cdr; n != NULL; n = n->cdr) {
+        c->cdr = tval_sexpr(s, n->car, NULL);
+        c = c->cdr;
+    }
+    return r;
+}
+
+void tet_yield(tframe *f) {
+    f->env->state->yield = true;
+}
+
+bool tet_resumed(tframe *f) {
+    return f->flags & TOBJ_FLAG_YIELDED;
+}
+
+bool tet_can_yield(tframe *f) {
+    tstate *s = f->env->state;
+    return s->task && s->depth == 1;
+}
+
 tframe *tet_read(tstate *s, char *in) {
     tframe *f = tframe_new(s->env);
 
@@ -881,6 +2667,76 @@ tframe *tet_read(tstate *s, char *in) {
     return f;
 }
 
+// Evaluate the call that's on the stack of (root) frame 'f'.
+static tval *tet_call_in(tstate *s, tframe *f, tval **r) {
+    tval *err = tet_eval(s, f);
+    *r = !err && f->obji ? f->objs[0] : NULL;
+    return err;
+}
+
+tval *tet_call(tstate *s, tval *fn, tval **args, tsize n, tval **r) {
+    *r = NULL;
+    TET_CATCH(s, err, {
+        return err;
+    });
+    tframe *f = tframe_new(s->env);
+    tframe_push(f, fn);
+    for (tsize i = 0; i < n; i++) {
+        tframe_push(f, args[i]);
+    }
+    TET_UNCATCH(s);
+    return tet_call_in(s, f, r);
+}
+
+tcall *tcall_new(tstate *s, tval *fn) {
+    tcall *c = tralloc(s, sizeof(tcall));
+    c->state = s;
+    c->fn = fn;
+    c->frame = tframe_new(s->env);
+    c->busy = false;
+    c->fnpin = tstate_pin(s, (tobj *) fn);
+    c->framepin = tstate_pin(s, (tobj *) c->frame);
+    trforget(s, 1); // c
+    return c;
+}
+
+void tcall_del(tcall *c) {
+    tstate_unpin(c->state, c->framepin);
+    tstate_unpin(c->state, c->fnpin);
+    tfree(c);
+}
+
+tval *tcall_run(tcall *c, tval **args, tsize n, tval **r) {
+    tstate *s = c->state;
+    if (c->busy) {
+        return tet_call(s, c->fn, args, n, r);
+    }
+
+    // Whatever the last call left of its frame, only the env is still of use.
+    tframe *f = c->frame;
+    f->orig = NULL;
+    f->prev = NULL;
+    f->ip = NULL;
+    f->vp = NULL;
+    f->obji = 0;
+    f->flags &= ~TOBJ_FLAG_YIELDED;
+
+    *r = NULL;
+    TET_CATCH(s, err, {
+        return err;
+    });
+    tframe_push(f, c->fn);
+    for (tsize i = 0; i < n; i++) {
+        tframe_push(f, args[i]);
+    }
+    TET_UNCATCH(s);
+
+    c->busy = true;
+    tval *err = tet_call_in(s, f, r);
+    c->busy = false;
+    return err;
+}
+
 tval *tet_parse(tstate *s, char *in, tsize *i) {
     tval *v = NULL;
     while (!EOFP(in[*i])) {
@@ -903,8 +2759,12 @@ tval *tet_parse(tstate *s, char *in, tsize *i) {
                 (*i)++;
                 v = tet_parse_qexpr(s, in, i);
                 break;
+            case ')':
+            case '}':
+                // Nothing left in this list, let the caller close it.
+                return NULL;
             default:
-                if (DIGITP(in[*i])) {
+                if (DIGITP(in[*i]) || (in[*i] == '-' && DIGITP(in[*i + 1]))) {
                     v = tet_parse_num(s, in, i);
                 } else {
                     v = tet_parse_sym(s, in, i);
@@ -918,11 +2778,27 @@ tval *tet_parse(tstate *s, char *in, tsize *i) {
 
 
 tval *tet_parse_num(tstate *s, char *in, tsize *i) {
+    bool neg = in[*i] == '-';
+    if (neg) (*i)++;
+    tsize start = *i;
     tnum n = 0;
+    bool over = false;
     while (DIGITP(in[*i])) {
-        n = (n * 10) + (in[(*i)++] - '0');
+        // Negative numbers are counted down, as there is one more of them than positive
+        // ones.
+        tnum d = in[(*i)++] - '0';
+        over = over || __builtin_mul_overflow(n, 10, &n) ||
+               (neg ? __builtin_sub_overflow(n, d, &n) : __builtin_add_overflow(n, d, &n));
     }
-    return tval_num(s, n);
+    if (!over) {
+        return tval_num(s, n);
+    }
+
+    // Too large for a tnum, so we start over with a bignum.
+    tval *v = tval_bignum(s, NULL);
+    v->big = tbig_parse(s, in + start, *i - start);
+    v->big->neg = neg;
+    return v;
 }
 
 tval *tet_parse_sym(tstate *s, char *in, tsize *i) {
@@ -937,6 +2813,7 @@ tval *tet_parse_sym(tstate *s, char *in, tsize *i) {
 
     tval *v = tval_sym(s, str);
     trforget(s, 1); // *str
+    tfree(str); // tval_sym made its own copy
     return v;
 }
 
@@ -960,8 +2837,12 @@ tval *tet_parse_str(tstate *s, char *in, tsize *i) {
     strncpy(str, in + b, *i - b);
     str[*i - b] = '\0';
 
+    // Skip the closing quote.
+    if (!EOFP(in[*i])) (*i)++;
+
     tval *v = tval_str(s, str);
     trforget(s, 1); // *str
+    tfree(str); // tval_str made its own copy
     return v;
 }
 
@@ -971,6 +2852,7 @@ tval *tet_parse_sexpr(tstate *s, char *in, tsize *i) {
 
     while (!EOFP(in[*i]) && in[*i] != ')') {
         tval *v = tet_parse(s, in, i);
+        if (!v) break;
 
         if (cur->car == NULL) {
             cur->car = v;
@@ -981,7 +2863,7 @@ tval *tet_parse_sexpr(tstate *s, char *in, tsize *i) {
             cur = p;
         }
     }
-    (*i)++;
+    if (!EOFP(in[*i])) (*i)++;
     return root;
 }
 
@@ -991,6 +2873,7 @@ tval *tet_parse_qexpr(tstate *s, char *in, tsize *i) {
 
     while (!EOFP(in[*i]) && in[*i] != '}') {
         tval *v = tet_parse(s, in, i);
+        if (!v) break;
 
         if (cur->car == NULL) {
             cur->car = v;
@@ -1001,49 +2884,5229 @@ tval *tet_parse_qexpr(tstate *s, char *in, tsize *i) {
             cur = p;
         }
     }
-    (*i)++;
+    if (!EOFP(in[*i])) (*i)++;
     return root;
 }
 
-
-//   ____  _   _ ___ _   _____ ___ _   _ ____
-//  | __ )| | | |_ _| | |_   _|_ _| \ | / ___|
-//  |  _ \| | | || || |   | |  | ||  \| \___ \
-//  | |_) | |_| || || |___| |  | || |\  |___) |
-//  |____/ \___/|___|_____|_| |___|_| \_|____/
-//
-
-tsize builtin_car(tframe *f) {
-    tval *v = tet_popsexpr(f);
-    tframe_push(f, v->car);
-    return 1;
-}
-
-tsize builtin_cdr(tframe *f) {
-    tval *v = tet_popsexpr(f);
-    tframe_push(f, v->cdr);
-    return 1;
+// Values that evaluate to themselves, and so may take the place of a call returning them
+// or of a parameter bound to them.
+static bool tet_optimize_const(tval *v) {
+    return v && (v->type == TVAL_NUMBER || v->type == TVAL_BIGNUM || v->type == TVAL_STRING);
 }
 
-tsize builtin_lambda(tframe *f) {
-    tval *body = tet_popsexpr(f);
-    tval *pars = tet_popsexpr(f);
-    tet_pushlambda(f, pars, body);
-    return 1;
+// Whether the symbol 'sym' occurs anywhere in v.
+static bool tet_optimize_uses(tval *v, char *sym) {
+    if (!v) {
+        return false;
+    }
+    switch (v->type) {
+        case TVAL_SYMBOL:
+            return strcmp(v->sym, sym) == 0;
+        case TVAL_SEXPR:
+        case TVAL_QEXPR:
+            return tet_optimize_uses(v->car, sym) || tet_optimize_uses(v->cdr, sym);
+        default:
+            return false;
+    }
 }
 
-tsize builtin_add(tframe *f) {
-    tsize c = tframe_size(f);
-    tnum sum = 0;
-    for (tsize i = 0; i < c - 1; i++) {
-        sum += tet_popnumber(f);
+// The value bound to parameter 'sym' of an inlined lambda, or NULL if it isn't one.
+static tval *tet_optimize_arg(tval *pars, tval *args, char *sym) {
+    for (; pars; pars = pars->cdr, args = args->cdr) {
+        if (strcmp(pars->car->sym, sym) == 0) {
+            return args->car;
+        }
     }
-    tet_pushnumber(f, sum);
-    return 1;
+    return NULL;
 }
 
-tsize builtin_sub(tframe *f) {}
-
-tsize builtin_mul(tframe *f) {}
-
-tsize builtin_div(tframe *f) {}
+// Copy the list 'l' (evaluated in the env of an inlined lambda) into a SEXPR, with the
+// parameters replaced by their arguments. Returns NULL if a parameter is used in a way
+// we can't substitute: inside a QEXPR it might be evaluated later, by a lambda that
+// looks it up dynamically.
+static tval *tet_optimize_subst(tstate *s, tval *l, tval *pars, tval *args) {
+    tval *r = NULL;
+    tval **c = &r;
+    for (; l; l = l->cdr) {
+        tval *v = l->car;
+        if (!v) {
+            return NULL;
+        }
+        if (v->type == TVAL_SYMBOL) {
+            tval *a = tet_optimize_arg(pars, args, v->sym);
+            v = a ? a : v;
+        } else if (v->type == TVAL_SEXPR) {
+            v = tet_optimize_subst(s, v, pars, args);
+            if (!v) {
+                return NULL;
+            }
+        } else if (v->type == TVAL_QEXPR) {
+            for (tval *p = pars; p; p = p->cdr) {
+                if (tet_optimize_uses(v, p->car->sym)) {
+                    return NULL;
+                }
+            }
+        }
+        *c = tval_sexpr(s, v, NULL);
+        c = &(*c)->cdr;
+    }
+    return r;
+}
+
+// Inline the application of a lambda literal to constants, ((lambda {a b} {+ a b}) 1 2),
+// by substituting the arguments into its body: (+ 1 2). Returns NULL if 'v' is not such
+// an application. Because every parameter is bound (and nothing else is), what remains
+// of the body looks up the same values in the env of the call as it did in the lambda's.
+static tval *tet_optimize_inline(tstate *s, tenv *e, tval *v) {
+    tval *l = v->car;
+    if (l->type != TVAL_SEXPR || !l->car || l->car->type != TVAL_SYMBOL) {
+        return NULL;
+    }
+    // Undefined symbols are left for the evaluator to report.
+    tval *kv = tenv_getpair(e, l->car);
+    tval *fn = kv ? kv->cdr : NULL;
+    if (!fn || fn->type != TVAL_BUILTIN || fn->builtin != builtin_lambda) {
+        return NULL;
+    }
+
+    // (lambda {pars} {body}), with as many distinct symbols for parameters as there are
+    // constant arguments.
+    tval *pars = l->cdr ? l->cdr->car : NULL;
+    tval *body = l->cdr && l->cdr->cdr ? l->cdr->cdr->car : NULL;
+    if (!pars || !body || l->cdr->cdr->cdr || pars->type != TVAL_QEXPR ||
+        body->type != TVAL_QEXPR || !pars->car || !body->car) {
+        return NULL;
+    }
+    tval *arg = v->cdr;
+    for (tval *p = pars; p; p = p->cdr, arg = arg->cdr) {
+        if (!arg || !p->car || p->car->type != TVAL_SYMBOL ||
+            !tet_optimize_const(arg->car) || tet_optimize_uses(p->cdr, p->car->sym)) {
+            return NULL;
+        }
+    }
+    if (arg) {
+        return NULL;
+    }
+    return tet_optimize_subst(s, body, pars, v->cdr);
+}
+
+// Call the pure builtin 'fn' on the constant arguments in 'args', returning its result if
+// that is a single constant. Calls that fail are left for the evaluator to report.
+static tval *tet_optimize_call(tstate *s, tenv *e, tval *fn, tval *args) {
+    tframe *f = tframe_new(e);
+    tframe_push(f, fn);
+    for (; args; args = args->cdr) {
+        tframe_push(f, args->car);
+    }
+
+    TET_CATCH(s, err, {
+        (void) err;
+        return NULL;
+    });
+    tsize c = fn->builtin(f);
+    TET_UNCATCH(s);
+
+    if (s->yield) {
+        s->yield = false;
+        return NULL;
+    }
+    tval *r = c == 1 && f->obji > 1 ? tframe_peek(f) : NULL;
+    return tet_optimize_const(r) ? r : NULL;
+}
+
+// Optimize the SEXPR 'v', evaluated in 'e'. Returns what should be evaluated instead,
+// which is a constant if 'fold' and the whole call could be folded.
+static tval *tet_optimize_expr(tstate *s, tenv *e, tval *v, bool fold) {
+    if (!v->car) {
+        return v;
+    }
+
+    // Inlined lambdas may leave calls to fold (or more lambdas to inline).
+    tval *in = tet_optimize_inline(s, e, v);
+    if (in) {
+        return tet_optimize_expr(s, e, in, fold);
+    }
+
+    bool consts = true;
+    for (tval *c = v; c; c = c->cdr) {
+        if (c->car && c->car->type == TVAL_SEXPR) {
+            tstate_remember(s, (tobj *) c);
+            c->car = tet_optimize_expr(s, e, c->car, true);
+        }
+        if (c != v && !tet_optimize_const(c->car)) {
+            consts = false;
+        }
+    }
+    if (!fold || !consts || v->car->type != TVAL_SYMBOL) {
+        return v;
+    }
+
+    tval *kv = tenv_getpair(e, v->car);
+    tval *fn = kv ? kv->cdr : NULL;
+    if (!fn || fn->type != TVAL_BUILTIN || !(fn->flags & TOBJ_FLAG_PURE)) {
+        return v;
+    }
+    tval *r = tet_optimize_call(s, e, fn, v->cdr);
+    return r ? r : v;
+}
+
+void tet_optimize(tstate *s, tframe *f) {
+    // The frame evaluates its list itself, so that list has to remain a call.
+    if (f->vp && f->vp->type == TVAL_SEXPR) {
+        f->vp = tet_optimize_expr(s, f->env, f->vp, false);
+    }
+}
+
+
+//   ____   ___   ___  _
+//  |  _ \ / _ \ / _ \| |
+//  | |_) | | | | | | | |
+//  |  __/| |_| | |_| | |___
+//  |_|    \___/ \___/|_____|
+//
+
+typedef struct tpool_job {
+    tfrozen *ctx; // (fn (name value)...), shared by every worker (see tpool_ctx)
+
+    tval **in; // elements, in the caller's heap
+    tval **out; // results, in the heaps of the workers that produced them
+    tsize len;
+    tsize chunk;
+    tsize next; // next element to hand out (atomic)
+
+    tval *err; // first error raised, in the heap of the worker that raised it (atomic)
+} tpool_job;
+
+// Apply fn to a single argument within s, returning the first value it returned.
+static tval *tpool_apply(tstate *s, tenv *e, tval *fn, tval *arg) {
+    tframe *f = tframe_new(e);
+    tframe_push(f, fn);
+    tframe_push(f, arg);
+
+    tval *err = tet_eval(s, f);
+    if (err) {
+        TET_THROWRAW(s, err);
+    }
+    return f->obji ? f->objs[0] : NULL;
+}
+
+// Freeze fn along with the bindings of the caller's environment e (those shadowed by an
+// inner env left out), as (fn (name value)...). This is done once per map, so that the
+// workers all share what they need rather than each copy the lot for every job.
+static tfrozen *tpool_ctx(tstate *s, tenv *e, tval *fn) {
+    tval *vars = NULL;
+    for (tenv *p = e; p; p = p->prev) {
+        for (tval *c = p->vars; c != NULL; c = c->cdr) {
+            tval *kv = c->car;
+            bool shadowed = false;
+            for (tenv *q = e; q != p && !shadowed; q = q->prev) {
+                for (tval *d = q->vars; d != NULL && !shadowed; d = d->cdr) {
+                    shadowed = strcmp(d->car->car->sym, kv->car->sym) == 0;
+                }
+            }
+            if (!shadowed) {
+                tval *b = tval_sexpr(s, kv->car, tval_sexpr(s, kv->cdr, NULL));
+                vars = tval_sexpr(s, b, vars);
+            }
+        }
+    }
+    return tfrozen_new(s, tval_sexpr(s, fn, vars));
+}
+
+static void tpool_work(struct tpool_worker *w, tpool_job *job) {
+    tstate *s = w->state;
+
+    TET_CATCH(s, err, {
+        tval *none = NULL;
+        __atomic_compare_exchange_n(&job->err, &none, err, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return;
+    });
+
+    // Start from a clean slate: whatever the previous job left behind (including the
+    // previous caller's bindings) is garbage now, and so are the regions it held.
+    s->env = tenv_new(s);
+    tstate_gc(s);
+    tstate_sweep(s, 0);
+    while (s->heldi) {
+        tfrozen_release(s->held[--s->heldi]);
+    }
+
+    // Bind the caller's names to their values in the region, which are shared as they
+    // are. Only the pairs are our own, as a binding may still be changed.
+    tstate_hold(s, job->ctx);
+    tval *fn = job->ctx->root->car;
+    for (tval *c = job->ctx->root->cdr; c != NULL; c = c->cdr) {
+        tval *kv = tval_sexpr(s, c->car->car, c->car->cdr->car);
+        s->env->vars = tval_sexpr(s, kv, s->env->vars);
+    }
+
+    // Keep grabbing chunks until the list is exhausted or somebody failed.
+    while (!__atomic_load_n(&job->err, __ATOMIC_RELAXED)) {
+        tsize i = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED);
+        if (i >= job->len) break;
+
+        tsize end = i + job->chunk < job->len ? i + job->chunk : job->len;
+        for (; i < end; i++) {
+            job->out[i] = tpool_apply(s, s->env, fn, tval_copy(s, job->in[i]));
+        }
+    }
+
+    TET_UNCATCH(s);
+}
+
+static void *tpool_main(void *arg) {
+    struct tpool_worker *w = arg;
+    tpool *p = w->pool;
+    tsize seen = 0;
+
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (!p->stop && p->gen == seen) {
+            pthread_cond_wait(&p->wake, &p->lock);
+        }
+        if (p->stop) break;
+        seen = p->gen;
+        tpool_job *job = p->job;
+        pthread_mutex_unlock(&p->lock);
+
+        tpool_work(w, job);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->busy == 0) {
+            pthread_cond_signal(&p->done);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+tpool *tpool_new(tsize threads, tsize chunk) {
+    if (!threads) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (tsize) n : 1;
+    }
+
+    tpool *p = talloc(sizeof(tpool));
+    if (!p) {
+        return NULL;
+    }
+    p->n = 0;
+    p->chunk = chunk;
+    p->workers = NULL;
+    p->job = NULL;
+    p->gen = 0;
+    p->busy = 0;
+    p->stop = false;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    // A single worker would only sit idle while the caller waits for it, so such a
+    // pool runs everything inline instead.
+    if (threads == 1) {
+        return p;
+    }
+
+    p->workers = talloc(threads * sizeof(struct tpool_worker));
+    if (!p->workers) {
+        tpool_del(p);
+        return NULL;
+    }
+
+    for (tsize i = 0; i < threads; i++) {
+        struct tpool_worker *w = &p->workers[i];
+        w->pool = p;
+        w->state = tstate_new();
+        if (!w->state) {
+            tpool_del(p);
+            return NULL;
+        }
+
+        // Workers map inline, so nested parallel maps don't start pools of their own.
+        w->state->pool = tpool_new(1, 0);
+        if (!w->state->pool || pthread_create(&w->thread, NULL, tpool_main, w)) {
+            tstate_del(w->state);
+            tpool_del(p);
+            return NULL;
+        }
+        p->n++;
+    }
+    return p;
+}
+
+void tpool_del(tpool *p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    for (tsize i = 0; i < p->n; i++) {
+        pthread_join(p->workers[i].thread, NULL);
+        tstate_del(p->workers[i].state);
+    }
+
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->wake);
+    pthread_mutex_destroy(&p->lock);
+    tfree(p->workers);
+    tfree(p);
+}
+
+tval *tpool_map(tstate *s, tpool *p, tenv *e, tval *fn, tval *list, tsize chunk) {
+    // An empty list (nil car) maps to an empty list.
+    tsize len = 0;
+    if (list->car) {
+        for (tval *c = list; c != NULL; c = c->cdr) len++;
+    }
+    if (!len) {
+        return tval_sexpr(s, NULL, NULL);
+    }
+
+    tval *root = NULL;
+    tval *cur = NULL;
+
+    // Without workers (or anything worth splitting) we simply map on this thread.
+    if (!p || !p->n || len == 1) {
+        for (tval *c = list; c != NULL; c = c->cdr) {
+            tval *r = tval_sexpr(s, tpool_apply(s, e, fn, c->car), NULL);
+            if (!root) {
+                root = r;
+            } else {
+                cur->cdr = r;
+            }
+            cur = r;
+        }
+        return root;
+    }
+
+    if (!chunk) chunk = p->chunk;
+    if (!chunk) chunk = len / (p->n * 4);
+    if (!chunk) chunk = 1;
+
+    tpool_job job;
+    job.in = tralloc(s, len * sizeof(tval *));
+    job.out = tralloc(s, len * sizeof(tval *));
+    job.ctx = tpool_ctx(s, e, fn);
+    job.len = len;
+    job.chunk = chunk;
+    job.next = 0;
+    job.err = NULL;
+
+    tsize i = 0;
+    for (tval *c = list; c != NULL; c = c->cdr) {
+        job.in[i++] = c->car;
+    }
+
+    // Hand the job to the workers and wait for all of them to finish. We must not
+    // touch our heap in the meantime, since the workers are reading from it.
+    pthread_mutex_lock(&p->lock);
+    p->job = &job;
+    p->gen++;
+    p->busy = p->n;
+    pthread_cond_broadcast(&p->wake);
+    while (p->busy) {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    p->job = NULL;
+    pthread_mutex_unlock(&p->lock);
+
+    // The workers hold the region for as long as they have anything of it.
+    tfrozen_release(job.ctx);
+
+    // The workers are idle now, so we can safely copy out of their heaps.
+    if (job.err) {
+        tval *err = tval_copy(s, job.err);
+        TET_THROWRAW(s, err);
+    }
+    for (i = 0; i < len; i++) {
+        tval *r = tval_sexpr(s, tval_copy(s, job.out[i]), NULL);
+        if (!root) {
+            root = r;
+        } else {
+            cur->cdr = r;
+        }
+        cur = r;
+    }
+
+    trforget(s, 2); // job.in, job.out
+    tfree(job.in);
+    tfree(job.out);
+    return root;
+}
+
+
+//   _____ ____   ___ __________ _   _
+//  |  ___|  _ \ / _ \__  / ____| \ | |
+//  | |_  | |_) | | | |/ /|  _| |  \| |
+//  |  _| |  _ <| |_| / /_| |___| |\  |
+//  |_|   |_| \_\\___/____|_____|_| \_|
+//
+
+struct tfrozen_chunk {
+    struct tfrozen_chunk *next;
+    tsize size;
+    tsize used;
+    char data[];
+};
+
+// A frozen value and the pointer to its region that precedes it.
+typedef struct tfrozen_cell {
+    tfrozen *region;
+    tval val;
+} tfrozen_cell;
+
+// State while freezing: the region being built and a map from original values to
+// their frozen copies, which preserves sharing and cycles.
+typedef struct tfrozen_ctx {
+    tstate *s;
+    tfrozen *z;
+    tval **keys;
+    tval **vals;
+    tsize mapi;
+    tsize mapl;
+} tfrozen_ctx;
+
+static void *tfrozen_alloc(tfrozen_ctx *x, tsize l) {
+    // Keep everything pointer-aligned.
+    l = (l + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    struct tfrozen_chunk *c = x->z->chunks;
+    if (!c || c->size - c->used < l) {
+        tsize size = c ? c->size * 2 : TET_FROZEN_CHUNK_MIN;
+        size = size < TET_FROZEN_CHUNK ? size : TET_FROZEN_CHUNK;
+        size = size > l ? size : l;
+        c = talloc(sizeof(struct tfrozen_chunk) + size);
+        if (!c) {
+            TET_THROWRAW(x->s, x->s->memerr);
+        }
+        c->next = x->z->chunks;
+        c->size = size;
+        c->used = 0;
+        x->z->chunks = c;
+    }
+
+    void *p = c->data + c->used;
+    c->used += l;
+    return p;
+}
+
+static tval *tfrozen_cell_new(tfrozen_ctx *x, tvaltype t) {
+    tfrozen_cell *c = tfrozen_alloc(x, sizeof(tfrozen_cell));
+    c->region = x->z;
+
+    tval *v = &c->val;
+    SETMARKTYPE(v, TMARK_VALUE);
+    v->flags = TOBJ_FLAG_FROZEN;
+    v->type = t;
+    v->car = NULL;
+    v->cdr = NULL;
+    return v;
+}
+
+static char *tfrozen_strdup(tfrozen_ctx *x, char *str) {
+    char *c = tfrozen_alloc(x, strlen(str) + 1);
+    strcpy(c, str);
+    return c;
+}
+
+static tsize tfrozen_hash(tval *v, tsize l) {
+    return ((uintptr_t) v >> 4) * 2654435761u & (l - 1);
+}
+
+static tval *tfrozen_map_get(tfrozen_ctx *x, tval *k) {
+    if (!x->mapl) return NULL;
+    for (tsize i = tfrozen_hash(k, x->mapl);; i = (i + 1) & (x->mapl - 1)) {
+        if (x->keys[i] == k) return x->vals[i];
+        if (!x->keys[i]) return NULL;
+    }
+}
+
+static void tfrozen_map_put(tfrozen_ctx *x, tval *k, tval *v) {
+    // Grow (and rehash) once the map is half full.
+    if ((x->mapi + 1) * 2 > x->mapl) {
+        tsize l = x->mapl ? x->mapl * 2 : 64;
+        tval **keys = talloc(l * sizeof(tval *));
+        tval **vals = talloc(l * sizeof(tval *));
+        if (!keys || !vals) {
+            tfree(keys);
+            tfree(vals);
+            TET_THROWRAW(x->s, x->s->memerr);
+        }
+        memset(keys, 0, l * sizeof(tval *));
+        for (tsize i = 0; i < x->mapl; i++) {
+            if (!x->keys[i]) continue;
+            tsize j = tfrozen_hash(x->keys[i], l);
+            while (keys[j]) j = (j + 1) & (l - 1);
+            keys[j] = x->keys[i];
+            vals[j] = x->vals[i];
+        }
+        tfree(x->keys);
+        tfree(x->vals);
+        x->keys = keys;
+        x->vals = vals;
+        x->mapl = l;
+    }
+
+    tsize i = tfrozen_hash(k, x->mapl);
+    while (x->keys[i]) i = (i + 1) & (x->mapl - 1);
+    x->keys[i] = k;
+    x->vals[i] = v;
+    x->mapi++;
+}
+
+static void tfrozen_dep(tfrozen_ctx *x, tfrozen *d) {
+    tfrozen *z = x->z;
+    if (d == z) return;
+    for (tsize i = 0; i < z->depi; i++) {
+        if (z->deps[i] == d) return;
+    }
+
+    if (z->depi >= z->depl) {
+        tsize l = z->depl ? z->depl * 2 : 4;
+        tfrozen **deps = trealloc(z->deps, l * sizeof(tfrozen *));
+        if (!deps) {
+            TET_THROWRAW(x->s, x->s->memerr);
+        }
+        z->deps = deps;
+        z->depl = l;
+    }
+    tfrozen_retain(d);
+    z->deps[z->depi++] = d;
+}
+
+// Have r refer to the task, mailbox or buffer v refers to, which the region then keeps
+// alive.
+static void tfrozen_handle(tfrozen_ctx *x, tval *r, tval *v) {
+    tfrozen *z = x->z;
+    if (z->handlei >= z->handlel) {
+        tsize l = z->handlel ? z->handlel * 2 : 4;
+        tval **handles = trealloc(z->handles, l * sizeof(tval *));
+        if (!handles) {
+            TET_THROWRAW(x->s, x->s->memerr);
+        }
+        z->handles = handles;
+        z->handlel = l;
+    }
+
+    if (v->type == TVAL_TASK) {
+        ttask_retain(v->task);
+        r->task = v->task;
+    } else if (v->type == TVAL_MAILBOX) {
+        tmailbox_retain(v->mailbox);
+        r->mailbox = v->mailbox;
+    } else {
+        __atomic_add_fetch(&v->bytes->buf->refs, 1, __ATOMIC_RELAXED);
+        r->bytes->buf = v->bytes->buf;
+    }
+    z->handles[z->handlei++] = r;
+}
+
+static tval *tfrozen_copy(tfrozen_ctx *x, tval *v);
+
+// A frozen copy of map node 'n' and the nodes under it, none of which are counted.
+static tmapnode *tfrozen_mapnode(tfrozen_ctx *x, tmapnode *n) {
+    if (!n) return NULL;
+
+    tmapnode *r = tfrozen_alloc(x, sizeof(tmapnode) + n->n * sizeof(tmapentry));
+    r->refs = 0;
+    r->bitmap = n->bitmap;
+    r->n = n->n;
+    r->cap = n->n;
+    r->mark = 0;
+    for (uint32_t i = 0; i < n->n; i++) {
+        tmapentry *e = &n->e[i];
+        r->e[i].node = tfrozen_mapnode(x, e->node);
+        r->e[i].key = tfrozen_copy(x, e->key);
+        r->e[i].val = tfrozen_copy(x, e->val);
+    }
+    return r;
+}
+
+static tval *tfrozen_copy(tfrozen_ctx *x, tval *v) {
+    if (!v) return NULL;
+
+    // Values that are already frozen are referenced, not copied.
+    if (TOBJ_FROZEN(v)) {
+        tfrozen_dep(x, tfrozen_of(v));
+        return v;
+    }
+
+    tval *r = tfrozen_map_get(x, v);
+    if (r) return r;
+
+    switch (v->type) {
+        case TVAL_NUMBER:
+            r = tfrozen_cell_new(x, v->type);
+            r->num = v->num;
+            break;
+        case TVAL_BIGNUM:
+            r = tfrozen_cell_new(x, v->type);
+            r->big = tfrozen_alloc(x, sizeof(tbig) + v->big->n * sizeof(uint32_t));
+            r->big->neg = v->big->neg;
+            r->big->n = v->big->n;
+            r->big->d = (uint32_t *) (r->big + 1);
+            memcpy(r->big->d, v->big->d, v->big->n * sizeof(uint32_t));
+            break;
+        case TVAL_VECTOR:
+            // Only pointer-aligned, which the vector builtins cope with.
+            r = tfrozen_cell_new(x, v->type);
+            r->vec = tfrozen_alloc(x, sizeof(tvec) + v->vec->n * sizeof(tnum));
+            r->vec->n = v->vec->n;
+            r->vec->d = (tnum *) (r->vec + 1);
+            memcpy(r->vec->d, v->vec->d, v->vec->n * sizeof(tnum));
+            break;
+        case TVAL_MAP:
+            r = tfrozen_cell_new(x, v->type);
+            tfrozen_map_put(x, v, r);
+            r->node = tfrozen_mapnode(x, v->node);
+            r->count = v->count;
+            return r;
+        case TVAL_SEQ:
+            r = tfrozen_cell_new(x, v->type);
+            tfrozen_map_put(x, v, r);
+            r->seq = tfrozen_alloc(x, sizeof(tseq));
+            *r->seq = *v->seq;
+            r->seq->fn = tfrozen_copy(x, v->seq->fn);
+            r->seq->src = tfrozen_copy(x, v->seq->src);
+            return r;
+        case TVAL_BYTES:
+            r = tfrozen_cell_new(x, v->type);
+            tfrozen_map_put(x, v, r);
+            if (v->bytes->buf) {
+                // Buffers are never changed either, so (say) a mapped file is shared
+                // rather than copied into the region.
+                r->bytes = tfrozen_alloc(x, sizeof(tbytes));
+                r->bytes->buf = NULL;
+                r->bytes->ptr = v->bytes->ptr;
+                r->bytes->len = v->bytes->len;
+                tfrozen_handle(x, r, v);
+                return r;
+            }
+            r->bytes = tfrozen_alloc(x, sizeof(tbytes) + v->bytes->len);
+            r->bytes->buf = NULL;
+            r->bytes->ptr = (char *) (r->bytes + 1);
+            r->bytes->len = v->bytes->len;
+            memcpy(r->bytes->ptr, v->bytes->ptr, v->bytes->len);
+            return r;
+        case TVAL_ERROR:
+        case TVAL_SYMBOL:
+        case TVAL_STRING:
+            r = tfrozen_cell_new(x, v->type);
+            r->str = tfrozen_strdup(x, v->str);
+            break;
+        case TVAL_BUILTIN:
+            r = tfrozen_cell_new(x, v->type);
+            r->builtin = v->builtin;
+            r->fast = v->fast;
+            r->flags |= v->flags & TOBJ_FLAG_PURE;
+            break;
+        case TVAL_TASK:
+        case TVAL_MAILBOX:
+            r = tfrozen_cell_new(x, v->type);
+            tfrozen_handle(x, r, v);
+            break;
+        case TVAL_LAMBDA:
+            r = tfrozen_cell_new(x, v->type);
+            tfrozen_map_put(x, v, r);
+            r->pars = tfrozen_copy(x, v->pars);
+            r->body = tfrozen_copy(x, v->body);
+            return r;
+        case TVAL_SEXPR:
+        case TVAL_QEXPR:
+            // Like tval_copy we only recurse into the cars. A cdr that was copied
+            // before (or is frozen already) ends the walk, which handles shared tails
+            // and cycles alike.
+            r = tfrozen_cell_new(x, v->type);
+            tfrozen_map_put(x, v, r);
+            for (tval *c = r;; c = c->cdr) {
+                c->car = tfrozen_copy(x, v->car);
+                v = v->cdr;
+                if (!v) break;
+                if (TOBJ_FROZEN(v) || tfrozen_map_get(x, v)) {
+                    c->cdr = tfrozen_copy(x, v);
+                    break;
+                }
+                c->cdr = tfrozen_cell_new(x, v->type);
+                tfrozen_map_put(x, v, c->cdr);
+            }
+            return r;
+        default: TET_THROW(x->s, "cannot freeze value of type %s", tvaltype_print(v->type));
+    }
+
+    tfrozen_map_put(x, v, r);
+    return r;
+}
+
+tfrozen *tfrozen_new(tstate *s, tval *v) {
+    TET_CATCHABLE(s);
+    tfrozen *z = tealloc(s, sizeof(tfrozen));
+    z->refs = 1;
+    z->root = NULL;
+    z->chunks = NULL;
+    z->deps = NULL;
+    z->depi = 0;
+    z->depl = 0;
+    z->handles = NULL;
+    z->handlei = 0;
+    z->handlel = 0;
+
+    tfrozen_ctx x = {s, z, NULL, NULL, 0, 0};
+
+    // Should anything fail halfway, free the partial region and pass the error on.
+    TET_CATCH(s, err, {
+        tfree(x.keys);
+        tfree(x.vals);
+        tfrozen_release(z);
+        TET_THROWRAW(s, err);
+    });
+
+    z->root = tfrozen_copy(&x, v);
+
+    TET_UNCATCH(s);
+    tfree(x.keys);
+    tfree(x.vals);
+    return z;
+}
+
+tfrozen *tfrozen_of(tval *v) {
+    return ((tfrozen_cell *) ((char *) v - offsetof(tfrozen_cell, val)))->region;
+}
+
+void tfrozen_retain(tfrozen *z) {
+    __atomic_add_fetch(&z->refs, 1, __ATOMIC_RELAXED);
+}
+
+void tfrozen_release(tfrozen *z) {
+    if (__atomic_sub_fetch(&z->refs, 1, __ATOMIC_ACQ_REL)) return;
+
+    while (z->depi) {
+        tfrozen_release(z->deps[--z->depi]);
+    }
+    while (z->handlei) {
+        tval *v = z->handles[--z->handlei];
+        if (v->type == TVAL_TASK) {
+            ttask_release(v->task);
+        } else if (v->type == TVAL_MAILBOX) {
+            tmailbox_release(v->mailbox);
+        } else {
+            tbuf_release(v->bytes->buf);
+        }
+    }
+    while (z->chunks) {
+        struct tfrozen_chunk *c = z->chunks;
+        z->chunks = c->next;
+        tfree(c);
+    }
+    tfree(z->deps);
+    tfree(z->handles);
+    tfree(z);
+}
+
+
+//   ____   ____ _   _ _____ ____
+//  / ___| / ___| | | | ____|  _ \
+//  \___ \| |   | |_| |  _| | | | |
+//   ___) | |___|  _  | |___| |_| |
+//  |____/ \____|_| |_|_____|____/
+//
+
+static ttask *ttask_new(tsched *c) {
+    ttask *t = talloc(sizeof(ttask));
+    if (!t) {
+        return NULL;
+    }
+
+    t->refs = 1; // The scheduler's.
+    t->sched = c;
+    t->status = TTASK_NEW;
+    t->call = NULL;
+    t->src = NULL;
+    t->root = NULL;
+    t->cur = NULL;
+    t->result = NULL;
+    t->waiting = false;
+    t->next = NULL;
+    t->fd = -1;
+    t->parkedi = 0;
+    return t;
+}
+
+void ttask_retain(ttask *t) {
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+}
+
+void ttask_release(ttask *t) {
+    if (__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL)) return;
+
+    if (t->call) {
+        tfrozen_release(t->call);
+    }
+    if (t->result) {
+        tfrozen_release(t->result);
+    }
+    tfree(t->src);
+    tfree(t);
+}
+
+// Wake up every sleeping worker (and every thread blocked in a join).
+static void tsched_wake(tsched *c) {
+    pthread_mutex_lock(&c->lock);
+    pthread_cond_broadcast(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+
+    // Workers with parked tasks sleep in epoll instead. They announce this before they
+    // check for work one last time, and we check for them after having posted ours, so
+    // one of us is bound to see the other.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (tsize i = 0; i < c->n; i++) {
+        if (__atomic_load_n(&c->workers[i].polling, __ATOMIC_SEQ_CST)) {
+            uint64_t one = 1;
+            if (write(c->workers[i].evfd, &one, sizeof(one)) < 0) {
+                // The counter is saturated, so the worker will wake up regardless.
+            }
+        }
+    }
+}
+
+static bool tsched_push(struct tsched_worker *w, ttask *t) {
+    pthread_mutex_lock(&w->lock);
+
+    // Grow the deque if necessary, keeping the tasks at the same logical positions.
+    if (w->bottom - w->top >= w->cap) {
+        tsize cap = w->cap ? w->cap * 2 : 64;
+        ttask **deque = talloc(cap * sizeof(ttask *));
+        if (!deque) {
+            pthread_mutex_unlock(&w->lock);
+            return false;
+        }
+        for (tsize i = w->top; i < w->bottom; i++) {
+            deque[i % cap] = w->deque[i % w->cap];
+        }
+        tfree(w->deque);
+        w->deque = deque;
+        w->cap = cap;
+    }
+
+    w->deque[w->bottom++ % w->cap] = t;
+    __atomic_add_fetch(&w->sched->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&w->lock);
+
+    tsched_wake(w->sched);
+    return true;
+}
+
+// Claim a task that has not started yet. Besides its worker, a task joining it may run
+// it (see tsched_help) while it's still in a deque, so whoever claims it first runs it.
+static bool tsched_claim(ttask *t) {
+    ttaskstatus status = TTASK_NEW;
+    return __atomic_compare_exchange_n(&t->status, &status, TTASK_STARTED, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static ttask *tsched_pop(struct tsched_worker *w) {
+    ttask *t = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom > w->top) {
+        t = w->deque[--w->bottom % w->cap];
+        __atomic_sub_fetch(&w->sched->pending, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return t;
+}
+
+static ttask *tsched_steal(struct tsched_worker *w) {
+    tsched *c = w->sched;
+    if (!__atomic_load_n(&c->pending, __ATOMIC_RELAXED)) return NULL;
+
+    // Start at a random victim, so thieves don't all go after the same worker.
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 7;
+    w->seed ^= w->seed << 17;
+    for (tsize i = 0; i < c->n; i++) {
+        struct tsched_worker *v = &c->workers[(w->seed + i) % c->n];
+        if (v == w) continue;
+
+        ttask *t = NULL;
+        pthread_mutex_lock(&v->lock);
+        if (v->bottom > v->top) {
+            t = v->deque[v->top++ % v->cap];
+            __atomic_sub_fetch(&c->pending, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (t) return t;
+    }
+    return NULL;
+}
+
+static struct tsched_worker *tsched_worker_of(tstate *s) {
+    tsched *c = s->sched;
+    for (tsize i = 0; i < c->n; i++) {
+        if (c->workers[i].state == s) {
+            return &c->workers[i];
+        }
+    }
+    return NULL;
+}
+
+// Park the task s is running until fd is ready for 'events' (EPOLLIN or EPOLLOUT). The
+// task should yield right after, tsched_step then leaves it out of the run queue.
+static void tsched_park(tstate *s, int fd, uint32_t events) {
+    struct tsched_worker *w = tsched_worker_of(s);
+    ttask *t = s->task;
+
+    if (w->parkedi >= w->parkedl) {
+        tsize l = w->parkedl ? w->parkedl * 2 : 16;
+        w->parked = terealloc(s, w->parked, l * sizeof(ttask *));
+        w->parkedl = l;
+    }
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = t;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        TET_THROW(s, "cannot wait for fd %d: %s", fd, strerror(errno));
+    }
+
+    t->fd = fd;
+    t->parkedi = w->parkedi;
+    w->parked[w->parkedi++] = t;
+}
+
+// Stop waiting for the file descriptor a task is parked on.
+static void tsched_unlink(struct tsched_worker *w, ttask *t) {
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, t->fd, NULL);
+    t->fd = -1;
+
+    ttask *last = w->parked[--w->parkedi];
+    w->parked[t->parkedi] = last;
+    last->parkedi = t->parkedi;
+}
+
+// Put a parked task whose file descriptor is ready back in the run queue.
+static void tsched_unpark(struct tsched_worker *w, ttask *t) {
+    tsched_unlink(w, t);
+
+    t->next = NULL;
+    if (w->tail) {
+        w->tail->next = t;
+    } else {
+        w->head = t;
+    }
+    w->tail = t;
+}
+
+// Unpark the tasks whose file descriptors are ready, waiting at most 'timeout'
+// milliseconds (-1 for as long as it takes) for one to become ready.
+static void tsched_poll(struct tsched_worker *w, int timeout) {
+    struct epoll_event evs[TET_SCHED_EVENTS];
+    int n = epoll_wait(w->epfd, evs, TET_SCHED_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+        ttask *t = evs[i].data.ptr;
+        if (t) {
+            tsched_unpark(w, t);
+        } else {
+            // Our eventfd, reset it.
+            uint64_t v;
+            if (read(w->evfd, &v, sizeof(v)) < 0) {
+                // Somebody else reset it already.
+            }
+        }
+    }
+    w->polls = 0;
+}
+
+// Freeze a task's result, or return NULL (and the reason) if it can't be frozen.
+static tfrozen *tsched_result(tstate *s, tval *v, tval **reason) {
+    TET_CATCH(s, err, {
+        *reason = err;
+        return NULL;
+    });
+
+    tfrozen *z = tfrozen_new(s, v);
+
+    TET_UNCATCH(s);
+    return z;
+}
+
+static void tsched_finish(struct tsched_worker *w, ttask *t, tval *v, bool failed) {
+    tstate *s = w->state;
+    tsched *c = w->sched;
+
+    // Freeze the result so it can be joined from any state. Should that fail (e.g. the
+    // result contained an environment) we fail the task with the reason instead.
+    tval *reason = NULL;
+    tfrozen *z = tsched_result(s, v, &reason);
+    if (!z) {
+        failed = true;
+        z = tsched_result(s, reason, &reason);
+    }
+
+    // A task may fail right after parking itself (see tsched_park), we won't wait for
+    // its fd anymore.
+    if (t->fd >= 0) {
+        tsched_unlink(w, t);
+    }
+
+    // Our heap no longer needs to keep the task's frames around.
+    if (t->root) {
+        tstate_unpin(s, t->rootpin);
+        tstate_unpin(s, t->curpin);
+        t->root = NULL;
+        t->cur = NULL;
+        w->started--;
+    }
+
+    t->result = z;
+    __atomic_store_n(&t->status, failed ? TTASK_FAILED : TTASK_DONE, __ATOMIC_RELEASE);
+    tsched_wake(c);
+    ttask_release(t);
+}
+
+static void tsched_start(struct tsched_worker *w, ttask *t) {
+    tstate *s = w->state;
+
+    tframe *f;
+    if (t->call) {
+        // Thaw the call into our heap, its function and arguments become the stack of
+        // the root frame just like they would have had the call been evaluated here.
+        tval *call = tval_copy_from(s, t->call->root, t->call);
+        f = tframe_new(s->env);
+        for (tval *a = call; a != NULL; a = a->cdr) {
+            tframe_push(f, a->car);
+        }
+        tfrozen_release(t->call);
+        t->call = NULL;
+    } else {
+        f = tet_read(s, t->src);
+    }
+
+    t->root = f;
+    t->cur = f;
+    t->rootpin = tstate_pin(s, (tobj *) f);
+    t->curpin = tstate_pin(s, (tobj *) f);
+    w->started++;
+}
+
+// Run t for a slice, returning whether it suspended because it is waiting on another.
+static bool tsched_step(struct tsched_worker *w, ttask *t) {
+    tstate *s = w->state;
+    volatile bool waiting = false;
+
+    // Errors outside of the evaluation itself (starting or finishing the task) fail it.
+    TET_CATCH(s, err, {
+        s->task = NULL;
+        tsched_finish(w, t, err, true);
+        return false;
+    });
+
+    if (!t->root) {
+        tsched_start(w, t);
+    }
+
+    s->task = t;
+    t->waiting = false;
+    tval *err = tet_run(s, t->root, &t->cur, TET_SCHED_SLICE);
+    s->task = NULL;
+
+    if (err) {
+        tsched_finish(w, t, err, true);
+    } else if (!t->cur) {
+        tframe *r = t->root;
+        tsched_finish(w, t, r->obji ? r->objs[0] : tval_sexpr(s, NULL, NULL), false);
+    } else if (t->fd >= 0) {
+        // Parked, tsched_poll puts it back in the run queue once its fd is ready.
+        tstate_repin(s, t->curpin, (tobj *) t->cur);
+    } else {
+        // Suspended, put it at the back of our run queue.
+        waiting = t->waiting;
+        tstate_repin(s, t->curpin, (tobj *) t->cur);
+        t->next = NULL;
+        if (w->tail) {
+            w->tail->next = t;
+        } else {
+            w->head = t;
+        }
+        w->tail = t;
+    }
+
+    TET_UNCATCH(s);
+
+    // Collect once the heap has grown enough since the last collection.
+    if (s->obji >= w->gc) {
+        tsize live = s->obji - tstate_gc(s);
+        w->gc = live * 2 > TET_SCHED_GC ? live * 2 : TET_SCHED_GC;
+    }
+    return waiting;
+}
+
+static void *tsched_main(void *arg) {
+    struct tsched_worker *w = arg;
+    tsched *c = w->sched;
+
+    // Number of started tasks in a row that were only waiting on other tasks.
+    tsize idle = 0;
+
+    while (!__atomic_load_n(&c->stop, __ATOMIC_RELAXED)) {
+        ttask *t = NULL;
+
+        // Check on our parked tasks every so often.
+        if (w->parkedi && ++w->polls >= TET_SCHED_POLL) {
+            tsched_poll(w, 0);
+        }
+
+        // Resume our started tasks round robin, unless they're all just waiting. Then
+        // look for new tasks, first our own (newest first) and then everybody else's.
+        if (w->head && idle < w->started - w->parkedi) {
+            t = w->head;
+            w->head = t->next;
+            if (!w->head) w->tail = NULL;
+        } else {
+            t = tsched_pop(w);
+            if (!t) t = tsched_steal(w);
+            if (t) idle = 0;
+
+            // A task that joined it may have run it already.
+            if (t && !tsched_claim(t)) {
+                ttask_release(t);
+                continue;
+            }
+        }
+
+        if (t) {
+            idle = tsched_step(w, t) ? idle + 1 : 0;
+            continue;
+        }
+
+        // Nothing to do. If our tasks are waiting we check back on them soon (or as soon
+        // as any task finishes), otherwise we sleep until something happens. With tasks
+        // parked that something may also be one of their fds becoming ready.
+        if (w->parkedi) {
+            __atomic_store_n(&w->polling, true, __ATOMIC_SEQ_CST);
+            if (!__atomic_load_n(&c->stop, __ATOMIC_SEQ_CST) &&
+                !__atomic_load_n(&c->pending, __ATOMIC_SEQ_CST)) {
+                tsched_poll(w, w->head ? 1 : -1);
+            }
+            __atomic_store_n(&w->polling, false, __ATOMIC_RELAXED);
+            idle = 0;
+            continue;
+        }
+
+        pthread_mutex_lock(&c->lock);
+        if (!c->stop && !__atomic_load_n(&c->pending, __ATOMIC_RELAXED)) {
+            if (w->head) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += 1000000;
+                if (ts.tv_nsec >= 1000000000) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&c->wake, &c->lock, &ts);
+            } else {
+                pthread_cond_wait(&c->wake, &c->lock);
+            }
+        }
+        pthread_mutex_unlock(&c->lock);
+        idle = 0;
+    }
+    return NULL;
+}
+
+// Give a fresh worker state the owner's globals, a pool that maps inline and us.
+static bool tsched_init(tsched *c, tstate *s) {
+    TET_CATCH(s, err, {
+        (void) err;
+        return false;
+    });
+
+    if (c->owner) {
+        tenv_copy(s->env, c->owner->env);
+    }
+
+    TET_UNCATCH(s);
+
+    s->sched = c;
+    s->pool = tpool_new(1, 0);
+    return s->pool != NULL;
+}
+
+tsched *tsched_new(tstate *s, tsize threads) {
+    if (!threads) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (tsize) n : 1;
+    }
+
+    tsched *c = tealloc(s, sizeof(tsched));
+    c->owner = s;
+    c->n = 0;
+    c->pending = 0;
+    c->next = 0;
+    c->stop = false;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->wake, NULL);
+
+    c->workers = talloc(threads * sizeof(struct tsched_worker));
+    if (!c->workers) {
+        tsched_del(c);
+        TET_THROWRAW(s, s->memerr);
+    }
+
+    // Set up every worker (and its state) before starting any, since they may steal
+    // from each other as soon as they are running.
+    for (tsize i = 0; i < threads; i++) {
+        struct tsched_worker *w = &c->workers[i];
+        w->sched = c;
+        w->deque = NULL;
+        w->top = 0;
+        w->bottom = 0;
+        w->cap = 0;
+        w->head = NULL;
+        w->tail = NULL;
+        w->started = 0;
+        w->parked = NULL;
+        w->parkedi = 0;
+        w->parkedl = 0;
+        w->polling = false;
+        w->polls = 0;
+        w->gc = TET_SCHED_GC;
+        w->seed = i * 2654435761u + 1;
+        pthread_mutex_init(&w->lock, NULL);
+
+        // The eventfd is registered without a task, which is how tsched_poll tells it
+        // apart from the fds tasks are parked on.
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        bool polls = w->epfd >= 0 && w->evfd >= 0 &&
+                     !epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->evfd, &ev);
+
+        w->state = polls ? tstate_new() : NULL;
+        if (!w->state || !tsched_init(c, w->state)) {
+            if (w->state) tstate_del(w->state);
+            if (w->epfd >= 0) close(w->epfd);
+            if (w->evfd >= 0) close(w->evfd);
+            pthread_mutex_destroy(&w->lock);
+            tsched_del(c);
+            TET_THROWRAW(s, s->memerr);
+        }
+        c->n++;
+    }
+
+    for (tsize i = 0; i < c->n; i++) {
+        if (pthread_create(&c->workers[i].thread, NULL, tsched_main, &c->workers[i])) {
+            // Stop the ones we did start, and don't join the rest.
+            __atomic_store_n(&c->stop, true, __ATOMIC_RELAXED);
+            tsched_wake(c);
+            for (tsize j = 0; j < i; j++) {
+                pthread_join(c->workers[j].thread, NULL);
+            }
+            c->n = i;
+            tsched_del(c);
+            TET_THROWRAW(s, s->memerr);
+        }
+    }
+    return c;
+}
+
+// Fail a task that will never run (or never finish) because its scheduler is stopping.
+static void tsched_abandon(ttask *t) {
+    __atomic_store_n(&t->status, TTASK_FAILED, __ATOMIC_RELEASE);
+    ttask_release(t);
+}
+
+void tsched_del(tsched *c) {
+    // Stop the workers, unless they were never started to begin with.
+    if (!__atomic_load_n(&c->stop, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&c->stop, true, __ATOMIC_RELAXED);
+        tsched_wake(c);
+        for (tsize i = 0; i < c->n; i++) {
+            pthread_join(c->workers[i].thread, NULL);
+        }
+    }
+
+    for (tsize i = 0; i < c->n; i++) {
+        struct tsched_worker *w = &c->workers[i];
+        while (w->bottom > w->top) {
+            ttask *t = w->deque[--w->bottom % w->cap];
+            if (tsched_claim(t)) {
+                tsched_abandon(t);
+            } else {
+                ttask_release(t);
+            }
+        }
+        while (w->head) {
+            ttask *t = w->head;
+            w->head = t->next;
+            t->root = NULL;
+            t->cur = NULL;
+            tsched_abandon(t);
+        }
+        while (w->parkedi) {
+            ttask *t = w->parked[--w->parkedi];
+            t->root = NULL;
+            t->cur = NULL;
+            t->fd = -1;
+            tsched_abandon(t);
+        }
+        tstate_del(w->state);
+        close(w->epfd);
+        close(w->evfd);
+        tfree(w->parked);
+        tfree(w->deque);
+        pthread_mutex_destroy(&w->lock);
+    }
+
+    pthread_cond_destroy(&c->wake);
+    pthread_mutex_destroy(&c->lock);
+    tfree(c->workers);
+    tfree(c);
+}
+
+// Place a new task on a worker's deque: our own if we're running on one of the workers,
+// otherwise we simply go round robin.
+static void tsched_place(tstate *s, tsched *c, ttask *t) {
+    struct tsched_worker *w = NULL;
+    for (tsize i = 0; i < c->n && s; i++) {
+        if (c->workers[i].state == s) {
+            w = &c->workers[i];
+        }
+    }
+    if (!w) {
+        w = &c->workers[__atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED) % c->n];
+    }
+
+    if (!tsched_push(w, t)) {
+        ttask_release(t);
+        if (s) {
+            TET_THROWRAW(s, s->memerr);
+        }
+    }
+}
+
+ttask *tsched_spawn(tsched *c, char *src) {
+    ttask *t = ttask_new(c);
+    if (!t) return NULL;
+
+    t->src = talloc(strlen(src) + 1);
+    if (!t->src) {
+        ttask_release(t);
+        return NULL;
+    }
+    strcpy(t->src, src);
+
+    // One reference for the scheduler, one for the caller.
+    ttask_retain(t);
+    if (!tsched_push(&c->workers[__atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED) % c->n], t)) {
+        ttask_release(t);
+        ttask_release(t);
+        return NULL;
+    }
+    return t;
+}
+
+// Block the calling thread until t has finished.
+static void tsched_wait(ttask *t) {
+    tsched *c = t->sched;
+    pthread_mutex_lock(&c->lock);
+    while (__atomic_load_n(&t->status, __ATOMIC_ACQUIRE) < TTASK_DONE) {
+        pthread_cond_wait(&c->wake, &c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Take t out of our run queue, returning whether it was there.
+static bool tsched_unqueue(struct tsched_worker *w, ttask *t) {
+    ttask *prev = NULL;
+    for (ttask *q = w->head; q != NULL; prev = q, q = q->next) {
+        if (q != t) continue;
+        if (prev) {
+            prev->next = t->next;
+        } else {
+            w->head = t->next;
+        }
+        if (w->tail == t) {
+            w->tail = prev;
+        }
+        t->next = NULL;
+        return true;
+    }
+    return false;
+}
+
+// Run a task of ours to completion within a builtin of the task s is running.
+static void tsched_run(struct tsched_worker *w, ttask *t) {
+    tstate *s = w->state;
+    ttask *joiner = s->task;
+
+    // Errors starting or finishing it fail the task, like in tsched_step. We don't hold
+    // a handler while it runs though, which would take one more level of nesting from
+    // every join (tet_run returns the errors of the run itself).
+    TET_CATCH(s, err, {
+        tsched_finish(w, t, err, true);
+        return;
+    });
+    if (!t->root) {
+        tsched_start(w, t);
+    }
+    TET_UNCATCH(s);
+
+    // Nested as we are it can't yield (see tet_can_yield), so this is all it takes.
+    s->task = t;
+    tval *volatile err = NULL;
+    while (t->cur && !err) {
+        err = tet_run(s, t->root, &t->cur, 0);
+    }
+    s->task = joiner;
+
+    TET_CATCH(s, err, {
+        tsched_finish(w, t, err, true);
+        return;
+    });
+    if (err) {
+        tsched_finish(w, t, err, true);
+    } else {
+        tframe *r = t->root;
+        tsched_finish(w, t, r->obji ? r->objs[0] : tval_sexpr(s, NULL, NULL), false);
+    }
+    TET_UNCATCH(s);
+}
+
+// Join t from a run nested in a builtin of the task s is running, which can't suspend
+// until t is done. Rather than block our worker on a task that may well be queued behind
+// us, we run t right here if it hasn't started yet or is suspended in our run queue (or
+// parked, its I/O then blocks). It is done on return, unless it's running elsewhere (or
+// further out on our own stack).
+static void tsched_help(tstate *s, ttask *t) {
+    // Once t is ours it has to finish: we need room for a handler of tsched_run, and for
+    // the two more that freezing its result takes (see tsched_result).
+    tstate_jmps_room(s, 3);
+
+    struct tsched_worker *w = tsched_worker_of(s);
+    if (tsched_claim(t)) {
+        // It is still in a deque, the worker that pops it drops this reference.
+        ttask_retain(t);
+    } else if (t->fd >= 0 && t->parkedi < w->parkedi && w->parked[t->parkedi] == t) {
+        tsched_unlink(w, t);
+    } else if (!tsched_unqueue(w, t)) {
+        return;
+    }
+    tsched_run(w, t);
+}
+
+// Copy the result of a finished task into s. Returns an error tval if it failed.
+static tval *tsched_thaw(tstate *s, ttask *t, tval **r) {
+    *r = NULL;
+    if (!t->result) {
+        return tval_err(s, "task failed");
+    }
+
+    tval *v = tval_copy_from(s, t->result->root, t->result);
+    if (__atomic_load_n(&t->status, __ATOMIC_ACQUIRE) == TTASK_FAILED) {
+        return v;
+    }
+    *r = v;
+    return NULL;
+}
+
+tval *tsched_join(tstate *s, ttask *t, tval **r) {
+    tsched_wait(t);
+
+    TET_CATCH(s, err, {
+        *r = NULL;
+        return err;
+    });
+
+    tval *err = tsched_thaw(s, t, r);
+
+    TET_UNCATCH(s);
+    return err;
+}
+
+
+//   __  __    _    ___ _     ____   _____  __
+//  |  \/  |  / \  |_ _| |   | __ ) / _ \ \/ /
+//  | |\/| | / _ \  | || |   |  _ \| | | \  /
+//  | |  | |/ ___ \ | || |___| |_) | |_| /  \
+//  |_|  |_/_/   \_\___|_____|____/ \___/_/\_\
+//
+
+tmailbox *tmailbox_new(tsize cap) {
+    // With a single slot, a full slot would look free to the next sender (its sequence
+    // number would equal the next position), so we need at least two.
+    tsize l = 2;
+    while (l < cap) l *= 2;
+
+    tmailbox *m = talloc(sizeof(tmailbox));
+    if (!m) {
+        return NULL;
+    }
+    m->slots = talloc(l * sizeof(struct tmailbox_slot));
+    if (!m->slots) {
+        tfree(m);
+        return NULL;
+    }
+
+    // Slot i is free for whoever sends at position i.
+    for (tsize i = 0; i < l; i++) {
+        m->slots[i].seq = i;
+        m->slots[i].msg = NULL;
+        m->slots[i].val = NULL;
+        m->slots[i].num = 0;
+        m->slots[i].number = false;
+        m->slots[i].copied = false;
+    }
+
+    m->refs = 1;
+    m->mask = l - 1;
+    m->head = 0;
+    m->tail = 0;
+    m->waiting = 0;
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->wake, NULL);
+    return m;
+}
+
+void tmailbox_retain(tmailbox *m) {
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+}
+
+void tmailbox_release(tmailbox *m) {
+    if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL)) return;
+
+    // Drop the messages nobody is going to receive anymore.
+    for (tsize i = m->tail; i != m->head; i++) {
+        if (m->slots[i & m->mask].msg) {
+            tfrozen_release(m->slots[i & m->mask].msg);
+        }
+    }
+
+    pthread_mutex_destroy(&m->lock);
+    pthread_cond_destroy(&m->wake);
+    tfree(m->slots);
+    tfree(m);
+}
+
+// Put message 'r' in the first free slot, returning false if there is none.
+static bool tmailbox_put(tmailbox *m, struct tmailbox_slot *r) {
+    tsize pos = __atomic_load_n(&m->head, __ATOMIC_RELAXED);
+    while (1) {
+        struct tmailbox_slot *l = &m->slots[pos & m->mask];
+        intptr_t dif = (intptr_t) __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE) - (intptr_t) pos;
+        if (dif == 0) {
+            // The slot is free, claim it (or retry at whatever position we lost it to).
+            if (__atomic_compare_exchange_n(&m->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                l->msg = r->msg;
+                l->val = r->val;
+                l->num = r->num;
+                l->number = r->number;
+                l->copied = r->copied;
+                __atomic_store_n(&l->seq, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (dif < 0) {
+            // The slot still holds the message from a lap ago, we're full.
+            return false;
+        } else {
+            pos = __atomic_load_n(&m->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Take the oldest message out of its slot, returning false if there is none.
+static bool tmailbox_take(tmailbox *m, struct tmailbox_slot *r) {
+    tsize pos = __atomic_load_n(&m->tail, __ATOMIC_RELAXED);
+    while (1) {
+        struct tmailbox_slot *l = &m->slots[pos & m->mask];
+        intptr_t dif = (intptr_t) __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE) - (intptr_t) (pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&m->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *r = *l;
+                // Free the slot for whoever sends at this position in the next lap.
+                __atomic_store_n(&l->seq, pos + m->mask + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (dif < 0) {
+            // Nothing was sent at this position yet, we're empty.
+            return false;
+        } else {
+            pos = __atomic_load_n(&m->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static bool tmailbox_full(tmailbox *m) {
+    return __atomic_load_n(&m->head, __ATOMIC_RELAXED) -
+           __atomic_load_n(&m->tail, __ATOMIC_RELAXED) > m->mask;
+}
+
+// Wake up everybody waiting on m, if there is anybody. Waiters register themselves
+// before they check the ring one last time and we check for them after having changed
+// it, so one of us is bound to see the other.
+static void tmailbox_notify(tmailbox *m) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&m->waiting, __ATOMIC_SEQ_CST)) return;
+
+    pthread_mutex_lock(&m->lock);
+    pthread_cond_broadcast(&m->wake);
+    pthread_mutex_unlock(&m->lock);
+}
+
+// Wait on m until woken up or until the deadline passes (if any), returning false in
+// the latter case. Must be called with m->lock held and after having registered.
+static bool tmailbox_wait(tmailbox *m, struct timespec *deadline) {
+    if (!deadline) {
+        pthread_cond_wait(&m->wake, &m->lock);
+        return true;
+    }
+    return pthread_cond_timedwait(&m->wake, &m->lock, deadline) != ETIMEDOUT;
+}
+
+static struct timespec tmailbox_deadline(long timeout) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000;
+    ts.tv_nsec += (timeout % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+bool tmailbox_send(tstate *s, tmailbox *m, tval *v, long timeout) {
+    // Numbers and nil need no region, they go in the slot as they are. Frozen values are
+    // sent as they are, anything else is frozen into a region of its own first.
+    struct tmailbox_slot l = {0, NULL, v, 0, false, false};
+    if (v && v->type == TVAL_NUMBER) {
+        l.val = NULL;
+        l.num = v->num;
+        l.number = true;
+    } else if (v && TOBJ_FROZEN(v)) {
+        l.msg = tfrozen_of(v);
+        tfrozen_retain(l.msg);
+    } else if (v) {
+        l.msg = tfrozen_new(s, v);
+        l.val = l.msg->root;
+        l.copied = true;
+    }
+
+    bool sent = tmailbox_put(m, &l);
+    if (!sent && timeout) {
+        struct timespec ts = tmailbox_deadline(timeout);
+        pthread_mutex_lock(&m->lock);
+        __atomic_add_fetch(&m->waiting, 1, __ATOMIC_SEQ_CST);
+        while (!(sent = tmailbox_put(m, &l))) {
+            if (!tmailbox_wait(m, timeout < 0 ? NULL : &ts)) {
+                sent = tmailbox_put(m, &l);
+                break;
+            }
+        }
+        __atomic_sub_fetch(&m->waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&m->lock);
+    }
+
+    if (!sent) {
+        if (l.msg) {
+            tfrozen_release(l.msg);
+        }
+        return false;
+    }
+    tmailbox_notify(m);
+    return true;
+}
+
+bool tmailbox_recv(tstate *s, tmailbox *m, long timeout, tval **r) {
+    TET_CATCHABLE(s);
+    struct tmailbox_slot l;
+    bool received = tmailbox_take(m, &l);
+    if (!received && timeout) {
+        struct timespec ts = tmailbox_deadline(timeout);
+        pthread_mutex_lock(&m->lock);
+        __atomic_add_fetch(&m->waiting, 1, __ATOMIC_SEQ_CST);
+        while (!(received = tmailbox_take(m, &l))) {
+            if (!tmailbox_wait(m, timeout < 0 ? NULL : &ts)) {
+                received = tmailbox_take(m, &l);
+                break;
+            }
+        }
+        __atomic_sub_fetch(&m->waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&m->lock);
+    }
+
+    if (!received) {
+        return false;
+    }
+    tmailbox_notify(m);
+
+    // Without a region there is nothing we could leak.
+    if (!l.msg) {
+        *r = l.number ? tval_num(s, l.num) : NULL;
+        return true;
+    }
+
+    // The message is ours now, so it must not leak should we fail to take it in.
+    TET_CATCH(s, err, {
+        tfrozen_release(l.msg);
+        TET_THROWRAW(s, err);
+    });
+
+    if (l.copied) {
+        // Nobody else refers to this region, copy the message out and let it go.
+        *r = tval_copy_from(s, l.val, l.msg);
+    } else {
+        tstate_hold(s, l.msg);
+        *r = l.val;
+    }
+
+    TET_UNCATCH(s);
+    tfrozen_release(l.msg);
+    return true;
+}
+
+
+//   _   _ _____    _    ____  ____  ____   ___  _____
+//  | | | | ____|  / \  |  _ \|  _ \|  _ \ / _ \|  ___|
+//  | |_| |  _|   / _ \ | |_) | |_) | |_) | | | | |_
+//  |  _  | |___ / ___ \|  __/|  __/|  _ <| |_| |  _|
+//  |_| |_|_____/_/   \_\_|   |_|   |_| \_\\___/|_|
+//
+
+// The name a function is known by in 'e', or what kind of function it is if it has none.
+static char *tprof_name(tenv *e, tval *fn) {
+    for (; e; e = e->prev) {
+        for (tval *c = e->vars; c != NULL; c = c->cdr) {
+            if (c->car->cdr == fn) {
+                return c->car->car->sym;
+            }
+        }
+    }
+    return fn->type == TVAL_LAMBDA ? "<lambda>" : fn->type == TVAL_BUILTIN ? "<builtin>" : "?";
+}
+
+// Write the tet call stack of the running frame chain into 'buf', outermost first.
+static void tprof_stack(tstate *s, char *buf, tsize l) {
+    buf[0] = 0;
+    if (!s->running) return;
+
+    // Collect the frames innermost first (frames only know their caller), then write
+    // them out in reverse. Frames still evaluating their function are skipped.
+    tframe *frames[TET_HEAPPROF_STACK / 2];
+    tsize n = 0;
+    for (tframe *f = *s->running; f && n < TET_HEAPPROF_STACK / 2; f = f->prev) {
+        if (f->obji && f->objs[0]) {
+            frames[n++] = f;
+        }
+    }
+
+    tsize i = 0;
+    while (n--) {
+        tframe *f = frames[n];
+        int w = snprintf(buf + i, l - i, "%s%s", i ? ";" : "", tprof_name(f->env, f->objs[0]));
+        if (w < 0 || (tsize) w >= l - i) {
+            buf[i] = 0;
+            break;
+        }
+        i += w;
+    }
+}
+
+static void theapprof_sample(tstate *s, tobj *o, tsize l) {
+    theapprof *p = s->heapprof;
+    if (p->next > l) {
+        p->next -= l;
+        return;
+    }
+
+    // Pick the next sample at a random distance, so allocation patterns that repeat
+    // every so many bytes aren't always (or never) sampled. On average it's 'rate'.
+    p->seed ^= p->seed << 13;
+    p->seed ^= p->seed >> 7;
+    p->seed ^= p->seed << 17;
+    p->next = 1 + p->seed % (2 * p->rate);
+
+    // This sample stands in for the allocations since the last one.
+    tsize allocs = l < p->rate ? p->rate / l : 1;
+    tsize bytes = allocs * l;
+
+    // Where are we? We skip our own C frame. The profile is best effort, we drop the
+    // sample rather than throw if we run out of memory while recording it.
+    char stack[TET_HEAPPROF_STACK];
+    tprof_stack(s, stack, TET_HEAPPROF_STACK);
+    void *pcs[TET_HEAPPROF_CDEPTH + 1];
+    int pcn = backtrace(pcs, TET_HEAPPROF_CDEPTH + 1) - 1;
+    if (pcn < 0) pcn = 0;
+
+    // Find the site, or add it.
+    tsize i;
+    for (i = 0; i < p->sitei; i++) {
+        struct theapprof_site *t = &p->sites[i];
+        if (t->pcn == (tsize) pcn && !memcmp(t->pcs, pcs + 1, pcn * sizeof(void *)) &&
+            !strcmp(t->stack, stack)) {
+            break;
+        }
+    }
+    if (i == p->sitei) {
+        if (p->sitei >= p->sitel) {
+            tsize sl = p->sitel ? p->sitel * 2 : 16;
+            struct theapprof_site *sites = trealloc(p->sites, sl * sizeof(*sites));
+            if (!sites) return;
+            p->sites = sites;
+            p->sitel = sl;
+        }
+        char *c = talloc(strlen(stack) + 1);
+        if (!c) return;
+        strcpy(c, stack);
+
+        struct theapprof_site *t = &p->sites[p->sitei++];
+        memset(t, 0, sizeof(*t));
+        t->stack = c;
+        memcpy(t->pcs, pcs + 1, pcn * sizeof(void *));
+        t->pcn = pcn;
+    }
+
+    // Remember the object, so we can take it off the live counts once it's freed.
+    if (p->obji >= p->objl) {
+        tsize ol = p->objl ? p->objl * 2 : 64;
+        struct theapprof_obj *objs = trealloc(p->objs, ol * sizeof(*objs));
+        if (!objs) return;
+        p->objs = objs;
+        p->objl = ol;
+    }
+    p->objs[p->obji++] = (struct theapprof_obj) {o, i, allocs, bytes};
+    o->flags |= TOBJ_FLAG_SAMPLED;
+
+    struct theapprof_site *t = &p->sites[i];
+    t->allocs += allocs;
+    t->bytes += bytes;
+    t->liveallocs += allocs;
+    t->livebytes += bytes;
+}
+
+static void theapprof_free(theapprof *p, tobj *o) {
+    // There are few sampled objects compared to the heap, a linear search will do.
+    for (tsize i = p->obji; i-- > 0;) {
+        struct theapprof_obj *b = &p->objs[i];
+        if (b->obj == o) {
+            p->sites[b->site].liveallocs -= b->allocs;
+            p->sites[b->site].livebytes -= b->bytes;
+            *b = p->objs[--p->obji];
+            return;
+        }
+    }
+}
+
+static void theapprof_del(theapprof *p) {
+    for (tsize i = 0; i < p->sitei; i++) {
+        tfree(p->sites[i].stack);
+    }
+    tfree(p->sites);
+    tfree(p->objs);
+    tfree(p);
+}
+
+void theapprof_dump(theapprof *p, FILE *out, bool live) {
+    for (tsize i = 0; i < p->sitei; i++) {
+        struct theapprof_site *t = &p->sites[i];
+        tsize bytes = live ? t->livebytes : t->bytes;
+        if (!bytes) continue;
+
+        fputs(t->stack[0] ? t->stack : "<c>", out);
+
+        // C frames, outermost first. Static functions have no dynamic symbols, so we
+        // write offsets from the nearest symbol (or object) for addr2line to resolve.
+        for (tsize j = t->pcn; j-- > 0;) {
+            char *pc = t->pcs[j];
+            Dl_info di;
+            if (!dladdr(pc, &di)) {
+                fprintf(out, ";%p", pc);
+            } else if (di.dli_sname) {
+                fprintf(out, ";%s+0x%zx", di.dli_sname, (size_t) (pc - (char *) di.dli_saddr));
+            } else {
+                char *name = strrchr(di.dli_fname, '/');
+                fprintf(out, ";%s+0x%zx", name ? name + 1 : di.dli_fname,
+                        (size_t) (pc - (char *) di.dli_fbase));
+            }
+        }
+        fprintf(out, " %zu\n", bytes);
+    }
+}
+
+
+//    ____ ____  _   _ ____  ____   ___  _____
+//   / ___|  _ \| | | |  _ \|  _ \ / _ \|  ___|
+//  | |   | |_) | | | | |_) | |_) | | | | |_
+//  | |___|  __/| |_| |  __/|  _ <| |_| |  _|
+//   \____|_|    \___/|_|   |_| \_\\___/|_|
+//
+
+// Ticks of the CPU timer of this thread, counted by the signal handler.
+static __thread volatile sig_atomic_t tcpuprof_ticks;
+
+static void tcpuprof_signal(int sig) {
+    (void) sig;
+    tcpuprof_ticks++;
+}
+
+static void tcpuprof_install() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = tcpuprof_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+}
+
+static bool tcpuprof_start(tcpuprof *p) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, tcpuprof_install);
+
+    // The timer runs on the CPU time of this thread and signals only this thread.
+    struct sigevent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_THREAD_ID;
+    ev.sigev_signo = SIGPROF;
+    ev._sigev_un._tid = (pid_t) syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &ev, &p->timer)) {
+        return false;
+    }
+
+    long ns = 1000000000L / (long) p->hz;
+    struct itimerspec it;
+    it.it_interval.tv_sec = ns / 1000000000L;
+    it.it_interval.tv_nsec = ns % 1000000000L;
+    it.it_value = it.it_interval;
+    if (timer_settime(p->timer, 0, &it, NULL)) {
+        timer_delete(p->timer);
+        return false;
+    }
+
+    p->seen = tcpuprof_ticks;
+    return true;
+}
+
+static void tcpuprof_tick(tstate *s) {
+    tcpuprof *p = s->cpuprof;
+    tsize ticks = (tsize) tcpuprof_ticks;
+    if (ticks == p->seen) return;
+    tsize n = ticks - p->seen;
+    p->seen = ticks;
+
+    char stack[TET_HEAPPROF_STACK];
+    tprof_stack(s, stack, TET_HEAPPROF_STACK);
+
+    // Find the stack, or add it. As with heap profiles we drop the sample rather than
+    // throw if we run out of memory.
+    tsize i;
+    for (i = 0; i < p->sitei; i++) {
+        if (!strcmp(p->sites[i].stack, stack)) break;
+    }
+    if (i == p->sitei) {
+        if (p->sitei >= p->sitel) {
+            tsize sl = p->sitel ? p->sitel * 2 : 16;
+            struct tcpuprof_site *sites = trealloc(p->sites, sl * sizeof(*sites));
+            if (!sites) return;
+            p->sites = sites;
+            p->sitel = sl;
+        }
+        char *c = talloc(strlen(stack) + 1);
+        if (!c) return;
+        strcpy(c, stack);
+        p->sites[p->sitei++] = (struct tcpuprof_site) {c, 0};
+    }
+    p->sites[i].ticks += n;
+}
+
+static void tcpuprof_del(tcpuprof *p) {
+    timer_delete(p->timer);
+    for (tsize i = 0; i < p->sitei; i++) {
+        tfree(p->sites[i].stack);
+    }
+    tfree(p->sites);
+    tfree(p);
+}
+
+void tcpuprof_dump(tcpuprof *p, FILE *out) {
+    for (tsize i = 0; i < p->sitei; i++) {
+        struct tcpuprof_site *t = &p->sites[i];
+        fprintf(out, "%s %zu\n", t->stack[0] ? t->stack : "<top>", t->ticks);
+    }
+}
+
+
+//   _____ ____      _    ____ _____
+//  |_   _|  _ \    / \  / ___| ____|
+//    | | | |_) |  / _ \| |   |  _|
+//    | | |  _ <  / ___ \ |___| |___
+//    |_| |_| \_\/_/   \_\____|_____|
+//
+
+void ttrace_record(tstate *s, ttracekind kind, uint64_t a, uint64_t b) {
+#if TET_TRACE
+    if (!s->trace) return;
+
+    // Only we write to the trace, so claiming the next slot needs no compare and swap.
+    // The sequence number is cleared before and set after writing the other fields,
+    // and it is the last thing a reader looks at.
+    uint64_t i = __atomic_load_n(&s->tracei, __ATOMIC_RELAXED);
+    ttrace_event *e = &s->trace[i & (TET_TRACE_LEN - 1)];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    __atomic_store_n(&e->ns, (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->kind, (uint64_t) kind, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->a, a, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->b, b, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&e->seq, i + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->tracei, i + 1, __ATOMIC_RELEASE);
+#else
+    (void) s;
+    (void) kind;
+    (void) a;
+    (void) b;
+#endif
+}
+
+tsize ttrace_read(tstate *s, ttrace_event *buf, tsize n) {
+#if TET_TRACE
+    if (!s->trace) return 0;
+
+    uint64_t end = __atomic_load_n(&s->tracei, __ATOMIC_ACQUIRE);
+    if (n > TET_TRACE_LEN) n = TET_TRACE_LEN;
+    uint64_t start = end > n ? end - n : 0;
+
+    tsize c = 0;
+    for (uint64_t i = start; i < end; i++) {
+        ttrace_event *e = &s->trace[i & (TET_TRACE_LEN - 1)];
+        uint64_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        ttrace_event r;
+        r.ns = __atomic_load_n(&e->ns, __ATOMIC_RELAXED);
+        r.kind = __atomic_load_n(&e->kind, __ATOMIC_RELAXED);
+        r.a = __atomic_load_n(&e->a, __ATOMIC_RELAXED);
+        r.b = __atomic_load_n(&e->b, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        // Skip the event if it was overwritten before or while we read it.
+        if (seq != i + 1 || __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) continue;
+        r.seq = seq;
+        buf[c++] = r;
+    }
+    return c;
+#else
+    (void) s;
+    (void) buf;
+    (void) n;
+    return 0;
+#endif
+}
+
+char *ttracekind_print(ttracekind k) {
+    switch (k) {
+        case TTRACE_THROW:
+            return "THROW";
+        case TTRACE_CATCH:
+            return "CATCH";
+        case TTRACE_GC:
+            return "GC";
+        case TTRACE_SWEEP:
+            return "SWEEP";
+        case TTRACE_CALL:
+            return "CALL";
+        case TTRACE_EVAL:
+            return "EVAL";
+    }
+    return 0;
+}
+
+void ttrace_dump(tstate *s, FILE *out) {
+#if TET_TRACE
+    // The buffer is rather large for the stack.
+    ttrace_event *buf = talloc(TET_TRACE_LEN * sizeof(ttrace_event));
+    if (!buf) return;
+
+    tsize n = ttrace_read(s, buf, TET_TRACE_LEN);
+    for (tsize i = 0; i < n; i++) {
+        ttrace_event *e = &buf[i];
+        fprintf(out, "%llu %llu.%09llu %s", (unsigned long long) e->seq - 1,
+                (unsigned long long) (e->ns / 1000000000), (unsigned long long) (e->ns % 1000000000),
+                ttracekind_print((ttracekind) e->kind));
+        switch (e->kind) {
+            case TTRACE_GC:
+                fprintf(out, " marked %llu garbage %llu\n", (unsigned long long) e->a, (unsigned long long) e->b);
+                break;
+            case TTRACE_SWEEP:
+                fprintf(out, " left %llu\n", (unsigned long long) e->a);
+                break;
+            case TTRACE_CALL:
+                fprintf(out, " %p args %llu\n", (void *) (uintptr_t) e->b, (unsigned long long) e->a);
+                break;
+            case TTRACE_EVAL:
+                fprintf(out, " %s %p\n", tvaltype_print((tvaltype) e->a), (void *) (uintptr_t) e->b);
+                break;
+            default:
+                fprintf(out, " %p\n", (void *) (uintptr_t) e->b);
+                break;
+        }
+    }
+    tfree(buf);
+#else
+    (void) s;
+    (void) out;
+#endif
+}
+
+
+//       _ ___ _____
+//      | |_ _|_   _|
+//   _  | || |  | |
+//  | |_| || |  | |
+//   \___/|___| |_|
+//
+
+#if TET_JIT
+
+// Marks the slot of a lambda we forgot, so that lookups probe past it.
+static tval tjit_removed;
+
+// Helpers called by compiled code, each the equivalent of a case in tet_run.
+
+static void tjit_lookup(tframe *f, tval *sym) {
+    tframe_push(f, tenv_lookup(f->env, sym));
+}
+
+static void tjit_quote(tframe *f, tval *v) {
+    tframe_push(f, tet_unquote(f->env->state, v));
+}
+
+static tframe *tjit_enter(tframe *f) {
+    tframe *nf = tframe_new(f->env);
+    nf->prev = f;
+    return nf;
+}
+
+static tframe *tjit_call(tframe *f) {
+    tstate *s = f->env->state;
+    tval *fn = f->objs[0];
+    TET_TRACE_EVENT(s, TET_TRACE_CALL, TTRACE_CALL, f->obji - 1, fn);
+
+    // Outside of tasks a builtin that yields is resumed right away, like tet_eval does.
+    tsize c = fn->fast && tet_fastcall(s, f, fn->fast) ? 1 : fn->builtin(f);
+    while (s->yield) {
+        s->yield = false;
+        f->flags |= TOBJ_FLAG_YIELDED;
+        c = fn->builtin(f);
+    }
+    f->flags &= ~TOBJ_FLAG_YIELDED;
+
+    if (f->obji < c) {
+        TET_THROW(s, "builtin wants to return %zu values, but there are only "
+                     "%zu values on the stack", c, f->obji);
+    }
+    for (tsize i = f->obji - c; i < f->obji; i++) {
+        tframe_push(f->prev, f->objs[i]);
+    }
+    return f->prev;
+}
+
+// Code being generated, and the guards it needs.
+typedef struct tjit_buf {
+    unsigned char *code;
+    tsize codei;
+    tsize codel;
+    struct tjit_guard *guards;
+    tsize guardi;
+    tsize guardl;
+    bool failed;
+} tjit_buf;
+
+static void tjit_emit(tjit_buf *b, const void *bytes, tsize n) {
+    if (b->codei + n > b->codel) {
+        tsize l = b->codel ? b->codel * 2 : 256;
+        while (l < b->codei + n) l *= 2;
+        unsigned char *code = trealloc(b->code, l);
+        if (!code) {
+            b->failed = true;
+            return;
+        }
+        b->code = code;
+        b->codel = l;
+    }
+    memcpy(b->code + b->codei, bytes, n);
+    b->codei += n;
+}
+
+static void tjit_emit_imm(tjit_buf *b, uint64_t imm) {
+    tjit_emit(b, &imm, 8); // x86-64 is little endian, like its immediates.
+}
+
+// fn(rbx, arg), where rbx holds the frame we're evaluating into.
+static void tjit_emit_call(tjit_buf *b, void *fn, void *arg) {
+    tjit_emit(b, "\x48\x89\xdf\x48\xbe", 5); // mov rdi, rbx; movabs rsi, arg
+    tjit_emit_imm(b, (uint64_t) (uintptr_t) arg);
+    tjit_emit(b, "\x48\xb8", 2); // movabs rax, fn
+    tjit_emit_imm(b, (uint64_t) (uintptr_t) fn);
+    tjit_emit(b, "\xff\xd0", 2); // call rax
+}
+
+// rbx = fn(rbx), to move to another frame.
+static void tjit_emit_frame(tjit_buf *b, void *fn) {
+    tjit_emit(b, "\x48\x89\xdf\x48\xb8", 5); // mov rdi, rbx; movabs rax, fn
+    tjit_emit_imm(b, (uint64_t) (uintptr_t) fn);
+    tjit_emit(b, "\xff\xd0\x48\x89\xc3", 5); // call rax; mov rbx, rax
+}
+
+static void tjit_guard(tjit_buf *b, tval *sym, tval *val) {
+    for (tsize i = 0; i < b->guardi; i++) {
+        if (!strcmp(b->guards[i].sym->sym, sym->sym)) return;
+    }
+    if (b->guardi >= b->guardl) {
+        tsize l = b->guardl ? b->guardl * 2 : 8;
+        struct tjit_guard *guards = trealloc(b->guards, l * sizeof(struct tjit_guard));
+        if (!guards) {
+            b->failed = true;
+            return;
+        }
+        b->guards = guards;
+        b->guardl = l;
+    }
+    b->guards[b->guardi++] = (struct tjit_guard) {sym, val};
+}
+
+// Emit code evaluating the values in list 'l' into the current frame, as if it were
+// being evaluated in env 'e'. Returns false if the list contains anything we can't
+// compile.
+static bool tjit_compile_list(tjit_buf *b, tenv *e, tval *l) {
+    for (; l; l = l->cdr) {
+        tval *v = l->car;
+        if (!v) return false;
+
+        switch (v->type) {
+            case TVAL_NUMBER:
+            case TVAL_BIGNUM:
+            case TVAL_VECTOR:
+            case TVAL_MAP:
+            case TVAL_SEQ:
+            case TVAL_BYTES:
+            case TVAL_STRING:
+            case TVAL_BUILTIN:
+            case TVAL_LAMBDA:
+                tjit_emit_call(b, tframe_push, v);
+                break;
+
+            case TVAL_SYMBOL:
+                tjit_emit_call(b, tjit_lookup, v);
+                break;
+
+            case TVAL_QEXPR:
+                tjit_emit_call(b, tjit_quote, v);
+                break;
+
+            case TVAL_SEXPR: {
+                // Only lists invoking a builtin by name, which we guard.
+                tval *head = v->car;
+                if (!head || head->type != TVAL_SYMBOL) return false;
+                tval *p = tenv_getpair(e, head);
+                if (!p || !p->cdr || p->cdr->type != TVAL_BUILTIN) return false;
+                tjit_guard(b, head, p->cdr);
+
+                tjit_emit_frame(b, tjit_enter);
+                tjit_emit_call(b, tframe_push, p->cdr);
+                if (!tjit_compile_list(b, e, v->cdr)) return false;
+                tjit_emit_frame(b, tjit_call);
+                break;
+            }
+
+            default:
+                return false;
+        }
+    }
+    return !b->failed;
+}
+
+static tjit_code *tjit_compile(tval *fn, tenv *e) {
+    tjit_buf b = {0};
+    tjit_emit(&b, "\x53\x48\x89\xfb", 4); // push rbx; mov rbx, rdi
+    bool ok = tjit_compile_list(&b, e, fn->body);
+    tjit_emit(&b, "\x5b\xc3", 2); // pop rbx; ret
+
+    tjit_code *c = NULL;
+    if (ok && !b.failed) {
+        c = talloc(sizeof(tjit_code) + b.guardi * sizeof(struct tjit_guard));
+    }
+    if (c) {
+        // Write the code while the memory is writable, then make it executable instead.
+        long page = sysconf(_SC_PAGESIZE);
+        c->len = (b.codei + page - 1) / page * page;
+        void *mem = mmap(NULL, c->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            memcpy(mem, b.code, b.codei);
+            if (mprotect(mem, c->len, PROT_READ | PROT_EXEC)) {
+                munmap(mem, c->len);
+                mem = MAP_FAILED;
+            }
+        }
+        if (mem == MAP_FAILED) {
+            tfree(c);
+            c = NULL;
+        } else {
+            c->fn = (tjit_fn) mem;
+            c->guardi = b.guardi;
+            if (b.guardi) {
+                memcpy(c->guards, b.guards, b.guardi * sizeof(struct tjit_guard));
+            }
+        }
+    }
+
+    tfree(b.code);
+    tfree(b.guards);
+    return c;
+}
+
+static void tjit_code_del(tjit_code *c) {
+    munmap((void *) c->fn, c->len);
+    tfree(c);
+}
+
+static tsize tjit_hash(tval *fn, tsize mask) {
+    return (tsize) (((uintptr_t) fn >> 4) * 11400714819323198485ull) & mask;
+}
+
+// Find the entry of 'fn', adding it if it is new.
+static struct tjit_entry *tjit_find(tstate *s, tjit *j, tval *fn) {
+    tsize mask = j->entryl - 1;
+    struct tjit_entry *free = NULL;
+    for (tsize i = tjit_hash(fn, mask);; i = (i + 1) & mask) {
+        struct tjit_entry *e = &j->entries[i];
+        if (e->fn == fn) return e;
+        if (e->fn == &tjit_removed && !free) free = e;
+        if (!e->fn) {
+            if (!free) {
+                free = e;
+                j->entryi++;
+            }
+            break;
+        }
+    }
+    *free = (struct tjit_entry) {fn, 0, NULL};
+
+    // Keep the table at most half full (counting removed entries), rebuilding it if not.
+    if (j->entryi * 2 > j->entryl) {
+        struct tjit_entry *old = j->entries;
+        tsize oldl = j->entryl;
+        tsize live = 0;
+        for (tsize i = 0; i < oldl; i++) {
+            if (old[i].fn && old[i].fn != &tjit_removed) live++;
+        }
+        tsize l = TET_JIT_LEN;
+        while (l < live * 4) l *= 2;
+
+        j->entries = tealloc(s, l * sizeof(struct tjit_entry));
+        memset(j->entries, 0, l * sizeof(struct tjit_entry));
+        j->entryl = l;
+        j->entryi = live;
+        struct tjit_entry *r = NULL;
+        for (tsize i = 0; i < oldl; i++) {
+            if (!old[i].fn || old[i].fn == &tjit_removed) continue;
+            tsize k = tjit_hash(old[i].fn, l - 1);
+            while (j->entries[k].fn) k = (k + 1) & (l - 1);
+            j->entries[k] = old[i];
+            if (old[i].fn == fn) r = &j->entries[k];
+        }
+        tfree(old);
+        return r;
+    }
+    return free;
+}
+
+bool tjit_run(tstate *s, tval *fn, tframe *f) {
+    // Plenty of lambdas are only ever invoked once (think of the ones passed to map), so
+    // we don't keep count of them until they're invoked again. Frozen lambdas we can't
+    // flag, those we always count.
+    if (!(fn->flags & (TOBJ_FLAG_CALLED | TOBJ_FLAG_FROZEN))) {
+        fn->flags |= TOBJ_FLAG_CALLED;
+        return false;
+    }
+
+    tjit *j = s->jitted;
+    if (!j) {
+        j = tralloc(s, sizeof(tjit));
+        j->entries = tralloc(s, TET_JIT_LEN * sizeof(struct tjit_entry));
+        memset(j->entries, 0, TET_JIT_LEN * sizeof(struct tjit_entry));
+        j->entryi = 0;
+        j->entryl = TET_JIT_LEN;
+        trforget(s, 2); // j, j->entries
+        s->jitted = j;
+    }
+
+    // Frozen lambdas are never freed by us, so tjit_forget doesn't see them go. We hold
+    // their region instead, so their entries stay theirs until we let go of both at once
+    // (see tstate_del).
+    struct tjit_entry *e = tjit_find(s, j, fn);
+    if (!e->calls && !e->code && (fn->flags & TOBJ_FLAG_FROZEN)) {
+        tstate_hold(s, tfrozen_of(fn));
+    }
+    if (!e->code) {
+        if (e->calls == (tsize) -1 || ++e->calls < TET_JIT_HOT) return false;
+        e->code = tjit_compile(fn, f->env);
+        if (!e->code) {
+            e->calls = (tsize) -1;
+            return false;
+        }
+    }
+
+    // Make sure every builtin the code invokes is still the one we compiled it with.
+    tjit_code *c = e->code;
+    for (tsize i = 0; i < c->guardi; i++) {
+        if (tenv_lookup(f->env, c->guards[i].sym) != c->guards[i].val) return false;
+    }
+
+    c->fn(f);
+    return true;
+}
+
+void tjit_forget(tjit *j, tval *fn) {
+    tsize mask = j->entryl - 1;
+    for (tsize i = tjit_hash(fn, mask); j->entries[i].fn; i = (i + 1) & mask) {
+        struct tjit_entry *e = &j->entries[i];
+        if (e->fn == fn) {
+            if (e->code) {
+                tjit_code_del(e->code);
+            }
+            *e = (struct tjit_entry) {&tjit_removed, 0, NULL};
+            return;
+        }
+    }
+}
+
+void tjit_del(tjit *j) {
+    for (tsize i = 0; i < j->entryl; i++) {
+        if (j->entries[i].code) {
+            tjit_code_del(j->entries[i].code);
+        }
+    }
+    tfree(j->entries);
+    tfree(j);
+}
+
+#endif
+
+
+//   ____ ___ ____ _   _ _   _ __  __
+//  | __ )_ _/ ___| \ | | | | |  \/  |
+//  |  _ \| | |  _|  \| | | | | |\/| |
+//  | |_) | | |_| | |\  | |_| | |  | |
+//  |____/___\____|_| \_|\___/|_|  |_|
+//
+
+// A bignum of 'n' limbs, all zero, allocated in one piece with them. Products of two
+// limbs plus two more still fit in 64 bits, which is what the arithmetic relies on.
+static tbig *tbig_new(tstate *s, tsize n) {
+    tbig *b = tealloc(s, sizeof(tbig) + n * sizeof(uint32_t));
+    b->neg = false;
+    b->n = n;
+    b->d = (uint32_t *) (b + 1);
+    memset(b->d, 0, n * sizeof(uint32_t));
+    return b;
+}
+
+static tbig *tbig_copy(tstate *s, tbig *b) {
+    tbig *r = tbig_new(s, b->n);
+    r->neg = b->neg;
+    memcpy(r->d, b->d, b->n * sizeof(uint32_t));
+    return r;
+}
+
+// Drop the most significant limbs that are zero.
+static tbig *tbig_trim(tbig *b) {
+    while (b->n > 1 && !b->d[b->n - 1]) {
+        b->n--;
+    }
+    if (b->n == 1 && !b->d[0]) {
+        b->neg = false;
+    }
+    return b;
+}
+
+// A bignum view of 'v', with its limbs in 'd'.
+static tbig tbig_of(tnum v, uint32_t d[2]) {
+    uint64_t m = v < 0 ? -(uint64_t) v : (uint64_t) v;
+    d[0] = (uint32_t) m;
+    d[1] = (uint32_t) (m >> 32);
+    tbig b = {v < 0, d[1] ? 2 : 1, d};
+    return b;
+}
+
+// Store b in 'r' if it fits a tnum.
+static bool tbig_num(tbig *b, tnum *r) {
+    if (b->n > 2) {
+        return false;
+    }
+    uint64_t m = b->d[0] | (b->n > 1 ? (uint64_t) b->d[1] << 32 : 0);
+    if (m > (uint64_t) INT64_MAX + b->neg) {
+        return false;
+    }
+    *r = b->neg ? -(tnum) (m - 1) - 1 : (tnum) m;
+    return true;
+}
+
+static bool tbig_zero(tbig *b) {
+    return b->n == 1 && !b->d[0];
+}
+
+// Compare the magnitudes of a and b.
+static int tbig_cmp(tbig *a, tbig *b) {
+    if (a->n != b->n) {
+        return a->n < b->n ? -1 : 1;
+    }
+    for (tsize i = a->n; i-- > 0;) {
+        if (a->d[i] != b->d[i]) {
+            return a->d[i] < b->d[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// Subtract the magnitude of y from the (at least as large) one of x, in place.
+static void tbig_subfrom(tbig *x, tbig *y) {
+    int64_t borrow = 0;
+    for (tsize i = 0; i < x->n; i++) {
+        int64_t t = (int64_t) x->d[i] - (i < y->n ? y->d[i] : 0) - borrow;
+        borrow = t < 0;
+        x->d[i] = (uint32_t) (t + (borrow << 32));
+    }
+    tbig_trim(x);
+}
+
+// a + b, or a - b if 'sub'.
+static tbig *tbig_add(tstate *s, tbig *a, tbig *b, bool sub) {
+    bool bneg = b->neg != sub;
+    if (a->neg == bneg) {
+        tsize n = (a->n > b->n ? a->n : b->n) + 1;
+        tbig *r = tbig_new(s, n);
+        uint64_t c = 0;
+        for (tsize i = 0; i < n; i++) {
+            c += (uint64_t) (i < a->n ? a->d[i] : 0) + (i < b->n ? b->d[i] : 0);
+            r->d[i] = (uint32_t) c;
+            c >>= 32;
+        }
+        r->neg = a->neg;
+        return tbig_trim(r);
+    }
+
+    // The signs differ, so we subtract the smaller magnitude from the larger one, which
+    // also gives the sign.
+    bool swap = tbig_cmp(a, b) < 0;
+    tbig *x = swap ? b : a;
+    tbig *y = swap ? a : b;
+    tbig *r = tbig_copy(s, x);
+    tbig_subfrom(r, y);
+    r->neg = !tbig_zero(r) && (swap ? bneg : a->neg);
+    return r;
+}
+
+static tbig *tbig_mul(tstate *s, tbig *a, tbig *b) {
+    tbig *r = tbig_new(s, a->n + b->n);
+    for (tsize i = 0; i < a->n; i++) {
+        uint64_t c = 0;
+        for (tsize j = 0; j < b->n; j++) {
+            c += (uint64_t) a->d[i] * b->d[j] + r->d[i + j];
+            r->d[i + j] = (uint32_t) c;
+            c >>= 32;
+        }
+        r->d[i + b->n] = (uint32_t) c;
+    }
+    r->neg = a->neg != b->neg;
+    return tbig_trim(r);
+}
+
+// a / b, rounded towards zero like C does. b must not be zero.
+static tbig *tbig_div(tstate *s, tbig *a, tbig *b) {
+    tbig *q = tralloc(s, sizeof(tbig) + a->n * sizeof(uint32_t));
+    q->n = a->n;
+    q->d = (uint32_t *) (q + 1);
+    memset(q->d, 0, a->n * sizeof(uint32_t));
+
+    if (b->n == 1) {
+        // Short division, a limb at a time.
+        uint64_t r = 0;
+        for (tsize i = a->n; i-- > 0;) {
+            r = r << 32 | a->d[i];
+            q->d[i] = (uint32_t) (r / b->d[0]);
+            r %= b->d[0];
+        }
+    } else {
+        // Shift and subtract, a bit at a time. The remainder stays below 2b, so it fits
+        // in one more limb than b.
+        tbig *r = tralloc(s, sizeof(tbig) + (b->n + 1) * sizeof(uint32_t));
+        r->neg = false;
+        r->n = 1;
+        r->d = (uint32_t *) (r + 1);
+        memset(r->d, 0, (b->n + 1) * sizeof(uint32_t));
+        for (tsize i = a->n * 32; i-- > 0;) {
+            uint32_t c = (a->d[i / 32] >> (i % 32)) & 1;
+            for (tsize j = 0; j <= b->n; j++) {
+                uint32_t t = r->d[j] >> 31;
+                r->d[j] = r->d[j] << 1 | c;
+                c = t;
+            }
+            r->n = b->n + 1;
+            tbig_trim(r);
+            if (tbig_cmp(r, b) >= 0) {
+                tbig_subfrom(r, b);
+                q->d[i / 32] |= (uint32_t) 1 << (i % 32);
+            }
+        }
+        tfree(r);
+        trforget(s, 1); // r
+    }
+    trforget(s, 1); // q
+
+    q->neg = a->neg != b->neg;
+    return tbig_trim(q);
+}
+
+// Parse the 'l' decimal digits at 'in'.
+static tbig *tbig_parse(tstate *s, char *in, tsize l) {
+    // Every 9 digits take less than a limb.
+    tbig *b = tbig_new(s, l / 9 + 1);
+    for (tsize i = 0; i < l; i++) {
+        uint64_t c = (uint64_t) (in[i] - '0');
+        for (tsize j = 0; j < b->n; j++) {
+            c += (uint64_t) b->d[j] * 10;
+            b->d[j] = (uint32_t) c;
+            c >>= 32;
+        }
+    }
+    return tbig_trim(b);
+}
+
+static void tbig_print(tprinter *p, tbig *b) {
+    // Divide a copy by 10^9 until nothing is left, which gives us the digits in groups
+    // of 9, least significant first.
+    uint32_t *d = talloc(b->n * sizeof(uint32_t));
+    uint32_t *g = talloc((b->n * 10 / 9 + 1) * sizeof(uint32_t));
+    if (!d || !g) {
+        tfree(d);
+        tfree(g);
+        tprinter_put(p, "<bignum>", 8);
+        return;
+    }
+    memcpy(d, b->d, b->n * sizeof(uint32_t));
+
+    tsize n = b->n;
+    tsize gi = 0;
+    while (n) {
+        uint64_t r = 0;
+        for (tsize i = n; i-- > 0;) {
+            r = r << 32 | d[i];
+            d[i] = (uint32_t) (r / 1000000000);
+            r %= 1000000000;
+        }
+        g[gi++] = (uint32_t) r;
+        while (n && !d[n - 1]) {
+            n--;
+        }
+    }
+
+    tprinter_num(p, b->neg ? -(tnum) g[--gi] : (tnum) g[--gi]);
+    while (gi) {
+        char c[9];
+        uint32_t x = g[--gi];
+        for (tsize i = 9; i-- > 0; x /= 10) {
+            c[i] = (char) ('0' + x % 10);
+        }
+        tprinter_put(p, c, 9);
+    }
+    tfree(d);
+    tfree(g);
+}
+
+
+//  __     _______ ____ _____ ___  ____
+//  \ \   / / ____/ ___|_   _/ _ \|  _ \
+//   \ \ / /|  _|| |     | || | | | |_) |
+//    \ V / | |__| |___  | || |_| |  _ <
+//     \_/  |_____\____| |_| \___/|_| \_\
+//
+
+// The numbers start TET_SIMD_ALIGN bytes in, so they are aligned for the widest loads we
+// do. The kernels below don't rely on that though: frozen vectors are only pointer-aligned.
+tvec *tvec_new(tstate *s, tsize n) {
+    void *p = NULL;
+    if (posix_memalign(&p, TET_SIMD_ALIGN, TET_SIMD_ALIGN + n * sizeof(tnum))) {
+        TET_THROWRAW(s, s->memerr);
+    }
+    tvec *v = p;
+    v->n = n;
+    v->d = (tnum *) ((char *) p + TET_SIMD_ALIGN);
+    return v;
+}
+
+// Every kernel comes in a plain version, and on x86-64 in SSE and AVX2 versions that the
+// dispatchers pick from. The checked ones return false if any element overflows, which
+// they detect a lane at a time: x + y overflowed into z iff x and y have the same sign
+// and z the other one, that is iff (x ^ z) & (y ^ z) is negative. There are no 64-bit
+// multiplies (or minimums) short of AVX-512, so products are always computed one by one.
+
+static bool tvec_sum_plain(const tnum *d, tsize n, tnum *r) {
+    tnum t = 0;
+    for (tsize i = 0; i < n; i++) {
+        if (__builtin_add_overflow(t, d[i], &t)) {
+            return false;
+        }
+    }
+    *r = t;
+    return true;
+}
+
+static bool tvec_addsub_plain(const tnum *a, const tnum *b, tnum *r, tsize n, bool sub) {
+    for (tsize i = 0; i < n; i++) {
+        if (sub ? __builtin_sub_overflow(a[i], b[i], &r[i])
+                : __builtin_add_overflow(a[i], b[i], &r[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static tnum tvec_minmax_plain(const tnum *d, tsize n, bool max) {
+    tnum m = d[0];
+    for (tsize i = 1; i < n; i++) {
+        if (max ? d[i] > m : d[i] < m) {
+            m = d[i];
+        }
+    }
+    return m;
+}
+
+#if TET_SIMD
+
+__attribute__((target("avx2")))
+static bool tvec_sum_avx2(const tnum *d, tsize n, tnum *r) {
+    __m256i t = _mm256_setzero_si256();
+    __m256i over = _mm256_setzero_si256();
+    tsize i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (d + i));
+        __m256i z = _mm256_add_epi64(t, x);
+        over = _mm256_or_si256(over, _mm256_and_si256(_mm256_xor_si256(t, z),
+                                                      _mm256_xor_si256(x, z)));
+        t = z;
+    }
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(over))) {
+        return false;
+    }
+    tnum lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, t);
+    tnum rest;
+    return tvec_sum_plain(lanes, 4, r) && tvec_sum_plain(d + i, n - i, &rest) &&
+           !__builtin_add_overflow(*r, rest, r);
+}
+
+static bool tvec_sum_sse(const tnum *d, tsize n, tnum *r) {
+    __m128i t = _mm_setzero_si128();
+    __m128i over = _mm_setzero_si128();
+    tsize i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (d + i));
+        __m128i z = _mm_add_epi64(t, x);
+        over = _mm_or_si128(over, _mm_and_si128(_mm_xor_si128(t, z), _mm_xor_si128(x, z)));
+        t = z;
+    }
+    if (_mm_movemask_pd(_mm_castsi128_pd(over))) {
+        return false;
+    }
+    tnum lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, t);
+    tnum rest;
+    return tvec_sum_plain(lanes, 2, r) && tvec_sum_plain(d + i, n - i, &rest) &&
+           !__builtin_add_overflow(*r, rest, r);
+}
+
+// x - y overflowed into z iff x and y have different signs and z has the one of y, that
+// is iff (x ^ y) & (x ^ z) is negative.
+__attribute__((target("avx2")))
+static bool tvec_addsub_avx2(const tnum *a, const tnum *b, tnum *r, tsize n, bool sub) {
+    __m256i over = _mm256_setzero_si256();
+    tsize i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+        __m256i z = sub ? _mm256_sub_epi64(x, y) : _mm256_add_epi64(x, y);
+        __m256i o = _mm256_xor_si256(sub ? x : y, z);
+        over = _mm256_or_si256(over, _mm256_and_si256(_mm256_xor_si256(x, sub ? y : z), o));
+        _mm256_storeu_si256((__m256i *) (r + i), z);
+    }
+    return !_mm256_movemask_pd(_mm256_castsi256_pd(over)) &&
+           tvec_addsub_plain(a + i, b + i, r + i, n - i, sub);
+}
+
+static bool tvec_addsub_sse(const tnum *a, const tnum *b, tnum *r, tsize n, bool sub) {
+    __m128i over = _mm_setzero_si128();
+    tsize i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *) (b + i));
+        __m128i z = sub ? _mm_sub_epi64(x, y) : _mm_add_epi64(x, y);
+        __m128i o = _mm_xor_si128(sub ? x : y, z);
+        over = _mm_or_si128(over, _mm_and_si128(_mm_xor_si128(x, sub ? y : z), o));
+        _mm_storeu_si128((__m128i *) (r + i), z);
+    }
+    return !_mm_movemask_pd(_mm_castsi128_pd(over)) &&
+           tvec_addsub_plain(a + i, b + i, r + i, n - i, sub);
+}
+
+// 64-bit compares need SSE4.2, so there is no SSE2 version of this one.
+__attribute__((target("avx2")))
+static tnum tvec_minmax_avx2(const tnum *d, tsize n, bool max) {
+    if (n < 4) {
+        return tvec_minmax_plain(d, n, max);
+    }
+    __m256i m = _mm256_loadu_si256((const __m256i *) d);
+    tsize i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (d + i));
+        __m256i gt = max ? _mm256_cmpgt_epi64(x, m) : _mm256_cmpgt_epi64(m, x);
+        m = _mm256_blendv_epi8(m, x, gt);
+    }
+    tnum lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, m);
+    tnum t = tvec_minmax_plain(lanes, 4, max);
+    for (; i < n; i++) {
+        if (max ? d[i] > t : d[i] < t) {
+            t = d[i];
+        }
+    }
+    return t;
+}
+
+__attribute__((target("sse4.2")))
+static tnum tvec_minmax_sse(const tnum *d, tsize n, bool max) {
+    if (n < 2) {
+        return tvec_minmax_plain(d, n, max);
+    }
+    __m128i m = _mm_loadu_si128((const __m128i *) d);
+    tsize i = 2;
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (d + i));
+        __m128i gt = max ? _mm_cmpgt_epi64(x, m) : _mm_cmpgt_epi64(m, x);
+        m = _mm_blendv_epi8(m, x, gt);
+    }
+    tnum lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, m);
+    tnum t = tvec_minmax_plain(lanes, 2, max);
+    for (; i < n; i++) {
+        if (max ? d[i] > t : d[i] < t) {
+            t = d[i];
+        }
+    }
+    return t;
+}
+
+#endif
+
+static bool tvec_sum(const tnum *d, tsize n, tnum *r) {
+#if TET_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return tvec_sum_avx2(d, n, r);
+    }
+    return tvec_sum_sse(d, n, r);
+#else
+    return tvec_sum_plain(d, n, r);
+#endif
+}
+
+static bool tvec_addsub(const tnum *a, const tnum *b, tnum *r, tsize n, bool sub) {
+#if TET_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return tvec_addsub_avx2(a, b, r, n, sub);
+    }
+    return tvec_addsub_sse(a, b, r, n, sub);
+#else
+    return tvec_addsub_plain(a, b, r, n, sub);
+#endif
+}
+
+// The minimum or maximum of the n > 0 numbers in d.
+static tnum tvec_minmax(const tnum *d, tsize n, bool max) {
+#if TET_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return tvec_minmax_avx2(d, n, max);
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return tvec_minmax_sse(d, n, max);
+    }
+#endif
+    return tvec_minmax_plain(d, n, max);
+}
+
+static tval *tvec_bigadd(tstate *s, tval *big, tbig *x) {
+    if (!big) {
+        big = tval_bignum(s, NULL);
+        big->big = tbig_copy(s, x);
+        return big;
+    }
+    tbig *n = tbig_add(s, big->big, x, false);
+    tfree(big->big);
+    big->big = n;
+    return big;
+}
+
+// The sum of a[i] * b[i], or of a[i] if b is NULL, computed exactly: like builtin_arith,
+// we keep what doesn't fit a tnum in a bignum, and return a NUMBER if the total does.
+static tval *tvec_total(tstate *s, const tnum *a, const tnum *b, tsize n) {
+    tnum r = 0;
+    tval *big = NULL;
+    uint32_t xd[2], yd[2];
+    for (tsize i = 0; i < n; i++) {
+        tnum t = a[i];
+        if (b && __builtin_mul_overflow(a[i], b[i], &t)) {
+            tbig x = tbig_of(a[i], xd);
+            tbig y = tbig_of(b[i], yd);
+            tval *p = tval_bignum(s, NULL);
+            p->big = tbig_mul(s, &x, &y);
+            big = tvec_bigadd(s, big, p->big);
+            continue;
+        }
+
+        tnum u;
+        if (!__builtin_add_overflow(r, t, &u)) {
+            r = u;
+            continue;
+        }
+        tbig x = tbig_of(r, xd);
+        big = tvec_bigadd(s, big, &x);
+        r = t;
+    }
+
+    if (big) {
+        tbig x = tbig_of(r, xd);
+        big = tvec_bigadd(s, big, &x);
+        if (!tbig_num(big->big, &r)) {
+            return big;
+        }
+    }
+    return tval_num(s, r);
+}
+
+// The vector argument i of a vector builtin.
+static tvec *tvec_arg(tframe *f, tsize i) {
+    tval *v = tframe_get(f, i);
+    if (!v || v->type != TVAL_VECTOR) {
+        TET_THROW(f->env->state, "type mismatch, got %s but expected VECTOR",
+                  v ? tvaltype_print(v->type) : "nil");
+    }
+    return v->vec;
+}
+
+
+//   __  __    _    ____
+//  |  \/  |  / \  |  _ \
+//  | |\/| | / _ \ | |_) |
+//  | |  | |/ ___ \|  __/
+//  |_|  |_/_/   \_\_|
+//
+
+static uint32_t tmap_fnv(uint32_t h, const void *p, tsize l) {
+    const unsigned char *c = p;
+    for (tsize i = 0; i < l; i++) {
+        h = (h ^ c[i]) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t tmap_hash(tval *k) {
+    if (!k) {
+        return 0;
+    }
+    switch (k->type) {
+        case TVAL_NUMBER: {
+            // The finalizer of MurmurHash3, so that every bit of the number counts.
+            uint64_t x = (uint64_t) k->num;
+            x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdull;
+            x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53ull;
+            return (uint32_t) (x ^ (x >> 33));
+        }
+        case TVAL_BIGNUM:
+            return tmap_fnv(2166136261u + k->big->neg, k->big->d, k->big->n * sizeof(uint32_t));
+        case TVAL_STRING:
+        case TVAL_SYMBOL:
+            return tmap_fnv(2166136261u + k->type, k->str, strlen(k->str));
+        case TVAL_BYTES:
+            return tmap_fnv(2166136261u + k->type, k->bytes->ptr, k->bytes->len);
+        case TVAL_SEXPR:
+        case TVAL_QEXPR: {
+            // Lists hash by their elements, so that equal lists find the same entry.
+            uint32_t h = 2166136261u + k->type;
+            for (tval *c = k; c != NULL; c = c->cdr) {
+                uint32_t e = tmap_hash(c->car);
+                h = tmap_fnv(h, &e, sizeof(e));
+            }
+            return h;
+        }
+        default:
+            return tmap_fnv(2166136261u, &k, sizeof(k));
+    }
+}
+
+static bool tmap_eq(tval *a, tval *b) {
+    if (a == b) {
+        return true;
+    }
+    if (!a || !b || a->type != b->type) {
+        return false;
+    }
+    switch (a->type) {
+        case TVAL_NUMBER:
+            return a->num == b->num;
+        case TVAL_BIGNUM:
+            return a->big->neg == b->big->neg && a->big->n == b->big->n &&
+                   !memcmp(a->big->d, b->big->d, a->big->n * sizeof(uint32_t));
+        case TVAL_STRING:
+        case TVAL_SYMBOL:
+            return !strcmp(a->str, b->str);
+        case TVAL_BYTES:
+            return a->bytes->len == b->bytes->len &&
+                   !memcmp(a->bytes->ptr, b->bytes->ptr, a->bytes->len);
+        case TVAL_SEXPR:
+        case TVAL_QEXPR:
+            for (; a && b; a = a->cdr, b = b->cdr) {
+                if (a->type != b->type || !tmap_eq(a->car, b->car)) {
+                    return false;
+                }
+            }
+            return !a && !b;
+        default:
+            return false;
+    }
+}
+
+static uint32_t tmap_bit(uint32_t h, tsize shift) {
+    return (uint32_t) 1 << ((h >> shift) & ((1 << TMAP_BITS) - 1));
+}
+
+// Where the entry for 'bit' is, or would go, in a node: the number of bits below it.
+// Counted by hand, as __builtin_popcount is a call into libgcc unless we may assume the
+// CPU has an instruction for it.
+static uint32_t tmap_index(tmapnode *x, uint32_t bit) {
+    uint32_t b = x->bitmap & (bit - 1);
+#ifdef __POPCNT__
+    return (uint32_t) __builtin_popcount(b);
+#else
+    b = b - ((b >> 1) & 0x55555555);
+    b = (b & 0x33333333) + ((b >> 2) & 0x33333333);
+    b = (b + (b >> 4)) & 0x0f0f0f0f;
+    return (b * 0x01010101) >> 24;
+#endif
+}
+
+// A node with room for 'n' entries, and none yet.
+static tmapnode *tmapnode_new(tstate *s, uint32_t n) {
+    tmapnode *x = tealloc(s, sizeof(tmapnode) + n * sizeof(tmapentry));
+    x->refs = 1;
+    x->bitmap = 0;
+    x->n = 0;
+    x->cap = n;
+    x->mark = GETMARK(s);
+    return x;
+}
+
+static void tmapnode_retain(tmapnode *x) {
+    if (x && x->refs) {
+        x->refs++;
+    }
+}
+
+static void tmapnode_release(tmapnode *x) {
+    if (!x || !x->refs || --x->refs) {
+        return;
+    }
+    for (uint32_t i = 0; i < x->n; i++) {
+        tmapnode_release(x->e[i].node);
+    }
+    tfree(x);
+}
+
+static tsize tmapnode_mark(tmapnode *x, tmark m) {
+    if (!x || !x->refs || x->mark == m) {
+        return 0;
+    }
+    x->mark = m;
+    tsize c = 0;
+    for (uint32_t i = 0; i < x->n; i++) {
+        tmapentry *e = &x->e[i];
+        c += e->node ? tmapnode_mark(e->node, m) : tval_mark(e->key, m) + tval_mark(e->val, m);
+    }
+    return c;
+}
+
+// Node 'x' with room for 'n' entries, belonging to the caller alone: x itself if the
+// caller held the only reference to it, a copy otherwise. Takes over that reference. A
+// node we own grows by doubling, as it is likely a transient being built up.
+static tmapnode *tmapnode_own(tstate *s, tmapnode *x, uint32_t n) {
+    if (x->refs == 1) {
+        if (n > x->cap) {
+            uint32_t cap = n > 2 * x->cap ? n : 2 * x->cap;
+            x = terealloc(s, x, sizeof(tmapnode) + cap * sizeof(tmapentry));
+            x->cap = cap;
+        }
+        return x;
+    }
+    tmapnode *r = tmapnode_new(s, n > x->n ? n : x->n);
+    r->bitmap = x->bitmap;
+    r->n = x->n;
+    memcpy(r->e, x->e, x->n * sizeof(tmapentry));
+    for (uint32_t i = 0; i < x->n; i++) {
+        tmapnode_retain(x->e[i].node);
+    }
+    tmapnode_release(x);
+    return r;
+}
+
+static tmapentry *tmap_find(tmapnode *x, uint32_t h, tval *k) {
+    for (tsize shift = 0; x; shift += TMAP_BITS) {
+        if (shift >= TMAP_END) {
+            for (uint32_t i = 0; i < x->n; i++) {
+                if (tmap_eq(x->e[i].key, k)) {
+                    return &x->e[i];
+                }
+            }
+            return NULL;
+        }
+        uint32_t bit = tmap_bit(h, shift);
+        if (!(x->bitmap & bit)) {
+            return NULL;
+        }
+        tmapentry *e = &x->e[tmap_index(x, bit)];
+        if (!e->node) {
+            return tmap_eq(e->key, k) ? e : NULL;
+        }
+        x = e->node;
+    }
+    return NULL;
+}
+
+// A node for the keys of entries a and b, whose hashes agree below 'shift'.
+static tmapnode *tmap_pair(tstate *s, tsize shift, tmapentry a, uint32_t ha, tmapentry b,
+                           uint32_t hb) {
+    if (shift >= TMAP_END) {
+        tmapnode *x = tmapnode_new(s, 2);
+        x->e[x->n++] = a;
+        x->e[x->n++] = b;
+        return x;
+    }
+    uint32_t ba = tmap_bit(ha, shift);
+    uint32_t bb = tmap_bit(hb, shift);
+    if (ba == bb) {
+        tmapentry c = {NULL, NULL, tmap_pair(s, shift + TMAP_BITS, a, ha, b, hb)};
+        tmapnode *x = tmapnode_new(s, 1);
+        x->bitmap = ba;
+        x->e[x->n++] = c;
+        return x;
+    }
+    tmapnode *x = tmapnode_new(s, 2);
+    x->bitmap = ba | bb;
+    x->e[x->n++] = ba < bb ? a : b;
+    x->e[x->n++] = ba < bb ? b : a;
+    return x;
+}
+
+// Map k (with hash h) to v in node x, which holds the keys whose hashes agree with h
+// below 'shift'. Takes over the caller's reference to x, and returns one to the result.
+static tmapnode *tmap_put_at(tstate *s, tmapnode *x, tsize shift, uint32_t h, tval *k,
+                             tval *v, bool *added) {
+    tmapentry kv = {k, v, NULL};
+    if (shift >= TMAP_END) {
+        for (uint32_t i = 0; i < x->n; i++) {
+            if (tmap_eq(x->e[i].key, k)) {
+                x = tmapnode_own(s, x, x->n);
+                x->e[i].val = v;
+                return x;
+            }
+        }
+        x = tmapnode_own(s, x, x->n + 1);
+        x->e[x->n++] = kv;
+        *added = true;
+        return x;
+    }
+
+    uint32_t bit = tmap_bit(h, shift);
+    uint32_t i = tmap_index(x, bit);
+    if (!(x->bitmap & bit)) {
+        x = tmapnode_own(s, x, x->n + 1);
+        memmove(&x->e[i + 1], &x->e[i], (x->n - i) * sizeof(tmapentry));
+        x->e[i] = kv;
+        x->n++;
+        x->bitmap |= bit;
+        *added = true;
+        return x;
+    }
+
+    tmapentry e = x->e[i];
+    if (e.node) {
+        x = tmapnode_own(s, x, x->n);
+        x->e[i].node = tmap_put_at(s, x->e[i].node, shift + TMAP_BITS, h, k, v, added);
+        return x;
+    }
+    if (tmap_eq(e.key, k)) {
+        if (e.val != v) {
+            x = tmapnode_own(s, x, x->n);
+            x->e[i].val = v;
+        }
+        return x;
+    }
+
+    // Another key takes the slot, the two of them move down into a node of their own.
+    tmapnode *c = tmap_pair(s, shift + TMAP_BITS, e, tmap_hash(e.key), kv, h);
+    x = tmapnode_own(s, x, x->n);
+    x->e[i].key = NULL;
+    x->e[i].val = NULL;
+    x->e[i].node = c;
+    *added = true;
+    return x;
+}
+
+// Remove k (with hash h), which must be there, from x. Like tmap_put_at, but returns
+// NULL if nothing is left. A node left with a single key is merged into its parent, so
+// that there is only ever one way to store a set of keys.
+static tmapnode *tmap_del_at(tstate *s, tmapnode *x, tsize shift, uint32_t h, tval *k) {
+    uint32_t i = 0;
+    uint32_t bit = 0;
+    if (shift >= TMAP_END) {
+        while (!tmap_eq(x->e[i].key, k)) {
+            i++;
+        }
+    } else {
+        bit = tmap_bit(h, shift);
+        i = tmap_index(x, bit);
+        if (x->e[i].node) {
+            x = tmapnode_own(s, x, x->n);
+            tmapnode *c = tmap_del_at(s, x->e[i].node, shift + TMAP_BITS, h, k);
+            if (c->n == 1 && !c->e[0].node) {
+                x->e[i] = c->e[0];
+                tmapnode_release(c);
+            } else {
+                x->e[i].node = c;
+            }
+            return x;
+        }
+    }
+
+    if (x->n == 1) {
+        tmapnode_release(x);
+        return NULL;
+    }
+    x = tmapnode_own(s, x, x->n);
+    memmove(&x->e[i], &x->e[i + 1], (x->n - i - 1) * sizeof(tmapentry));
+    x->n--;
+    x->bitmap &= ~bit;
+    return x;
+}
+
+// A copy of x (and everything in it) for state 's', see tval_copy_from.
+static tmapnode *tmapnode_copy_from(tstate *s, tmapnode *x, tfrozen *z) {
+    if (!x) {
+        return NULL;
+    }
+    tmapnode *r = tmapnode_new(s, x->n);
+    r->bitmap = x->bitmap;
+    for (uint32_t i = 0; i < x->n; i++) {
+        tmapentry *e = &x->e[i];
+        tmapentry c = {NULL, NULL, NULL};
+        if (e->node) {
+            c.node = tmapnode_copy_from(s, e->node, z);
+        } else {
+            c.key = tval_copy_from(s, e->key, z);
+            c.val = tval_copy_from(s, e->val, z);
+        }
+        r->e[r->n++] = c;
+    }
+    return r;
+}
+
+// Append the keys, or the values, under x to the list ending in 'tail'.
+static tval **tmapnode_list(tstate *s, tmapnode *x, bool vals, tval **tail) {
+    for (uint32_t i = 0; x && i < x->n; i++) {
+        tmapentry *e = &x->e[i];
+        if (e->node) {
+            tail = tmapnode_list(s, e->node, vals, tail);
+        } else {
+            *tail = tval_sexpr(s, vals ? e->val : e->key, NULL);
+            tail = &(*tail)->cdr;
+        }
+    }
+    return tail;
+}
+
+static void tmapnode_print(tprinter *p, tmapnode *x, bool *first) {
+    for (uint32_t i = 0; x && i < x->n; i++) {
+        tmapentry *e = &x->e[i];
+        if (e->node) {
+            tmapnode_print(p, e->node, first);
+            continue;
+        }
+        if (!*first) tprinter_char(p, ' ');
+        *first = false;
+        tprinter_any(p, e->key);
+        tprinter_char(p, ' ');
+        tprinter_any(p, e->val);
+    }
+}
+
+tval *tval_map(tstate *s) {
+    tval *m = tval_new(s, TVAL_MAP);
+    m->node = NULL;
+    m->count = 0;
+    return m;
+}
+
+bool tmap_get(tval *m, tval *k, tval **v) {
+    tmapentry *e = tmap_find(m->node, tmap_hash(k), k);
+    if (e) {
+        *v = e->val;
+    }
+    return e != NULL;
+}
+
+tval *tmap_put(tstate *s, tval *m, tval *k, tval *v) {
+    tval *r = m;
+    if (!(m->flags & TOBJ_FLAG_TRANSIENT)) {
+        r = tval_map(s);
+        r->node = m->node;
+        r->count = m->count;
+        tmapnode_retain(r->node);
+    }
+    tstate_remember(s, (tobj *) r);
+
+    uint32_t h = tmap_hash(k);
+    bool added = false;
+    if (!r->node) {
+        tmapentry kv = {k, v, NULL};
+        r->node = tmapnode_new(s, 1);
+        r->node->bitmap = tmap_bit(h, 0);
+        r->node->e[r->node->n++] = kv;
+        added = true;
+    } else {
+        r->node = tmap_put_at(s, r->node, 0, h, k, v, &added);
+    }
+    r->count += added;
+    return r;
+}
+
+tval *tmap_del(tstate *s, tval *m, tval *k) {
+    uint32_t h = tmap_hash(k);
+    if (!tmap_find(m->node, h, k)) {
+        return m;
+    }
+
+    tval *r = m;
+    if (!(m->flags & TOBJ_FLAG_TRANSIENT)) {
+        r = tval_map(s);
+        r->node = m->node;
+        r->count = m->count;
+        tmapnode_retain(r->node);
+    }
+    tstate_remember(s, (tobj *) r);
+    r->node = tmap_del_at(s, r->node, 0, h, k);
+    r->count--;
+    return r;
+}
+
+tval *tmap_transient(tstate *s, tval *m) {
+    tval *r = tval_map(s);
+    r->node = m->node;
+    r->count = m->count;
+    r->flags |= TOBJ_FLAG_TRANSIENT;
+    tmapnode_retain(r->node);
+    return r;
+}
+
+tval *tmap_persistent(tval *m) {
+    m->flags &= ~TOBJ_FLAG_TRANSIENT;
+    return m;
+}
+
+// The map argument of a map builtin.
+static tval *tmap_arg(tframe *f) {
+    tval *m = tframe_get(f, 1);
+    if (!m || m->type != TVAL_MAP) {
+        TET_THROW(f->env->state, "type mismatch, got %s but expected MAP",
+                  m ? tvaltype_print(m->type) : "nil");
+    }
+    return m;
+}
+
+// Like tmap_arg, for the builtins that need a transient map or a persistent one.
+static tval *tmap_kind_arg(tframe *f, char *name, bool transient) {
+    tstate *s = f->env->state;
+    tval *m = tmap_arg(f);
+    if (!(m->flags & TOBJ_FLAG_TRANSIENT) != !transient) {
+        TET_THROW(s, "%s expects a %s map", name, transient ? "transient" : "persistent");
+    }
+    return m;
+}
+
+
+//   ____  _____ ___
+//  / ___|| ____/ _ \
+//  \___ \|  _|| | | |
+//   ___) | |__| |_| |
+//  |____/|_____\__\_\
+//
+
+tval *tval_seq(tstate *s, tseqkind kind) {
+    tval *v = tval_new(s, TVAL_SEQ);
+    v->seq = NULL;
+    tseq *q = tealloc(s, sizeof(tseq));
+    q->kind = kind;
+    q->fn = NULL;
+    q->src = NULL;
+    q->start = 0;
+    q->end = 0;
+    q->step = 0;
+    v->seq = q;
+    return v;
+}
+
+// Where an iteration is at, in one sequence of the chain being iterated. The iterator of
+// a sequence is followed by that of its source.
+typedef struct tseqit {
+    tseq *seq;
+    tval *cur; // LIST: what is left of the list
+    tnum i; // RANGE: the next number, TAKE: how many were taken, SPLIT: the next offset
+    bool done; // RANGE: the next number is out of range of a tnum, SPLIT: at the end
+} tseqit;
+
+// Whether a sequence of kind 'k' draws its elements from sequence 'src'.
+static bool tseq_chained(tseqkind k) {
+    return k != TSEQ_RANGE && k != TSEQ_LIST && k != TSEQ_SPLIT;
+}
+
+// The number of sequences in the chain that starts with 'q'.
+static tsize tseq_depth(tseq *q) {
+    tsize n = 1;
+    for (; tseq_chained(q->kind); q = q->src->seq) {
+        n++;
+    }
+    return n;
+}
+
+// An iteration over 'q'. It isn't registered (see tralloc): the elements are computed by
+// evaluating lambdas, which may nest handlers of their own that would free it. Whoever
+// iterates frees it with tfree, and has to catch errors to do so.
+static tseqit *tseq_iter(tstate *s, tseq *q) {
+    tsize n = tseq_depth(q);
+    tseqit *it = tealloc(s, n * sizeof(tseqit));
+    for (tsize i = 0; i < n; i++) {
+        it[i].seq = q;
+        it[i].cur = q->kind == TSEQ_LIST ? q->src : NULL;
+        it[i].i = q->kind == TSEQ_RANGE ? q->start : 0;
+        it[i].done = false;
+        if (i + 1 < n) {
+            q = q->src->seq;
+        }
+    }
+    return it;
+}
+
+static tval *tseq_call(tstate *s, tenv *e, tval *fn, tval **args, tsize n) {
+    tframe *f = tframe_new(e);
+    tframe_push(f, fn);
+    for (tsize i = 0; i < n; i++) {
+        tframe_push(f, args[i]);
+    }
+
+    tval *err = tet_eval(s, f);
+    if (err) {
+        TET_THROWRAW(s, err);
+    }
+    return f->obji ? f->objs[0] : NULL;
+}
+
+// Store the next element of the iteration in 'v', if there is one. The elements are
+// pulled through the chain one by one, so no stage ever holds on to more than that.
+static bool tseq_next(tstate *s, tenv *e, tseqit *it, tval **v) {
+    tseq *q = it->seq;
+    switch (q->kind) {
+        case TSEQ_RANGE:
+            if (it->done || (q->step > 0 ? it->i >= q->end : it->i <= q->end)) {
+                return false;
+            }
+            *v = tval_num(s, it->i);
+            it->done = __builtin_add_overflow(it->i, q->step, &it->i);
+            return true;
+        case TSEQ_LIST:
+            if (!it->cur) {
+                return false;
+            }
+            *v = it->cur->car;
+            it->cur = it->cur->cdr;
+            return true;
+        case TSEQ_MAP:
+            if (!tseq_next(s, e, it + 1, v)) {
+                return false;
+            }
+            *v = tseq_call(s, e, q->fn, v, 1);
+            return true;
+        case TSEQ_FILTER:
+            while (tseq_next(s, e, it + 1, v)) {
+                tval *keep = tseq_call(s, e, q->fn, v, 1);
+                if (keep && !(keep->type == TVAL_NUMBER && keep->num == 0)) {
+                    return true;
+                }
+            }
+            return false;
+        case TSEQ_TAKE:
+            if (it->i >= q->end || !tseq_next(s, e, it + 1, v)) {
+                return false;
+            }
+            it->i++;
+            return true;
+        case TSEQ_SPLIT: {
+            if (it->done) {
+                return false;
+            }
+            tbytes *b = q->src->bytes;
+            tsize off = (tsize) it->i;
+            tsize left = b->len - off;
+            char *d = left ? memchr(b->ptr + off, (int) q->step, left) : NULL;
+            tsize l = d ? (tsize) (d - (b->ptr + off)) : left;
+            if (!d && !l) {
+                // Nothing after the last delimiter.
+                it->done = true;
+                return false;
+            }
+            *v = tbytes_slice(s, q->src, off, l);
+            it->i = (tnum) (off + l + 1);
+            it->done = !d;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Consuming a sequence allocates for every element, the element itself and whatever
+// the lambdas computing it leave behind, which is garbage as soon as the next element
+// is pulled. No collection runs inside a builtin though (the frames we were called from
+// aren't roots), so consumers pull in a region (see tstate_region_enter) and call this
+// after every element: once the region has grown past 'next' objects, it is freed of
+// everything but what 'keep' reaches and opened again, so memory stays bounded however
+// long the sequence. The region only has what was allocated since, which the iteration
+// itself (see tseqit) never refers to.
+static void tseq_collect(tstate *s, tsize *next, tobj *keep) {
+    tsize n = s->obji - s->regioni;
+    if (n < *next) {
+        return;
+    }
+    tsize live = n - tstate_region_exit(s, keep);
+    tstate_region_enter(s);
+    *next = live * 2 > TET_SEQ_GC ? live * 2 : TET_SEQ_GC;
+}
+
+// How many numbers a range has.
+static uint64_t tseq_range_len(tseq *q) {
+    if (q->step > 0) {
+        if (q->start >= q->end) return 0;
+        return ((uint64_t) q->end - (uint64_t) q->start - 1) / (uint64_t) q->step + 1;
+    }
+    if (q->start <= q->end) return 0;
+    return ((uint64_t) q->start - (uint64_t) q->end - 1) / -(uint64_t) q->step + 1;
+}
+
+// Argument i of a sequence builtin, which may also be a list.
+static tval *tseq_arg(tframe *f, tsize i) {
+    tstate *s = f->env->state;
+    tval *v = tframe_get(f, i);
+    if (v && v->type == TVAL_SEQ) {
+        return v;
+    }
+    if (v && v->type != TVAL_SEXPR && v->type != TVAL_QEXPR) {
+        TET_THROW(s, "type mismatch, got %s but expected SEQ", tvaltype_print(v->type));
+    }
+
+    tval *r = tval_seq(s, TSEQ_LIST);
+    if (v && (v->car || v->cdr)) {
+        // Anything but an empty list (nil car).
+        r->seq->src = v;
+    }
+    return r;
+}
+
+
+//   ______   _______ _____ ____
+//  | __ ) \ / /_   _| ____/ ___|
+//  |  _ \\ V /  | | |  _| \___ \
+//  | |_) || |   | | | |___ ___) |
+//  |____/ |_|   |_| |_____|____/
+//
+
+static void tbuf_release(tbuf *b) {
+    if (!b || __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    if (b->mapped) {
+        munmap(b->data, b->len);
+    }
+    tfree(b);
+}
+
+// A value for the 'len' bytes at 'ptr', in 'buf', which it takes a reference to.
+static tval *tbytes_new(tstate *s, tbuf *buf, char *ptr, tsize len) {
+    tval *v = tval_new(s, TVAL_BYTES);
+    v->bytes = NULL;
+    tbytes *b = tealloc(s, sizeof(tbytes));
+    if (buf) {
+        __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    }
+    b->buf = buf;
+    b->ptr = ptr;
+    b->len = len;
+    v->bytes = b;
+    return v;
+}
+
+// Gives the (empty) BYTES 'v' the whole of buffer 'buf'.
+static void tbytes_own(tval *v, tbuf *buf) {
+    v->bytes->buf = buf;
+    v->bytes->ptr = buf->data;
+    v->bytes->len = buf->len;
+}
+
+tval *tval_bytes(tstate *s, const char *data, tsize len) {
+    tval *v = tbytes_new(s, NULL, NULL, 0);
+    tbuf *buf = tealloc(s, sizeof(tbuf) + len);
+    buf->refs = 1;
+    buf->mapped = false;
+    buf->data = (char *) (buf + 1);
+    buf->len = len;
+    if (len) {
+        memcpy(buf->data, data, len);
+    }
+    tbytes_own(v, buf);
+    return v;
+}
+
+tval *tval_mmap(tstate *s, char *path) {
+    tval *v = tbytes_new(s, NULL, NULL, 0);
+    tbuf *buf = tealloc(s, sizeof(tbuf));
+    buf->refs = 1;
+    buf->mapped = false;
+    buf->data = NULL;
+    buf->len = 0;
+    tbytes_own(v, buf);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        TET_THROW(s, "cannot open %s: %s", path, strerror(errno));
+    }
+    struct stat st;
+    char *e = fstat(fd, &st) ? strerror(errno) : !S_ISREG(st.st_mode) ? "not a regular file" : NULL;
+    if (e) {
+        close(fd);
+        TET_THROW(s, "cannot map %s: %s", path, e);
+    }
+
+    // Empty files can't be mapped, but then there is nothing to map either.
+    if (st.st_size > 0) {
+        void *p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            int e = errno;
+            close(fd);
+            TET_THROW(s, "cannot map %s: %s", path, strerror(e));
+        }
+        // We read front to back: read ahead eagerly, and let pages go once read.
+        madvise(p, (size_t) st.st_size, MADV_SEQUENTIAL);
+        buf->mapped = true;
+        buf->data = p;
+        buf->len = (tsize) st.st_size;
+    }
+    close(fd);
+
+    tbytes_own(v, buf);
+    return v;
+}
+
+tval *tbytes_slice(tstate *s, tval *v, tsize off, tsize len) {
+    return tbytes_new(s, v->bytes->buf, v->bytes->ptr + off, len);
+}
+
+static tsize tbytes_count_plain(const char *p, tsize n, int d) {
+    tsize r = 0;
+    const char *end = p + n;
+    while (p < end && (p = memchr(p, d, (size_t) (end - p)))) {
+        r++;
+        p++;
+    }
+    return r;
+}
+
+#if TET_SIMD
+
+// Matches are counted in byte lanes, which are added up every 255 blocks (before any of
+// them can wrap) by summing their absolute differences to zero.
+__attribute__((target("avx2")))
+static tsize tbytes_count_avx2(const char *p, tsize n, int d) {
+    __m256i c = _mm256_set1_epi8((char) d);
+    __m256i t = _mm256_setzero_si256();
+    tsize i = 0;
+    while (i + 32 <= n) {
+        __m256i k = _mm256_setzero_si256();
+        for (tsize j = 0; j < 255 && i + 32 <= n; j++, i += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i *) (p + i));
+            k = _mm256_sub_epi8(k, _mm256_cmpeq_epi8(x, c));
+        }
+        t = _mm256_add_epi64(t, _mm256_sad_epu8(k, _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, t);
+    return (tsize) (lanes[0] + lanes[1] + lanes[2] + lanes[3]) +
+           tbytes_count_plain(p + i, n - i, d);
+}
+
+static tsize tbytes_count_sse(const char *p, tsize n, int d) {
+    __m128i c = _mm_set1_epi8((char) d);
+    __m128i t = _mm_setzero_si128();
+    tsize i = 0;
+    while (i + 16 <= n) {
+        __m128i k = _mm_setzero_si128();
+        for (tsize j = 0; j < 255 && i + 16 <= n; j++, i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (p + i));
+            k = _mm_sub_epi8(k, _mm_cmpeq_epi8(x, c));
+        }
+        t = _mm_add_epi64(t, _mm_sad_epu8(k, _mm_setzero_si128()));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, t);
+    return (tsize) (lanes[0] + lanes[1]) + tbytes_count_plain(p + i, n - i, d);
+}
+
+#endif
+
+// How many of the n bytes at p are equal to d.
+static tsize tbytes_count(const char *p, tsize n, int d) {
+#if TET_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return tbytes_count_avx2(p, n, d);
+    }
+    return tbytes_count_sse(p, n, d);
+#else
+    return tbytes_count_plain(p, n, d);
+#endif
+}
+
+// The single byte that argument i of 'name' is, given as a string of one character or
+// as its value (strings have no escapes, so that's how to give a newline or a tab).
+static int tbytes_delim_arg(tframe *f, tsize i, char *name) {
+    tval *v = tframe_get(f, i);
+    if (v && v->type == TVAL_NUMBER && v->num >= 0 && v->num <= 255) {
+        return (int) v->num;
+    }
+    if (v && v->type == TVAL_STRING && v->str[0] && !v->str[1]) {
+        return (unsigned char) v->str[0];
+    }
+    TET_THROW(f->env->state, "%s expects a delimiter of one byte", name);
+}
+
+
+//   ____  _   _ ___ _   _____ ___ _   _ ____
+//  | __ )| | | |_ _| | |_   _|_ _| \ | / ___|
+//  |  _ \| | | || || |   | |  | ||  \| \___ \
+//  | |_) | |_| || || |___| |  | || |\  |___) |
+//  |____/ \___/|___|_____|_| |___|_| \_|____/
+//
+
+tsize builtin_car(tframe *f) {
+    tval *v = tet_popsexpr(f);
+    tframe_push(f, v->car);
+    return 1;
+}
+
+tsize builtin_cdr(tframe *f) {
+    tval *v = tet_popsexpr(f);
+    tframe_push(f, v->cdr);
+    return 1;
+}
+
+tsize builtin_lambda(tframe *f) {
+    tval *body = tet_popsexpr(f);
+    tval *pars = tet_popsexpr(f);
+    tet_pushlambda(f, pars, body);
+    return 1;
+}
+
+// The arithmetic builtins, in a single pass over the stack. We compute with tnums until
+// an operation overflows or an argument is a bignum, and with bignums from there on. A
+// result that fits a tnum again is returned as a NUMBER.
+static tsize builtin_arith(tframe *f, char op) {
+    tstate *s = f->env->state;
+    tsize c = f->obji;
+    if (op == '-' && c < 2) {
+        TET_THROW(s, "- expects at least one argument");
+    }
+    if (op == '/' && c < 3) {
+        TET_THROW(s, "/ expects at least two arguments");
+    }
+
+    tnum r = op == '*' ? 1 : 0;
+    tval *big = NULL; // the result so far, once it is a bignum
+    for (tsize i = 1; i < c; i++) {
+        tval *v = f->objs[i];
+        if (!v || (v->type != TVAL_NUMBER && v->type != TVAL_BIGNUM)) {
+            TET_THROW(s, "type mismatch, got %s but expected NUMBER",
+                      v ? tvaltype_print(v->type) : "nil");
+        }
+
+        // Subtraction and division start from their first argument, unless - negates it.
+        if (i == 1 && (op == '/' || (op == '-' && c > 2))) {
+            if (v->type == TVAL_NUMBER) {
+                r = v->num;
+            } else {
+                big = tval_bignum(s, NULL);
+                big->big = tbig_copy(s, v->big);
+            }
+            continue;
+        }
+
+        if (!big && v->type == TVAL_NUMBER) {
+            tnum t = 0;
+            bool over;
+            switch (op) {
+                case '+':
+                    over = __builtin_add_overflow(r, v->num, &t);
+                    break;
+                case '-':
+                    over = __builtin_sub_overflow(r, v->num, &t);
+                    break;
+                case '*':
+                    over = __builtin_mul_overflow(r, v->num, &t);
+                    break;
+                default:
+                    if (v->num == 0) {
+                        TET_THROW(s, "division by zero");
+                    }
+                    over = r == INT64_MIN && v->num == -1;
+                    if (!over) {
+                        t = r / v->num;
+                    }
+                    break;
+            }
+            if (!over) {
+                r = t;
+                continue;
+            }
+        }
+
+        // Continue with bignums. The result is kept in a value of its own (allocated
+        // before its limbs), so it is collected should we throw.
+        uint32_t rd[2], vd[2];
+        if (!big) {
+            tbig rb = tbig_of(r, rd);
+            big = tval_bignum(s, NULL);
+            big->big = tbig_copy(s, &rb);
+        }
+        tbig vb = v->type == TVAL_NUMBER ? tbig_of(v->num, vd) : *v->big;
+        tbig *n;
+        switch (op) {
+            case '+':
+                n = tbig_add(s, big->big, &vb, false);
+                break;
+            case '-':
+                n = tbig_add(s, big->big, &vb, true);
+                break;
+            case '*':
+                n = tbig_mul(s, big->big, &vb);
+                break;
+            default:
+                if (tbig_zero(&vb)) {
+                    TET_THROW(s, "division by zero");
+                }
+                n = tbig_div(s, big->big, &vb);
+                break;
+        }
+        tfree(big->big);
+        big->big = n;
+    }
+
+    f->obji = 1;
+    if (big && !tbig_num(big->big, &r)) {
+        tframe_push(f, big);
+    } else {
+        tet_pushnumber(f, r);
+    }
+    return 1;
+}
+
+tsize builtin_add(tframe *f) {
+    return builtin_arith(f, '+');
+}
+
+tsize builtin_sub(tframe *f) {
+    return builtin_arith(f, '-');
+}
+
+tsize builtin_mul(tframe *f) {
+    return builtin_arith(f, '*');
+}
+
+tsize builtin_div(tframe *f) {
+    return builtin_arith(f, '/');
+}
+
+static bool tfast_car_fn(tstate *s, targ l, targ unused, targ *r) {
+    (void) s;
+    (void) unused;
+    r->val = l.val->car;
+    return true;
+}
+
+static bool tfast_cdr_fn(tstate *s, targ l, targ unused, targ *r) {
+    (void) s;
+    (void) unused;
+    r->val = l.val->cdr;
+    return true;
+}
+
+// Overflows are left to the builtins, which continue with bignums.
+static bool tfast_add_fn(tstate *s, targ a, targ b, targ *r) {
+    (void) s;
+    return !__builtin_add_overflow(a.num, b.num, &r->num);
+}
+
+static bool tfast_sub_fn(tstate *s, targ a, targ b, targ *r) {
+    (void) s;
+    return !__builtin_sub_overflow(a.num, b.num, &r->num);
+}
+
+static bool tfast_mul_fn(tstate *s, targ a, targ b, targ *r) {
+    (void) s;
+    return !__builtin_mul_overflow(a.num, b.num, &r->num);
+}
+
+static bool tfast_div_fn(tstate *s, targ a, targ b, targ *r) {
+    if (b.num == 0) {
+        TET_THROW(s, "division by zero");
+    }
+    if (a.num == INT64_MIN && b.num == -1) {
+        return false;
+    }
+    r->num = a.num / b.num;
+    return true;
+}
+
+const tfast tfast_car = {1, {TVAL_SEXPR}, TVAL_SEXPR, tfast_car_fn};
+const tfast tfast_cdr = {1, {TVAL_SEXPR}, TVAL_SEXPR, tfast_cdr_fn};
+const tfast tfast_add = {2, {TVAL_NUMBER, TVAL_NUMBER}, TVAL_NUMBER, tfast_add_fn};
+const tfast tfast_sub = {2, {TVAL_NUMBER, TVAL_NUMBER}, TVAL_NUMBER, tfast_sub_fn};
+const tfast tfast_mul = {2, {TVAL_NUMBER, TVAL_NUMBER}, TVAL_NUMBER, tfast_mul_fn};
+const tfast tfast_div = {2, {TVAL_NUMBER, TVAL_NUMBER}, TVAL_NUMBER, tfast_div_fn};
+
+// Shared by map and pmap: (map fn list) and (pmap fn list [chunk]).
+static tsize builtin_map_with(tframe *f, tpool *p) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f);
+    if (c < 3) {
+        TET_THROW(s, "map expects a function and a list");
+    }
+
+    tval *fn = tframe_get(f, 1);
+    tval *list = tframe_get(f, 2);
+    if (list->type != TVAL_SEXPR && list->type != TVAL_QEXPR) {
+        TET_THROW(s, "type mismatch, got %s but expected %s",
+                  tvaltype_print(list->type), tvaltype_print(TVAL_SEXPR));
+    }
+    tsize chunk = c > 3 ? (tsize) tet_getnumber(f, 3) : 0;
+
+    tval *r = tpool_map(s, p, f->env, fn, list, chunk);
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+tsize builtin_map(tframe *f) {
+    return builtin_map_with(f, NULL);
+}
+
+tsize builtin_pmap(tframe *f) {
+    tstate *s = f->env->state;
+    tpool *p = s->pool;
+    if (!p) {
+        p = tstate_pool(s, TET_POOL_THREADS, TET_POOL_CHUNK);
+    }
+    return builtin_map_with(f, p);
+}
+
+tsize builtin_freeze(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "freeze expects exactly one argument");
+    }
+
+    tval *v = tstate_freeze(s, tframe_get(f, 1));
+    f->obji = 1;
+    tframe_push(f, v);
+    return 1;
+}
+
+tsize builtin_spawn(tframe *f) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f);
+    if (c < 2) {
+        TET_THROW(s, "spawn expects a function and its arguments");
+    }
+
+    tsched *sched = s->sched;
+    if (!sched) {
+        sched = tstate_sched(s, TET_SCHED_THREADS);
+    }
+
+    // Freeze the call (fn args...), so whichever worker ends up running it can.
+    tval *call = NULL;
+    for (tsize i = c - 1; i >= 1; i--) {
+        call = tval_sexpr(s, tframe_get(f, i), call);
+    }
+    tfrozen *z = tfrozen_new(s, call);
+
+    ttask *t = ttask_new(sched);
+    if (!t) {
+        tfrozen_release(z);
+        TET_THROWRAW(s, s->memerr);
+    }
+    t->call = z;
+
+    // The handle needs its reference before the task is placed, as it may finish (and
+    // drop the scheduler's reference) right away.
+    tval *v = tval_task(s, t);
+    tsched_place(s, sched, t);
+
+    f->obji = 1;
+    tframe_push(f, v);
+    return 1;
+}
+
+tsize builtin_join(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "join expects exactly one argument");
+    }
+    ttask *t = tet_gettype(f, 1, TVAL_TASK)->task;
+
+    // Within a task we suspend until the other task is done (we'll be invoked again when
+    // resumed). Nested in a builtin a task can't suspend, but it may run the other task
+    // itself. Otherwise all we can do is block.
+    if (__atomic_load_n(&t->status, __ATOMIC_ACQUIRE) < TTASK_DONE) {
+        if (tet_can_yield(f)) {
+            s->task->waiting = true;
+            tet_yield(f);
+            return 0;
+        }
+        if (s->task) {
+            tsched_help(s, t);
+        }
+        tsched_wait(t);
+    }
+
+    tval *r;
+    tval *err = tsched_thaw(s, t, &r);
+    if (err) {
+        TET_THROWRAW(s, err);
+    }
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+tsize builtin_yield(tframe *f) {
+    // Suspend once. Either way we return nothing, so (yield) can go anywhere.
+    if (!tet_resumed(f)) {
+        tet_yield(f);
+    }
+    return 0;
+}
+
+tsize builtin_mailbox(tframe *f) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f);
+    if (c > 2) {
+        TET_THROW(s, "mailbox expects at most one argument");
+    }
+    tnum cap = c > 1 ? tet_getnumber(f, 1) : TET_MAILBOX_LEN;
+    if (cap < 1) {
+        TET_THROW(s, "mailbox capacity must be positive");
+    }
+
+    TET_CATCHABLE(s);
+    tmailbox *m = tmailbox_new((tsize) cap);
+    if (!m) {
+        TET_THROWRAW(s, s->memerr);
+    }
+    TET_CATCH(s, err, {
+        tmailbox_release(m);
+        TET_THROWRAW(s, err);
+    });
+    tval *v = tval_mailbox(s, m);
+    TET_UNCATCH(s);
+    tmailbox_release(m); // The handle holds the only reference we need.
+
+    f->obji = 1;
+    tframe_push(f, v);
+    return 1;
+}
+
+// Inside a task that can suspend (see tet_can_yield), send and recv don't block their
+// worker but yield until the mailbox is ready or 'timeout' milliseconds have passed
+// since they were first invoked. Returns whether we yielded. The deadline is pushed
+// after the c arguments of the builtin when it first yields, as it needs to survive
+// being invoked again.
+static bool builtin_mailbox_yield(tframe *f, tsize c, long timeout) {
+    if (!timeout) return false;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!tet_resumed(f)) {
+        struct timespec d = now;
+        if (timeout > 0) {
+            d.tv_sec += timeout / 1000;
+            d.tv_nsec += (timeout % 1000) * 1000000;
+            if (d.tv_nsec >= 1000000000) {
+                d.tv_sec++;
+                d.tv_nsec -= 1000000000;
+            }
+        }
+        tet_pushnumber(f, (tnum) d.tv_sec);
+        tet_pushnumber(f, (tnum) d.tv_nsec);
+    } else if (timeout > 0) {
+        tnum sec = tet_getnumber(f, c);
+        tnum nsec = tet_getnumber(f, c + 1);
+        if (now.tv_sec > sec || (now.tv_sec == sec && now.tv_nsec >= nsec)) {
+            return false;
+        }
+    }
+
+    f->env->state->task->waiting = true;
+    tet_yield(f);
+    return true;
+}
+
+tsize builtin_send(tframe *f) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f) - (tet_resumed(f) ? 2 : 0);
+    if (c != 3 && c != 4) {
+        TET_THROW(s, "send expects a mailbox, a value and optionally a timeout");
+    }
+    tmailbox *m = tet_gettype(f, 1, TVAL_MAILBOX)->mailbox;
+    tval *v = tframe_get(f, 2);
+    long timeout = c > 3 ? tet_getnumber(f, 3) : -1;
+
+    bool sent;
+    if (tet_can_yield(f)) {
+        // Don't bother freezing the message while there is no room for it anyway.
+        sent = !tmailbox_full(m) && tmailbox_send(s, m, v, 0);
+        if (!sent && builtin_mailbox_yield(f, c, timeout)) {
+            return 0;
+        }
+    } else {
+        sent = tmailbox_send(s, m, v, timeout);
+    }
+
+    // 1 if the message was sent, 0 if the mailbox stayed full until the timeout.
+    f->obji = 1;
+    tet_pushnumber(f, sent);
+    return 1;
+}
+
+tsize builtin_recv(tframe *f) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f) - (tet_resumed(f) ? 2 : 0);
+    if (c != 2 && c != 3) {
+        TET_THROW(s, "recv expects a mailbox and optionally a timeout");
+    }
+    tmailbox *m = tet_gettype(f, 1, TVAL_MAILBOX)->mailbox;
+    long timeout = c > 2 ? tet_getnumber(f, 2) : -1;
+
+    tval *r;
+    bool received;
+    if (tet_can_yield(f)) {
+        received = tmailbox_recv(s, m, 0, &r);
+        if (!received && builtin_mailbox_yield(f, c, timeout)) {
+            return 0;
+        }
+    } else {
+        received = tmailbox_recv(s, m, timeout, &r);
+    }
+
+    // Any value (even nil) may be a message, so a timeout can only be an error.
+    if (!received) {
+        TET_THROW(s, "recv timed out");
+    }
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+// Wait until fd is ready for 'events' (EPOLLIN or EPOLLOUT). Inside a task that can
+// suspend (see tet_can_yield) we park the task and yield, returning true: the builtin is
+// invoked again once fd is ready. Anywhere else we have nothing better to do than block
+// until fd is ready, after which we return false and the builtin simply tries again.
+static bool builtin_io_wait(tframe *f, int fd, uint32_t events) {
+    tstate *s = f->env->state;
+    if (tet_can_yield(f)) {
+        tsched_park(s, fd, events);
+        tet_yield(f);
+        return true;
+    }
+
+    struct pollfd p;
+    p.fd = fd;
+    p.events = events == EPOLLIN ? POLLIN : POLLOUT;
+    while (poll(&p, 1, -1) < 0 && errno == EINTR);
+    return false;
+}
+
+static bool builtin_io_again(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static int builtin_io_fd(tframe *f, tsize i) {
+    tnum fd = tet_getnumber(f, i);
+    if (fd < 0 || fd > INT_MAX) {
+        TET_THROW(f->env->state, "invalid file descriptor %" PRId64, fd);
+    }
+    return (int) fd;
+}
+
+// Resolve (host port) at i and i + 1 of the stack. The caller frees the result.
+static struct addrinfo *builtin_io_resolve(tframe *f, tsize i, bool passive) {
+    tstate *s = f->env->state;
+    char *host = tet_gettype(f, i, TVAL_STRING)->str;
+    char port[16];
+    snprintf(port, sizeof(port), "%" PRId64, tet_getnumber(f, i + 1));
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    struct addrinfo *ai;
+    int e = getaddrinfo(host, port, &hints, &ai);
+    if (e) {
+        TET_THROW(s, "cannot resolve %s:%s: %s", host, port, gai_strerror(e));
+    }
+    return ai;
+}
+
+// Fill in a unix domain socket address for the path at i of the stack.
+static socklen_t builtin_io_unix(tframe *f, tsize i, struct sockaddr_un *a) {
+    char *path = tet_gettype(f, i, TVAL_STRING)->str;
+    if (strlen(path) >= sizeof(a->sun_path)) {
+        TET_THROW(f->env->state, "socket path too long: %s", path);
+    }
+
+    memset(a, 0, sizeof(*a));
+    a->sun_family = AF_UNIX;
+    strcpy(a->sun_path, path);
+    return sizeof(*a);
+}
+
+static void builtin_io_listen(tframe *f, int fd, struct sockaddr *a, socklen_t l) {
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, a, l) || listen(fd, SOMAXCONN)) {
+        int e = errno;
+        close(fd);
+        TET_THROW(f->env->state, "cannot listen: %s", strerror(e));
+    }
+    f->obji = 1;
+    tet_pushnumber(f, fd);
+}
+
+// Start connecting fd to a, returning whether the connection is still in progress.
+static bool builtin_io_connect(tframe *f, int fd, struct sockaddr *a, socklen_t l) {
+    while (connect(fd, a, l)) {
+        if (errno == EINTR) continue;
+        if (errno == EINPROGRESS || builtin_io_again()) return true;
+
+        int e = errno;
+        close(fd);
+        TET_THROW(f->env->state, "cannot connect: %s", strerror(e));
+    }
+    return false;
+}
+
+// Finish connecting the fd at 'i' of the stack (pushed there before we first waited).
+static tsize builtin_io_connected(tframe *f, tsize i, bool pending) {
+    int fd = builtin_io_fd(f, i);
+    if (pending) {
+        if (!tet_resumed(f) && builtin_io_wait(f, fd, EPOLLOUT)) {
+            return 0;
+        }
+
+        int e = 0;
+        socklen_t l = sizeof(e);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &e, &l);
+        if (e) {
+            close(fd);
+            TET_THROW(f->env->state, "cannot connect: %s", strerror(e));
+        }
+    }
+    f->obji = 1;
+    tet_pushnumber(f, fd);
+    return 1;
+}
+
+static int builtin_io_socket(tframe *f, int family) {
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        TET_THROW(f->env->state, "cannot create socket: %s", strerror(errno));
+    }
+    return fd;
+}
+
+tsize builtin_listen(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 3) {
+        TET_THROW(s, "listen expects a host and a port");
+    }
+
+    TET_CATCHABLE(s);
+    struct addrinfo *ai = builtin_io_resolve(f, 1, true);
+    TET_CATCH(s, err, {
+        freeaddrinfo(ai);
+        TET_THROWRAW(s, err);
+    });
+    int fd = builtin_io_socket(f, ai->ai_family);
+    builtin_io_listen(f, fd, ai->ai_addr, ai->ai_addrlen);
+    TET_UNCATCH(s);
+    freeaddrinfo(ai);
+    return 1;
+}
+
+tsize builtin_connect(tframe *f) {
+    tstate *s = f->env->state;
+
+    // Resumed once the connection attempt finished, its fd is on top of the arguments.
+    if (tet_resumed(f)) {
+        return builtin_io_connected(f, 3, true);
+    }
+    if (tframe_size(f) != 3) {
+        TET_THROW(s, "connect expects a host and a port");
+    }
+
+    TET_CATCHABLE(s);
+    struct addrinfo *ai = builtin_io_resolve(f, 1, false);
+    TET_CATCH(s, err, {
+        freeaddrinfo(ai);
+        TET_THROWRAW(s, err);
+    });
+    int fd = builtin_io_socket(f, ai->ai_family);
+    bool pending = builtin_io_connect(f, fd, ai->ai_addr, ai->ai_addrlen);
+    TET_UNCATCH(s);
+    freeaddrinfo(ai);
+
+    tet_pushnumber(f, fd);
+    return builtin_io_connected(f, 3, pending);
+}
+
+tsize builtin_listen_unix(tframe *f) {
+    if (tframe_size(f) != 2) {
+        TET_THROW(f->env->state, "listen-unix expects a path");
+    }
+
+    struct sockaddr_un a;
+    socklen_t l = builtin_io_unix(f, 1, &a);
+    builtin_io_listen(f, builtin_io_socket(f, AF_UNIX), (struct sockaddr *) &a, l);
+    return 1;
+}
+
+tsize builtin_connect_unix(tframe *f) {
+    if (tet_resumed(f)) {
+        return builtin_io_connected(f, 2, true);
+    }
+    if (tframe_size(f) != 2) {
+        TET_THROW(f->env->state, "connect-unix expects a path");
+    }
+
+    struct sockaddr_un a;
+    socklen_t l = builtin_io_unix(f, 1, &a);
+    int fd = builtin_io_socket(f, AF_UNIX);
+    bool pending = builtin_io_connect(f, fd, (struct sockaddr *) &a, l);
+
+    tet_pushnumber(f, fd);
+    return builtin_io_connected(f, 2, pending);
+}
+
+tsize builtin_accept(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "accept expects a file descriptor");
+    }
+    int fd = builtin_io_fd(f, 1);
+
+    int c;
+    while ((c = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        if (!builtin_io_again()) {
+            TET_THROW(s, "accept: %s", strerror(errno));
+        }
+        if (builtin_io_wait(f, fd, EPOLLIN)) {
+            return 0;
+        }
+    }
+
+    f->obji = 1;
+    tet_pushnumber(f, c);
+    return 1;
+}
+
+tsize builtin_open(tframe *f) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f);
+    if (c != 2 && c != 3) {
+        TET_THROW(s, "open expects a path and optionally a mode");
+    }
+    char *path = tet_gettype(f, 1, TVAL_STRING)->str;
+    char *mode = c > 2 ? tet_gettype(f, 2, TVAL_STRING)->str : "r";
+
+    int flags;
+    if (!strcmp(mode, "r")) {
+        flags = O_RDONLY;
+    } else if (!strcmp(mode, "w")) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (!strcmp(mode, "a")) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else if (!strcmp(mode, "rw")) {
+        flags = O_RDWR | O_CREAT;
+    } else {
+        TET_THROW(s, "invalid mode: %s", mode);
+    }
+
+    int fd = open(path, flags | O_NONBLOCK | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        TET_THROW(s, "cannot open %s: %s", path, strerror(errno));
+    }
+    f->obji = 1;
+    tet_pushnumber(f, fd);
+    return 1;
+}
+
+tsize builtin_pipe(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 1) {
+        TET_THROW(s, "pipe expects no arguments");
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC)) {
+        TET_THROW(s, "pipe: %s", strerror(errno));
+    }
+
+    // (read-end write-end)
+    tval *r = tval_sexpr(s, tval_num(s, fds[0]), tval_sexpr(s, tval_num(s, fds[1]), NULL));
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+tsize builtin_read(tframe *f) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f);
+    if (c != 2 && c != 3) {
+        TET_THROW(s, "read expects a file descriptor and optionally a size");
+    }
+    int fd = builtin_io_fd(f, 1);
+    tnum n = c > 2 ? tet_getnumber(f, 2) : TET_IO_READ;
+    if (n < 1) {
+        TET_THROW(s, "read size must be positive");
+    }
+
+    char *buf = tralloc(s, (tsize) n + 1);
+    ssize_t l;
+    while ((l = read(fd, buf, (size_t) n)) < 0) {
+        if (errno == EINTR) continue;
+        if (!builtin_io_again()) {
+            TET_THROW(s, "read: %s", strerror(errno));
+        }
+        if (builtin_io_wait(f, fd, EPOLLIN)) {
+            trforget(s, 1); // buf
+            tfree(buf);
+            return 0;
+        }
+    }
+
+    // An empty string means the other end is done.
+    buf[l] = '\0';
+    tval *r = tval_str(s, buf);
+    trforget(s, 1); // buf
+    tfree(buf);
+
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+tsize builtin_write(tframe *f) {
+    tstate *s = f->env->state;
+
+    // When resumed, the number of bytes written so far is on top of the arguments.
+    tsize c = tframe_size(f) - (tet_resumed(f) ? 1 : 0);
+    if (c != 3) {
+        TET_THROW(s, "write expects a file descriptor and a string");
+    }
+    int fd = builtin_io_fd(f, 1);
+    char *str = tet_gettype(f, 2, TVAL_STRING)->str;
+    tsize len = strlen(str);
+    tsize done = tet_resumed(f) ? (tsize) tet_getnumber(f, 3) : 0;
+
+    while (done < len) {
+        ssize_t l = write(fd, str + done, len - done);
+        if (l >= 0) {
+            done += (tsize) l;
+            continue;
+        }
+        if (errno == EINTR) continue;
+        if (!builtin_io_again()) {
+            TET_THROW(s, "write: %s", strerror(errno));
+        }
+
+        if (s->task) {
+            f->obji = 3;
+            tet_pushnumber(f, (tnum) done);
+        }
+        if (builtin_io_wait(f, fd, EPOLLOUT)) {
+            return 0;
+        }
+    }
+
+    f->obji = 1;
+    tet_pushnumber(f, (tnum) len);
+    return 1;
+}
+
+tsize builtin_close(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "close expects a file descriptor");
+    }
+    if (close(builtin_io_fd(f, 1))) {
+        TET_THROW(s, "close: %s", strerror(errno));
+    }
+    f->obji = 1;
+    return 0;
+}
+
+// (vec list) makes a vector of the numbers in a list.
+tsize builtin_vec(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "vec expects a list");
+    }
+    tval *l = tframe_get(f, 1);
+    if (l && l->type != TVAL_SEXPR && l->type != TVAL_QEXPR) {
+        TET_THROW(s, "type mismatch, got %s but expected %s",
+                  tvaltype_print(l->type), tvaltype_print(TVAL_SEXPR));
+    }
+    if (l && !l->car && !l->cdr) {
+        // An empty list (nil car).
+        l = NULL;
+    }
+
+    tsize n = 0;
+    for (tval *c = l; c; c = c->cdr) {
+        if (!c->car || c->car->type != TVAL_NUMBER) {
+            TET_THROW(s, "vec expects numbers, got %s",
+                      c->car ? tvaltype_print(c->car->type) : "nil");
+        }
+        n++;
+    }
+    tval *v = tval_vector(s, NULL);
+    v->vec = tvec_new(s, n);
+    n = 0;
+    for (tval *c = l; c; c = c->cdr) {
+        v->vec->d[n++] = c->car->num;
+    }
+    f->obji = 1;
+    tframe_push(f, v);
+    return 1;
+}
+
+tsize builtin_vec_list(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "vec-list expects a vector");
+    }
+    tvec *v = tvec_arg(f, 1);
+
+    tval *l = NULL;
+    for (tsize i = v->n; i > 0; i--) {
+        l = tval_sexpr(s, tval_num(s, v->d[i - 1]), l);
+    }
+    if (!l) {
+        l = tval_sexpr(s, NULL, NULL);
+    }
+    f->obji = 1;
+    tframe_push(f, l);
+    return 1;
+}
+
+tsize builtin_vec_len(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "vec-len expects a vector");
+    }
+    tvec *v = tvec_arg(f, 1);
+    f->obji = 1;
+    tet_pushnumber(f, (tnum) v->n);
+    return 1;
+}
+
+// Sums that overflow are done again, exactly, by tvec_total.
+tsize builtin_vec_sum(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "vec-sum expects a vector");
+    }
+    tvec *v = tvec_arg(f, 1);
+    tnum r;
+    tval *t = tvec_sum(v->d, v->n, &r) ? tval_num(s, r) : tvec_total(s, v->d, NULL, v->n);
+    f->obji = 1;
+    tframe_push(f, t);
+    return 1;
+}
+
+static tsize builtin_vec_minmax(tframe *f, bool max) {
+    tstate *s = f->env->state;
+    char *name = max ? "vec-max" : "vec-min";
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "%s expects a vector", name);
+    }
+    tvec *v = tvec_arg(f, 1);
+    if (!v->n) {
+        TET_THROW(s, "%s of an empty vector", name);
+    }
+    tnum r = tvec_minmax(v->d, v->n, max);
+    f->obji = 1;
+    tet_pushnumber(f, r);
+    return 1;
+}
+
+tsize builtin_vec_min(tframe *f) {
+    return builtin_vec_minmax(f, false);
+}
+
+tsize builtin_vec_max(tframe *f) {
+    return builtin_vec_minmax(f, true);
+}
+
+// The two vector arguments of a binary vector builtin, which must be of the same length.
+static void builtin_vec_args(tframe *f, char *name, tvec **a, tvec **b) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 3) {
+        TET_THROW(s, "%s expects two vectors", name);
+    }
+    *a = tvec_arg(f, 1);
+    *b = tvec_arg(f, 2);
+    if ((*a)->n != (*b)->n) {
+        TET_THROW(s, "%s expects vectors of the same length, got %zu and %zu", name,
+                  (*a)->n, (*b)->n);
+    }
+}
+
+tsize builtin_vec_dot(tframe *f) {
+    tvec *a, *b;
+    builtin_vec_args(f, "vec-dot", &a, &b);
+    tval *t = tvec_total(f->env->state, a->d, b->d, a->n);
+    f->obji = 1;
+    tframe_push(f, t);
+    return 1;
+}
+
+// Elementwise arithmetic. A vector only holds tnums, so overflowing is an error here.
+static tsize builtin_vec_arith(tframe *f, char op) {
+    tstate *s = f->env->state;
+    char name[] = {'v', 'e', 'c', op, '\0'};
+    tvec *a, *b;
+    builtin_vec_args(f, name, &a, &b);
+
+    tval *r = tval_vector(s, NULL);
+    r->vec = tvec_new(s, a->n);
+    bool ok = true;
+    if (op == '*') {
+        for (tsize i = 0; i < a->n && ok; i++) {
+            ok = !__builtin_mul_overflow(a->d[i], b->d[i], &r->vec->d[i]);
+        }
+    } else {
+        ok = tvec_addsub(a->d, b->d, r->vec->d, a->n, op == '-');
+    }
+    if (!ok) {
+        TET_THROW(s, "%s overflows", name);
+    }
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+tsize builtin_vec_add(tframe *f) {
+    return builtin_vec_arith(f, '+');
+}
+
+tsize builtin_vec_sub(tframe *f) {
+    return builtin_vec_arith(f, '-');
+}
+
+tsize builtin_vec_mul(tframe *f) {
+    return builtin_vec_arith(f, '*');
+}
+
+// (hash-map k v ...) makes a map of its arguments, (assoc m k v ...) adds them to m.
+static tsize builtin_assoc_with(tframe *f, char *name, tval *m) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f);
+    tsize i = m ? 2 : 1;
+    if ((c - i) % 2) {
+        TET_THROW(s, "%s expects keys and values", name);
+    }
+
+    tval *t = tmap_transient(s, m ? m : tval_map(s));
+    for (; i < c; i += 2) {
+        tmap_put(s, t, f->objs[i], f->objs[i + 1]);
+    }
+    f->obji = 1;
+    tframe_push(f, tmap_persistent(t));
+    return 1;
+}
+
+tsize builtin_hash_map(tframe *f) {
+    return builtin_assoc_with(f, "hash-map", NULL);
+}
+
+tsize builtin_assoc(tframe *f) {
+    if (tframe_size(f) < 2) {
+        TET_THROW(f->env->state, "assoc expects a map, keys and values");
+    }
+    return builtin_assoc_with(f, "assoc", tmap_kind_arg(f, "assoc", false));
+}
+
+tsize builtin_dissoc(tframe *f) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f);
+    if (c < 2) {
+        TET_THROW(s, "dissoc expects a map and keys");
+    }
+    tval *t = tmap_transient(s, tmap_kind_arg(f, "dissoc", false));
+    for (tsize i = 2; i < c; i++) {
+        tmap_del(s, t, f->objs[i]);
+    }
+    f->obji = 1;
+    tframe_push(f, tmap_persistent(t));
+    return 1;
+}
+
+// (get m k) is the value of k in m, or nil if there is none. (get m k d) returns d then.
+tsize builtin_get(tframe *f) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f);
+    if (c != 3 && c != 4) {
+        TET_THROW(s, "get expects a map, a key and optionally a default");
+    }
+    tval *m = tmap_arg(f);
+    tval *v = c == 4 ? f->objs[3] : NULL;
+    tmap_get(m, f->objs[2], &v);
+    f->obji = 1;
+    tframe_push(f, v);
+    return 1;
+}
+
+tsize builtin_contains(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 3) {
+        TET_THROW(s, "contains expects a map and a key");
+    }
+    tval *m = tmap_arg(f);
+    tval *v;
+    bool r = tmap_get(m, f->objs[2], &v);
+    f->obji = 1;
+    tet_pushnumber(f, r);
+    return 1;
+}
+
+tsize builtin_count(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "count expects a map");
+    }
+    tval *m = tmap_arg(f);
+    f->obji = 1;
+    tet_pushnumber(f, (tnum) m->count);
+    return 1;
+}
+
+static tsize builtin_keys_with(tframe *f, char *name, bool vals) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "%s expects a map", name);
+    }
+    tval *m = tmap_arg(f);
+    tval *l = NULL;
+    tmapnode_list(s, m->node, vals, &l);
+    if (!l) {
+        l = tval_sexpr(s, NULL, NULL);
+    }
+    f->obji = 1;
+    tframe_push(f, l);
+    return 1;
+}
+
+tsize builtin_keys(tframe *f) {
+    return builtin_keys_with(f, "keys", false);
+}
+
+tsize builtin_vals(tframe *f) {
+    return builtin_keys_with(f, "vals", true);
+}
+
+tsize builtin_transient(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "transient expects a map");
+    }
+    tval *t = tmap_transient(s, tmap_kind_arg(f, "transient", false));
+    f->obji = 1;
+    tframe_push(f, t);
+    return 1;
+}
+
+tsize builtin_assoc_mut(tframe *f) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f);
+    if (c < 2 || c % 2) {
+        TET_THROW(s, "assoc! expects a transient map, keys and values");
+    }
+    tval *t = tmap_kind_arg(f, "assoc!", true);
+    for (tsize i = 2; i < c; i += 2) {
+        tmap_put(s, t, f->objs[i], f->objs[i + 1]);
+    }
+    f->obji = 1;
+    tframe_push(f, t);
+    return 1;
+}
+
+tsize builtin_dissoc_mut(tframe *f) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f);
+    if (c < 2) {
+        TET_THROW(s, "dissoc! expects a transient map and keys");
+    }
+    tval *t = tmap_kind_arg(f, "dissoc!", true);
+    for (tsize i = 2; i < c; i++) {
+        tmap_del(s, t, f->objs[i]);
+    }
+    f->obji = 1;
+    tframe_push(f, t);
+    return 1;
+}
+
+tsize builtin_persistent(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "persistent! expects a transient map");
+    }
+    tval *t = tmap_persistent(tmap_kind_arg(f, "persistent!", true));
+    f->obji = 1;
+    tframe_push(f, t);
+    return 1;
+}
+
+// (range end), (range start end) and (range start end step): the numbers from start
+// (or 0) up to end, exclusive, a step (or 1) apart.
+tsize builtin_range(tframe *f) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f);
+    if (c < 2 || c > 4) {
+        TET_THROW(s, "range expects an end, or a start, end and optionally a step");
+    }
+    tval *r = tval_seq(s, TSEQ_RANGE);
+    tseq *q = r->seq;
+    q->start = c > 2 ? tet_getnumber(f, 1) : 0;
+    q->end = tet_getnumber(f, c > 2 ? 2 : 1);
+    q->step = c > 3 ? tet_getnumber(f, 3) : 1;
+    if (!q->step) {
+        TET_THROW(s, "range expects a step other than 0");
+    }
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+static tsize builtin_lazy_with(tframe *f, char *name, tseqkind kind) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 3) {
+        TET_THROW(s, "%s expects a function and a sequence", name);
+    }
+    tval *src = tseq_arg(f, 2);
+    tval *r = tval_seq(s, kind);
+    r->seq->fn = tframe_get(f, 1);
+    r->seq->src = src;
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+tsize builtin_lazy_map(tframe *f) {
+    return builtin_lazy_with(f, "lazy-map", TSEQ_MAP);
+}
+
+tsize builtin_lazy_filter(tframe *f) {
+    return builtin_lazy_with(f, "lazy-filter", TSEQ_FILTER);
+}
+
+// (take n seq). Taking from a range or a take is done by shortening it instead.
+tsize builtin_take(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 3) {
+        TET_THROW(s, "take expects a count and a sequence");
+    }
+    tnum n = tet_getnumber(f, 1);
+    if (n < 0) {
+        TET_THROW(s, "take expects a count of at least 0");
+    }
+    tval *sv = tseq_arg(f, 2);
+    tseq *src = sv->seq;
+
+    tval *r;
+    if (src->kind == TSEQ_RANGE) {
+        r = tval_seq(s, TSEQ_RANGE);
+        *r->seq = *src;
+        if ((uint64_t) n < tseq_range_len(src)) {
+            r->seq->end = (tnum) ((uint64_t) src->start + (uint64_t) n * (uint64_t) src->step);
+        }
+    } else if (src->kind == TSEQ_TAKE) {
+        r = tval_seq(s, TSEQ_TAKE);
+        *r->seq = *src;
+        r->seq->end = n < src->end ? n : src->end;
+    } else {
+        r = tval_seq(s, TSEQ_TAKE);
+        r->seq->src = sv;
+        r->seq->end = n;
+    }
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+// (reduce f init seq) folds f over seq, from init: (f (f init x0) x1) and so on.
+tsize builtin_reduce(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 4) {
+        TET_THROW(s, "reduce expects a function, an initial value and a sequence");
+    }
+    tval *args[2] = {tframe_get(f, 2), NULL};
+    TET_CATCHABLE(s);
+    tseqit *it = tseq_iter(s, tseq_arg(f, 3)->seq);
+    TET_CATCH(s, err, {
+        tstate_region_exit(s, (tobj *) err);
+        tfree(it);
+        TET_THROWRAW(s, err);
+    });
+
+    // Only the accumulator survives an element (see tseq_collect).
+    tsize next = TET_SEQ_GC;
+    tstate_region_enter(s);
+    while (tseq_next(s, f->env, it, &args[1])) {
+        args[0] = tseq_call(s, f->env, tframe_get(f, 1), args, 2);
+        tseq_collect(s, &next, (tobj *) args[0]);
+    }
+    tstate_region_exit(s, (tobj *) args[0]);
+    TET_UNCATCH(s);
+    tfree(it);
+    f->obji = 1;
+    tframe_push(f, args[0]);
+    return 1;
+}
+
+tsize builtin_seq_list(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "seq-list expects a sequence");
+    }
+    tval *l = NULL;
+    tval *v;
+    TET_CATCHABLE(s);
+    tseqit *it = tseq_iter(s, tseq_arg(f, 1)->seq);
+    TET_CATCH(s, err, {
+        tstate_region_exit(s, (tobj *) err);
+        tfree(it);
+        TET_THROWRAW(s, err);
+    });
+
+    // Only the list survives its elements (see tseq_collect). Its cells outlive the
+    // regions they were made in, so the last one is remembered before it is appended to.
+    tsize next = TET_SEQ_GC;
+    tval *last = NULL;
+    tstate_region_enter(s);
+    while (tseq_next(s, f->env, it, &v)) {
+        tval *c = tval_sexpr(s, v, NULL);
+        if (last) {
+            tstate_remember(s, (tobj *) last);
+            last->cdr = c;
+        } else {
+            l = c;
+        }
+        last = c;
+        tseq_collect(s, &next, (tobj *) l);
+    }
+    tstate_region_exit(s, (tobj *) l);
+    TET_UNCATCH(s);
+    tfree(it);
+    if (!l) {
+        l = tval_sexpr(s, NULL, NULL);
+    }
+    f->obji = 1;
+    tframe_push(f, l);
+    return 1;
+}
+
+tsize builtin_mmap(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "mmap expects a path");
+    }
+    tval *r = tval_mmap(s, tet_gettype(f, 1, TVAL_STRING)->str);
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+tsize builtin_bytes(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "bytes expects a string");
+    }
+    char *str = tet_gettype(f, 1, TVAL_STRING)->str;
+    tval *r = tval_bytes(s, str, strlen(str));
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+tsize builtin_bytes_len(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "bytes-len expects bytes");
+    }
+    tbytes *b = tet_gettype(f, 1, TVAL_BYTES)->bytes;
+    f->obji = 1;
+    tet_pushnumber(f, (tnum) b->len);
+    return 1;
+}
+
+// The one builtin that copies bytes, into a string (up to the first zero byte, if any).
+tsize builtin_bytes_str(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "bytes-str expects bytes");
+    }
+    tbytes *b = tet_gettype(f, 1, TVAL_BYTES)->bytes;
+    tval *r = tval_new(s, TVAL_STRING);
+    char *c = tealloc(s, b->len + 1);
+    if (b->len) {
+        memcpy(c, b->ptr, b->len);
+    }
+    c[b->len] = 0;
+    r->str = c;
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+// (bytes-slice b start [end]), end defaulting to the end of b.
+tsize builtin_bytes_slice(tframe *f) {
+    tstate *s = f->env->state;
+    tsize c = tframe_size(f);
+    if (c != 3 && c != 4) {
+        TET_THROW(s, "bytes-slice expects bytes, a start and optionally an end");
+    }
+    tval *v = tet_gettype(f, 1, TVAL_BYTES);
+    tnum start = tet_getnumber(f, 2);
+    tnum end = c > 3 ? tet_getnumber(f, 3) : (tnum) v->bytes->len;
+    if (start < 0 || end < start || (tsize) end > v->bytes->len) {
+        TET_THROW(s, "bytes-slice out of range, %" PRId64 " to %" PRId64 " of %zu", start, end,
+                  v->bytes->len);
+    }
+    tval *r = tbytes_slice(s, v, (tsize) start, (tsize) (end - start));
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+// How many times a byte occurs (say how many lines there are), counted without making a
+// value for each.
+tsize builtin_bytes_count(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 3) {
+        TET_THROW(s, "bytes-count expects bytes and a delimiter");
+    }
+    tbytes *b = tet_gettype(f, 1, TVAL_BYTES)->bytes;
+    int d = tbytes_delim_arg(f, 2, "bytes-count");
+    tsize n = b->len ? tbytes_count(b->ptr, b->len, d) : 0;
+    f->obji = 1;
+    tet_pushnumber(f, (tnum) n);
+    return 1;
+}
+
+static tsize builtin_split_with(tframe *f, tval *v, int d) {
+    tval *r = tval_seq(f->env->state, TSEQ_SPLIT);
+    r->seq->src = v;
+    r->seq->step = d;
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
+
+tsize builtin_lines(tframe *f) {
+    if (tframe_size(f) != 2) {
+        TET_THROW(f->env->state, "lines expects bytes");
+    }
+    return builtin_split_with(f, tet_gettype(f, 1, TVAL_BYTES), '\n');
+}
+
+tsize builtin_split(tframe *f) {
+    if (tframe_size(f) != 3) {
+        TET_THROW(f->env->state, "split expects bytes and a delimiter");
+    }
+    tval *v = tet_gettype(f, 1, TVAL_BYTES);
+    return builtin_split_with(f, v, tbytes_delim_arg(f, 2, "split"));
+}
+
+// The printed form of a value, which tet_parse reads back as an equal value if it's made
+// of numbers, strings, symbols and lists.
+tsize builtin_repr(tframe *f) {
+    tstate *s = f->env->state;
+    if (tframe_size(f) != 2) {
+        TET_THROW(s, "repr expects a value");
+    }
+    tval *r = tval_new(s, TVAL_STRING);
+    r->str = NULL;
+
+    tprinter p;
+    tprinter_init(&p, NULL, NULL);
+    tprinter_val(&p, tframe_get(f, 1));
+    if (p.failed) {
+        tprinter_del(&p);
+        TET_THROWRAW(s, s->memerr);
+    }
+    // The buffer is the string.
+    r->str = p.buf;
+    p.buf = NULL;
+    tprinter_del(&p);
+
+    f->obji = 1;
+    tframe_push(f, r);
+    return 1;
+}
@@ -6,9 +6,13 @@
 #define TET_H
 
 #include <stddef.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <setjmp.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
 
 //    ____ ___  _   _ _____ ___ ____
 //   / ___/ _ \| \ | |  ___|_ _/ ___|
@@ -19,13 +23,16 @@
 
 // types
 #define TET_TYPE_BYTE uint8_t
-#define TET_TYPE_NUMBER int32_t
+#define TET_TYPE_NUMBER int64_t
 #define TET_TYPE_SIZE size_t
 
 // tstate->jmps
-// desc:    This array contains jump buffers used with longjmp when handling errors.
-// fields:  _LEN is initial size
-#define TET_STATE_JMPS_LEN 4
+// desc:    This array contains jump buffers used with longjmp when handling errors, in
+//          blocks that are allocated as handlers nest deeper.
+// fields:  _LEN is how many handlers a block holds
+//          _MAX is how deeply handlers may nest (see TET_CATCH)
+#define TET_STATE_JMPS_LEN 8
+#define TET_STATE_JMPS_MAX 1024
 
 // tstate->objs
 //      _LEN is initial size
@@ -40,16 +47,167 @@
 //           to allocation logic have been made.
 #define TET_STATE_PTRS_LEN 4
 
+// tstate->pins
+//      _LEN is initial size
+#define TET_STATE_PINS_LEN 8
+
+// tstate->remembered
+//      _LEN is initial size
+#define TET_STATE_REMEMBERED_LEN 8
+
+// tstate->nums
+//      _MIN and _MAX bound the numbers every tstate preallocates (_MAX excluded), which
+//                    tval_num returns rather than allocating new ones.
+#define TET_STATE_NUMS_MIN (-128)
+#define TET_STATE_NUMS_MAX 1024
+
+// tstate_gc
+//      _THREADS is the default number of threads to mark with (tstate->gcthreads), 0 means
+//               one per online core.
+//      _PARALLEL is the number of objects a heap must have before it is marked in parallel.
+//      _SHARE is the number of objects a marking thread keeps to itself before it offers
+//             half of them to the other threads.
+#define TET_GC_THREADS 0
+#define TET_GC_PARALLEL 65536
+#define TET_GC_SHARE 64
+
+// tstate_sweep
+//      _SWEEP is the number of objects every allocation sweeps while a sweep is pending.
+#define TET_GC_SWEEP 32
+
+// tstats
+//      _PAUSES is the number of buckets in the pause time histogram. Bucket 0 counts pauses
+//              under a microsecond, bucket i those under 2^i microseconds and the last one
+//              everything longer.
+#define TET_GC_PAUSES 24
+
+// theapprof
+//      _RATE is the default average number of bytes allocated between two samples.
+//      _CDEPTH is the number of C frames recorded per sample.
+//      _STACK is the maximum length of the tet call stack recorded per sample.
+#define TET_HEAPPROF_RATE (512 * 1024)
+#define TET_HEAPPROF_CDEPTH 4
+#define TET_HEAPPROF_STACK 512
+
+// tcpuprof
+//      _HZ is the default number of samples per second of CPU time.
+//      _STEPS is the number of steps tet_run takes between looking for a due sample.
+#define TET_CPUPROF_HZ 99
+#define TET_CPUPROF_STEPS 1024
+
 // tframe->stack
 // fields:  _LEN is initial size
 //          _GROW is the growth factor
 #define TET_FRAME_STACK_LEN 8
 #define TET_FRAME_STACK_GROW(l) ((l) * 2)
 
-// tet_strbuf
-//      _LEN is initial size, used for formatting errors (from C).
+// tstate->strbuf
+//      _LEN is the size of the per-state buffer used for formatting errors (from C).
 #define TET_STRBUF_LEN 256
 
+// tpool
+//      _THREADS is the default number of worker threads, 0 means one per online core.
+//      _CHUNK is the default number of list elements handed to a worker at a time,
+//             0 means the list is split in roughly four chunks per worker.
+#define TET_POOL_THREADS 0
+#define TET_POOL_CHUNK 0
+
+// tsched
+//      _THREADS is the default number of worker threads, 0 means one per online core.
+//      _SLICE is the number of evaluation steps a task may run before it is preempted.
+//      _GC is the number of objects a worker's heap may grow to before it collects,
+//          after which it may grow to twice its live size (but at least this much).
+//      _POLL is the number of slices a worker runs between checking whether any of its
+//            tasks waiting for I/O can continue.
+//      _EVENTS is the maximum number of I/O events a worker handles per check.
+#define TET_SCHED_THREADS 0
+#define TET_SCHED_SLICE 1024
+#define TET_SCHED_GC 4096
+#define TET_SCHED_POLL 64
+#define TET_SCHED_EVENTS 64
+
+// tseq
+//      _GC is the number of objects consuming a sequence may allocate before the garbage
+//          left by the elements so far is freed, after which it may allocate twice what
+//          survived (but at least this much).
+#define TET_SEQ_GC 4096
+
+// I/O builtins
+//      _READ is the number of bytes read reads at most when not told otherwise.
+#define TET_IO_READ 4096
+
+// tprinter
+//      _BUF is the size the buffer of a printer with a sink grows to before it is flushed.
+//      _IOV is the number of pieces a printer hands to its sink at once at most.
+//      _DIRECT is the length from which strings and bytes are handed to the sink as
+//              they are, rather than copied into the buffer.
+#define TET_PRINT_BUF 65536
+#define TET_PRINT_IOV 64
+#define TET_PRINT_DIRECT 1024
+
+// tfrozen
+//      _CHUNK is the size of the chunks a frozen region allocates from (a larger value
+//          gets a chunk of its own size)
+//      _CHUNK_MIN is the size of its first chunk, which doubles for every next one up to
+//          _CHUNK, so that small regions (like most messages) stay small
+#define TET_FROZEN_CHUNK 4096
+#define TET_FROZEN_CHUNK_MIN 256
+
+// tmailbox
+//      _LEN is the capacity of a mailbox created without one, capacities are always
+//           rounded up to a power of two (of at least two).
+#define TET_MAILBOX_LEN 64
+
+// TET_TRACE
+// desc:    Level of the events every state records in its trace (see ttrace_record),
+//          0 compiles tracing out entirely. Each level includes the ones before it:
+//          _ERROR (1) throws and catches, _GC (2) collections, _CALL (3) invocations of
+//          builtins and lambdas and _EVAL (4) every value evaluated. TET_DEBUG, which
+//          used to print all of these to stdout, is taken to mean full tracing.
+// fields:  _LEN is the number of events kept, a power of two.
+#ifndef TET_TRACE
+#if defined(TET_DEBUG) && TET_DEBUG
+#define TET_TRACE 4
+#else
+#define TET_TRACE 0
+#endif
+#endif
+#define TET_TRACE_ERROR 1
+#define TET_TRACE_GC 2
+#define TET_TRACE_CALL 3
+#define TET_TRACE_EVAL 4
+#define TET_TRACE_LEN 4096
+
+// TET_JIT
+// desc:    When non-zero, lambdas invoked often enough are compiled to machine code (see
+//          tjit). Only x86-64 Linux is supported, elsewhere lambdas are always
+//          interpreted.
+// fields:  _HOT is the number of invocations after which a lambda is compiled.
+//          _LEN is the initial size of the table of lambdas seen, a power of two.
+#ifndef TET_JIT
+#if defined(__x86_64__) && defined(__linux__)
+#define TET_JIT 1
+#else
+#define TET_JIT 0
+#endif
+#endif
+#define TET_JIT_HOT 64
+#define TET_JIT_LEN 64
+
+// TET_SIMD
+// desc:    When non-zero, the vector builtins use SSE2, SSE4.2 or AVX2, whichever is the
+//          widest the CPU supports (checked at run time). Only x86-64 is supported,
+//          elsewhere they are plain loops.
+// fields:  _ALIGN is the alignment of the numbers of new vectors, in bytes.
+#ifndef TET_SIMD
+#if defined(__x86_64__)
+#define TET_SIMD 1
+#else
+#define TET_SIMD 0
+#endif
+#endif
+#define TET_SIMD_ALIGN 32
+
 //   ____  _____ ____ _        _    ____  _____ ____
 //  |  _ \| ____/ ___| |      / \  |  _ \| ____/ ___|
 //  | | | |  _|| |   | |     / _ \ | |_) |  _| \___ \
@@ -71,8 +229,35 @@ typedef enum tvaltype {
     TVAL_FRAME,
     TVAL_BUILTIN,
     TVAL_LAMBDA,
+    TVAL_TASK,
+    TVAL_MAILBOX,
+    TVAL_BIGNUM,
+    TVAL_VECTOR,
+    TVAL_MAP,
+    TVAL_SEQ,
+    TVAL_BYTES,
+    TVAL_TYPES, // number of value types, not a type itself
 } tvaltype;
 
+typedef enum ttracekind {
+    TTRACE_THROW, // a: 0, b: the error thrown
+    TTRACE_CATCH, // a: 0, b: the error caught by tet_run
+    TTRACE_GC, // a: objects marked, b: objects to be swept
+    TTRACE_SWEEP, // a: objects left after sweeping, b: 0
+    TTRACE_CALL, // a: number of arguments, b: the builtin or lambda
+    TTRACE_EVAL, // a: type of the value, b: the value
+} ttracekind;
+
+// An event in the trace of a state. Events are written by the thread running the state
+// and may be read by any other, which is why every field is accessed atomically.
+typedef struct ttrace_event {
+    uint64_t seq; // number of the event + 1, 0 while it is being written
+    uint64_t ns; // CLOCK_MONOTONIC
+    uint64_t kind;
+    uint64_t a;
+    uint64_t b;
+} ttrace_event;
+
 typedef enum tobjtype {
     TMARK_STATE = 0b00,
     TMARK_ENV = 0b01,
@@ -84,17 +269,70 @@ typedef enum tobjtype {
 #define TOBJ_MARK_TYPE ((tmark) 0xC0)
 #define TOBJ_MARK_VALUE ((tmark) 0x3F)
 #define SETMARK(v, m) ((v)->mark = ((v)->mark & TOBJ_MARK_TYPE) + ((m) & TOBJ_MARK_VALUE))
-#define SETMARKTYPE(v, t) ((v)->mark = (tmark)(t) << TOBJ_MARK_OFFSET)
+#define SETMARKTYPE(v, t) ((v)->flags = 0, (v)->mark = (tmark)(t) << TOBJ_MARK_OFFSET)
 #define GETMARK(v) ((v)->mark & TOBJ_MARK_VALUE)
 #define GETMARKTYPE(v) ((v)->mark >> TOBJ_MARK_OFFSET)
 
+// Object flags, stored next to the mark.
+//      _FROZEN objects live in a frozen region (see tfrozen) and are never written to.
+//      _YIELDED frames suspended while invoking a builtin (see tet_yield).
+//      _SAMPLED objects were sampled by the heap profiler (see theapprof).
+//      _CALLED lambdas were invoked before, and are counted by the compiler (see tjit).
+//      _PURE builtins have no effects and depend only on their arguments (see tval_pure).
+//      _STATIC values live as long as their tstate and are never marked (see tval_num).
+//      _TRANSIENT maps are changed in place by tmap_put and tmap_del (see tmap_transient).
+//      _REGION objects were allocated in the open region, or are older objects that were
+//              written to in it (see tstate_region_enter).
+#define TOBJ_FLAG_FROZEN ((tmark) 0x01)
+#define TOBJ_FLAG_YIELDED ((tmark) 0x02)
+#define TOBJ_FLAG_SAMPLED ((tmark) 0x04)
+#define TOBJ_FLAG_CALLED ((tmark) 0x08)
+#define TOBJ_FLAG_PURE ((tmark) 0x10)
+#define TOBJ_FLAG_STATIC ((tmark) 0x20)
+#define TOBJ_FLAG_TRANSIENT ((tmark) 0x40)
+#define TOBJ_FLAG_REGION ((tmark) 0x80)
+#define TOBJ_FROZEN(v) ((v)->flags & TOBJ_FLAG_FROZEN)
+
 typedef struct tstate tstate;
 typedef struct tobj tobj;
 typedef struct tenv tenv;
 typedef struct tframe tframe;
 typedef struct tval tval;
+typedef struct tpool tpool;
+typedef struct tfrozen tfrozen;
+typedef struct tsched tsched;
+typedef struct ttask ttask;
+typedef struct tmailbox tmailbox;
+typedef struct theapprof theapprof;
+typedef struct tcpuprof tcpuprof;
+typedef struct tjit tjit;
+typedef struct tsymcache tsymcache;
+typedef struct tbig tbig;
+typedef struct tvec tvec;
+typedef struct tmapnode tmapnode;
+typedef struct tseq tseq;
+typedef struct tbuf tbuf;
+typedef struct tbytes tbytes;
 typedef tsize (*tbuiltin)(tframe *f);
 
+// An argument or result of a fast builtin: a number is passed as is, everything else as
+// the value itself.
+typedef union targ {
+    tnum num;
+    tval *val;
+} targ;
+
+// The fixed-arity calling convention of a builtin, see tval_fast. Unused arguments are
+// zero. Returns false to have the builtin called through the stack after all.
+#define TET_FAST_ARGS 2
+typedef bool (*tfastfn)(tstate *s, targ a, targ b, targ *r);
+typedef struct tfast {
+    tsize arity;
+    tvaltype args[TET_FAST_ARGS];
+    tvaltype ret;
+    tfastfn fn;
+} tfast;
+
 //    ____ _     ___  ____    _    _     ____
 //   / ___| |   / _ \| __ )  / \  | |   / ___|
 //  | |  _| |  | | | |  _ \ / _ \ | |   \___ \
@@ -102,9 +340,6 @@ typedef tsize (*tbuiltin)(tframe *f);
 //   \____|_____\___/|____/_/   \_\_____|____/
 //
 
-static tval tet_memerr;
-static char tet_strbuf[TET_STRBUF_LEN];
-
 // Primitive memory functions.
 void *talloc(tsize l);
 void *trealloc(void *p, tsize l);
@@ -129,27 +364,48 @@ char *tvaltype_print(tvaltype t);
 //  |_|  |_/_/   \_\____|_| \_\\___/|____/
 //
 
-// Error handling
+// Error handling. Handlers nest no deeper than TET_STATE_JMPS_MAX (evaluation nests as
+// builtins like map evaluate lambdas), one more is refused with an error thrown to the
+// handler before it. Code that acquires what its handler releases checks for room with
+// TET_CATCHABLE first, so that the refusal doesn't leak it. The jump stack grows a block
+// at a time (a jmp_buf can't be moved once set, so blocks are never reallocated).
+#define TET_JMP(s, i) (&(s)->jmps[(i) / TET_STATE_JMPS_LEN][(i) % TET_STATE_JMPS_LEN])
+#define TET_CATCHABLE(s) \
+    if ((s)->jmpi % TET_STATE_JMPS_LEN == 0 &&\
+        ((s)->jmpi >= TET_STATE_JMPS_MAX || !(s)->jmps[(s)->jmpi / TET_STATE_JMPS_LEN])) {\
+        tstate_jmps_room((s), 1);\
+    }
 #define TET_CATCH(s, e, expr) \
-    if (setjmp((s)->jmps[(s)->jmpi++].buf)) {\
+    TET_CATCHABLE(s)\
+    (s)->jmpi++;\
+    if (setjmp(TET_JMP((s), (s)->jmpi - 1)->buf)) {\
         tsize i = (s)->jmpi;\
-        tval *(e) = (tval*) (s)->jmps[i].val;\
+        tval *(e) = (tval*) TET_JMP((s), i)->val;\
         trclean(s); expr;\
     }
 #define TET_UNCATCH(s) (s)->jmpi--
 #define TET_THROWRAW(s, e) {\
+        TET_TRACE_EVENT((s), TET_TRACE_ERROR, TTRACE_THROW, 0, (e));\
         tsize i = --(s)->jmpi;\
-        (s)->jmps[i].val = (void*) (e);\
-        longjmp((s)->jmps[i].buf, 1);\
+        TET_JMP((s), i)->val = (void*) (e);\
+        longjmp(TET_JMP((s), i)->buf, 1);\
     }
 #define TET_THROW(s, fmt, ...) {\
     tval *err = tval_err((s), fmt, ##__VA_ARGS__);\
-    printf("THROW: %p (err tval*)\n", err);\
     TET_THROWRAW((s), err);\
     }
 
+// Tracing, recording an event only if its level is enabled (see TET_TRACE).
+#if TET_TRACE
+#define TET_TRACE_EVENT(s, level, kind, a, b) do {\
+        if ((level) <= TET_TRACE) ttrace_record((s), (kind), (uint64_t) (a), (uint64_t) (uintptr_t) (b));\
+    } while (0)
+#else
+#define TET_TRACE_EVENT(s, level, kind, a, b) do {} while (0)
+#endif
+
 // Helpers
-#define GC_HEADER() tmark mark;
+#define GC_HEADER() tmark mark; tmark flags;
 
 //   ____ _____  _  _____ _____
 //  / ___|_   _|/ \|_   _| ____|
@@ -157,18 +413,110 @@ char *tvaltype_print(tvaltype t);
 //   ___) || |/ ___ \| | | |___
 //  |____/ |_/_/   \_\_| |_____|
 //
+// Concurrency: tet keeps no mutable global state. Everything an interpreter touches
+// (its heap, its error handler stack, its error formatting buffer and even the
+// preallocated out-of-memory error) is owned by its tstate. Independent tstates may
+// therefore be used concurrently from separate threads without any locking, as long
+// as no single tstate (or object allocated by it) is used by two threads at once.
 struct tstate {
     GC_HEADER();
 
     tenv *env;
     tframe *frame;
 
-    // A small 'jump stack' used for (nested) error handling.
-    struct {
+    // The error thrown when an allocation fails. It is allocated up front (so throwing
+    // it never allocates) and is never tracked, so it will never be garbage collected.
+    tval *memerr;
+
+    // Scratch buffer used to format error messages.
+    char strbuf[TET_STRBUF_LEN];
+
+    // Worker pool used by parallel builtins, created on first use (see tstate_pool).
+    tpool *pool;
+
+    // Frozen regions this state holds a reference to, released when it is deleted.
+    tfrozen **held;
+    tsize heldi;
+    tsize heldl;
+
+    // Scheduler used to run spawned tasks, created on first use (see tstate_sched).
+    // For the worker states of a scheduler this is the scheduler they work for, and
+    // 'task' is the task they are currently running.
+    tsched *sched;
+    ttask *task;
+
+    // Set by tet_yield to suspend the running frame chain after the current builtin.
+    bool yield;
+
+    // Number of tet_runs in progress, one inside the other (see tet_can_yield).
+    tsize depth;
+
+    // Number of threads tstate_gc marks large heaps with, 0 for one per online core.
+    tsize gcthreads;
+
+    // Sweep in progress (see tstate_sweep): objs[sweepi..sweepn) are yet to be swept,
+    // objs[0..sweepj) survived, and the slots in between are free.
+    tsize sweepi;
+    tsize sweepj;
+    tsize sweepn;
+
+    // Garbage collector counters, see tstate_stats.
+    tsize allocs;
+    tsize gcs;
+    uint64_t pausetotal; // nanoseconds
+    uint64_t pausemax; // nanoseconds
+    tsize pauses[TET_GC_PAUSES];
+
+    // Heap and CPU profiles, if profiling (see tstate_heapprof and tstate_cpuprof).
+    theapprof *heapprof;
+    tcpuprof *cpuprof;
+
+    // The frame tet_run is evaluating, while it runs.
+    tframe **running;
+
+    // Whether to compile hot lambdas (see tjit), and what we know about them so far.
+    bool jit;
+    tjit *jitted;
+
+    // Names bound in envs that aren't the outermost of their chain, as a bitmap of their
+    // hashes, and a version that is bumped when a bit is first set or a global env goes
+    // away. Symbols only cache global bindings while both allow it (see tenv_lookup).
+    uint64_t shadowed[4];
+    tsize envver;
+
+    // The numbers from TET_STATE_NUMS_MIN up to _MAX, if we could allocate them.
+    tval *nums;
+
+#if TET_TRACE
+    // Ring buffer of the last TET_TRACE_LEN trace events, see ttrace_record.
+    ttrace_event *trace;
+    uint64_t tracei; // atomic, number of events ever recorded
+#endif
+
+    // Objects that are garbage collection roots in addition to env and frame. Free
+    // slots are NULL and their indices are kept on the pinfree stack.
+    tobj **pins;
+    tsize pini;
+    tsize pinl;
+    tsize *pinfree;
+    tsize pinfreei;
+
+    // How deeply regions are nested (see tstate_region_enter), where the objects
+    // allocated in the outermost one start in objs, and the older objects written to
+    // since. To keep the region at the end of objs, no sweep is left unfinished while
+    // one is open.
+    tsize regions;
+    tsize regioni;
+    tobj **remembered;
+    tsize rememberedi;
+    tsize rememberedl;
+
+    // The 'jump stack' used for (nested) error handling, in blocks of TET_STATE_JMPS_LEN.
+    struct tjmp {
         void *val;
         jmp_buf buf;
-    } jmps[TET_STATE_JMPS_LEN];
-    tmark jmpi;
+    } *jmps[TET_STATE_JMPS_MAX / TET_STATE_JMPS_LEN];
+    tsize jmpi;
 
     // All pointers to non-garbage-collectable objects
     // (used to free memory if object construction fails halfway).
@@ -186,16 +534,77 @@ struct tobj {
     GC_HEADER();
 };
 
+// Heap and garbage collector statistics of a tstate, as filled in by tstate_stats.
+// Objects and bytes are indexed by tobjtype (TMARK_STATE is always 0), values and
+// valuebytes by tvaltype. Bytes include memory owned by an object (the characters of
+// a string, the slots of a frame), but not memory shared with other states.
+typedef struct tstats {
+    tsize objects[4];
+    tsize bytes[4];
+    tsize values[TVAL_TYPES];
+    tsize valuebytes[TVAL_TYPES];
+
+    tsize allocs; // objects allocated since the state was created
+    tsize gcs; // number of collections
+    uint64_t pausetotal; // nanoseconds spent in tstate_gc
+    uint64_t pausemax; // nanoseconds of the longest tstate_gc
+    tsize pauses[TET_GC_PAUSES]; // pause time histogram (see TET_GC_PAUSES)
+} tstats;
+
 tstate *tstate_new();
 void tstate_del(tstate *s);
+
+// Make room on the jump stack for 'n' more handlers (see TET_CATCH), throwing to the
+// innermost handler if that would nest them too deeply.
+void tstate_jmps_room(tstate *s, tsize n);
 tsize tstate_mark(tstate *s, tmark m);
 
+// Like tstate_mark, but with 'threads' threads sharing the work. tstate_gc uses this for
+// heaps of at least TET_GC_PARALLEL objects.
+tsize tstate_mark_parallel(tstate *s, tmark m, tsize threads);
+
+// Collect garbage, returning the number of unreachable objects. Only marking is done
+// right away, the unreachable objects are freed by tstate_sweep: a little at a time as
+// new objects are allocated, or all at once when called directly (with n = 0).
 tsize tstate_gc(tstate *s);
+bool tstate_sweep(tstate *s, tsize n);
+
+// Fill in 'st' with the statistics of 's'. The counts of live objects are taken by
+// walking the heap, so this is O(heap), but nothing is counted until asked for.
+void tstate_stats(tstate *s, tstats *st);
 void tstate_gc_obj(tstate *s, tobj *o);
 
 void tstate_track(tstate *s, tobj *o);
 void tstate_untrack(tstate *s, tobj *o);
 
+tpool *tstate_pool(tstate *s, tsize threads, tsize chunk);
+
+tval *tstate_freeze(tstate *s, tval *v);
+void tstate_hold(tstate *s, tfrozen *z);
+
+tsched *tstate_sched(tstate *s, tsize threads);
+
+// Start profiling the heap, sampling an allocation about once every 'rate' bytes, or
+// stop (and forget the profile) if 'rate' is 0.
+void tstate_heapprof(tstate *s, tsize rate);
+
+// Start profiling the CPU time the calling thread spends running 's', taking about 'hz'
+// samples per second, or stop (and forget the profile) if 'hz' is 0.
+void tstate_cpuprof(tstate *s, tsize hz);
+
+tsize tstate_pin(tstate *s, tobj *o);
+void tstate_repin(tstate *s, tsize i, tobj *o);
+void tstate_unpin(tstate *s, tsize i);
+
+// Enter a region: the objects allocated from here on are freed all at once when it is
+// left, in time proportional to their number rather than to the whole heap. Older
+// objects they were stored into (bindings in outer envs, transient maps, ...) keep them,
+// and whatever they reach, alive, as do 'keep', the pins, s->env and s->frame. Regions
+// nest, only leaving the outermost one frees anything. Like tstate_gc, this must not be
+// done while evaluating. Returns the number of objects freed.
+void tstate_region_enter(tstate *s);
+tsize tstate_region_exit(tstate *s, tobj *keep);
+
 //   _____ _   ___     __
 //  | ____| \ | \ \   / /
 //  |  _| |  \| |\ \ / /
@@ -207,6 +616,7 @@ struct tenv {
     tstate *state;
 
     tenv *prev;
+    tenv *root; // the outermost env of the chain, as far as we know
     tval *vars;
 };
 
@@ -215,9 +625,14 @@ void tenv_del(tenv *e);
 tsize tenv_mark(tenv *e, tmark m);
 
 tval *tenv_get(tenv *e, tval *k);
+// Like tenv_get, but remembering the binding in 'k' when it is found in the outermost env.
+// Until a name with the same hash is bound in an inner env somewhere in the state, later
+// lookups through 'k' from the same chain are a check and a load. tet_run uses this.
+tval *tenv_lookup(tenv *e, tval *k);
 tval *tenv_getpair(tenv *e, tval *k);
 tval *tenv_set(tenv *e, tval *k, tval *v);
 tval *tenv_put(tenv *e, tval *k, tval *v);
+void tenv_copy(tenv *e, tenv *from);
 
 //   _____ ____     _    __  __ _____
 //  |  ___|  _ \   / \  |  \/  | ____|
@@ -273,7 +688,7 @@ tval *tet_gettype(tframe *f, tsize i, tvaltype t);
         tframe_push(f, tval_##c(f->env->state, v));\
     }\
     r tet_pop##n(tframe *f) {\
-        tval *v = tet_get##n(f, f->obji - 1); \
+        r v = tet_get##n(f, f->obji - 1); \
         --f->obji; \
         return v;\
     }
@@ -321,7 +736,10 @@ struct tval {
     union {
         char *err; // ERROR
         tnum num; // NUMBER
-        char *sym; // SYMBOL
+        struct {
+            char *sym;
+            tsymcache *cache;
+        }; // SYMBOL
         char *str; // STRING
         struct {
             tval *car;
@@ -329,14 +747,117 @@ struct tval {
         }; // SEXPR / QEXPR
         tenv *env; // ENV
         tframe *frame; // FRAME
-        tbuiltin builtin; // BUILTIN
+        struct {
+            tbuiltin builtin;
+            const tfast *fast;
+        }; // BUILTIN
         struct {
             tval *pars;
             tval *body;
         }; // LAMBDA;
+        ttask *task; // TASK
+        tmailbox *mailbox; // MAILBOX
+        tbig *big; // BIGNUM
+        tvec *vec; // VECTOR
+        struct {
+            tmapnode *node;
+            tsize count;
+        }; // MAP
+        tseq *seq; // SEQ
+        tbytes *bytes; // BYTES
     };
 };
 
+// An integer outside of the range of tnum, as a sign and magnitude. The magnitude is 'n'
+// 32-bit limbs, least significant first, of which the last is never zero. Arithmetic
+// results that fit a tnum are always NUMBERs, so a BIGNUM is never zero either.
+struct tbig {
+    bool neg;
+    tsize n;
+    uint32_t *d;
+};
+
+// 'n' numbers, unboxed and contiguous. Vectors are never changed once made.
+struct tvec {
+    tsize n;
+    tnum *d;
+};
+
+// A node of a map, a hash array mapped trie. Up to TMAP_END, a node has an entry for
+// every 5-bit slice of the hash (least significant first) set in 'bitmap', in order of
+// the slices; past it, there are only keys with equal hashes, in no particular order. An
+// entry is either a key and its value, or (if 'node' is set) a node holding the keys
+// whose hashes share the slices of the node and the entry.
+//
+// Nodes are shared between the versions of a map, and counted by the maps and nodes
+// referring to them. A node referred to just once belongs to a single map and may be
+// changed in place, which is what transients do. Frozen nodes aren't counted ('refs' is
+// 0): they are never changed, nor freed.
+typedef struct tmapentry {
+    tval *key;
+    tval *val;
+    tmapnode *node;
+} tmapentry;
+
+struct tmapnode {
+    tsize refs;
+    uint32_t bitmap;
+    uint32_t n;
+    uint32_t cap; // entries there is room for
+    tmark mark; // of the last collection that marked it, so shared nodes are marked once
+    tmapentry e[];
+};
+
+#define TMAP_BITS 5
+#define TMAP_END 32
+
+// A lazy sequence: not its elements, but how to compute them, which happens only as
+// they are consumed (one at a time, and again every time the sequence is). Each kind
+// but RANGE, LIST and SPLIT draws its elements from the sequence 'src'.
+typedef enum tseqkind {
+    TSEQ_RANGE, // start, start + step, ... up to end (exclusive)
+    TSEQ_LIST, // the elements of the list 'src'
+    TSEQ_MAP, // fn applied to each element
+    TSEQ_FILTER, // the elements for which fn returns neither nil nor 0
+    TSEQ_TAKE, // the first 'end' elements
+    TSEQ_SPLIT, // the BYTES of 'src' between the bytes equal to 'step', as slices of it
+} tseqkind;
+
+struct tseq {
+    tseqkind kind;
+    tval *fn;
+    tval *src;
+    tnum start;
+    tnum end;
+    tnum step;
+};
+
+// Memory that BYTES values are slices of: a file mapped read-only, or bytes of our own
+// (right after the tbuf). Buffers are counted by the values referring to them, which
+// may be in different states (and threads), and released by the last one.
+struct tbuf {
+    tsize refs;
+    bool mapped;
+    char *data;
+    tsize len;
+};
+
+// 'len' bytes at 'ptr', in 'buf' (or NULL: in the frozen region of a frozen value, which
+// has them copied unless they were in a buffer already). Bytes are never changed, so
+// slices of them share the buffer rather than copy it.
+struct tbytes {
+    tbuf *buf;
+    char *ptr;
+    tsize len;
+};
+
+// The global binding a symbol was last resolved to, see tenv_lookup.
+struct tsymcache {
+    tenv *env; // the outermost env, that holds the binding
+    tsize ver; // the envver of the state at the time
+    tval *pair;
+};
+
 tval *tval_new(tstate *s, tvaltype t);
 void tval_del(tstate *s, tval *v);
 tsize tval_mark(tval *v, tmark m);
@@ -348,8 +869,95 @@ tval *tval_str(tstate *s, char *str);
 tval *tval_sexpr(tstate *s, tval *car, tval *cdr);
 tval *tval_qexpr(tstate *s, tval *car, tval *cdr);
 tval *tval_builtin(tstate *s, tbuiltin builtin);
+// A builtin that may be called ahead of time by tet_optimize, when all its arguments are
+// constants. Only register builtins as pure if they have no effects and return the same
+// values for the same arguments; throwing is fine.
+tval *tval_pure(tstate *s, tbuiltin builtin);
+// Give builtin 'v' a fast path: when it is called with exactly 'fast->arity' arguments of
+// the declared types, the evaluator calls 'fast->fn' with them unboxed instead of the
+// builtin, and pushes its result as a value of type 'fast->ret'. Any other call goes
+// through the stack as usual, so the builtin still has to handle (or reject) those, as
+// well as the calls its fast function declines. A fast function may throw, but must not
+// yield. Returns v.
+tval *tval_fast(tval *v, const tfast *fast);
 tval *tval_lambda(tstate *s, tval *pars, tval *body);
+tval *tval_task(tstate *s, ttask *task);
+tval *tval_mailbox(tstate *s, tmailbox *mailbox);
+// Takes ownership of 'big', which should have been allocated in one piece with its limbs
+// (as tet_parse_num and the arithmetic builtins do).
+tval *tval_bignum(tstate *s, tbig *big);
+// Takes ownership of 'vec', which should have been allocated by tvec_new.
+tval *tval_vector(tstate *s, tvec *vec);
+// A vector of 'n' numbers, left uninitialized, allocated in one piece with them.
+tvec *tvec_new(tstate *s, tsize n);
+// An empty map. Maps are persistent: tmap_put and tmap_del return a new map, sharing all
+// but the path to the key with the old one, and leave the old one as it is. Numbers,
+// bignums, strings, symbols, bytes and lists (element by element) are keys by value, all
+// other values by identity.
+tval *tval_map(tstate *s);
+
+// Whether map 'm' maps key 'k', and if so to what, in 'v'.
+bool tmap_get(tval *m, tval *k, tval **v);
+tval *tmap_put(tstate *s, tval *m, tval *k, tval *v);
+tval *tmap_del(tstate *s, tval *m, tval *k);
+// A transient copy of map 'm', for building up a map in bulk: tmap_put and tmap_del
+// change a transient in place (and return it), only copying the nodes it still shares
+// with 'm'. tmap_persistent makes it persistent again, after which it must not change.
+tval *tmap_transient(tstate *s, tval *m);
+tval *tmap_persistent(tval *m);
+// A sequence of kind 'kind', with all its fields (see tseq) left zero.
+tval *tval_seq(tstate *s, tseqkind kind);
+// A copy of the 'len' bytes at 'data'.
+tval *tval_bytes(tstate *s, const char *data, tsize len);
+// The contents of the file at 'path', mapped rather than read, for reading sequentially.
+// Throws if the file cannot be mapped.
+tval *tval_mmap(tstate *s, char *path);
+// Bytes 'off' to 'off + len' of BYTES 'v', sharing its buffer.
+tval *tbytes_slice(tstate *s, tval *v, tsize off, tsize len);
+
+tval *tval_copy(tstate *s, tval *v);
 
+// Where a printer's output goes: 'n' pieces, to be written in order. Returns whether
+// they were, if not the printer stops (and drops the rest of its output).
+typedef bool (*tsink)(void *ctx, const struct iovec *iov, int n);
+
+// Prints values, as tet_parse reads them, into a buffer. With a sink, what's in the
+// buffer is handed to the sink once it fills up and on tprinter_flush, together with
+// the strings and bytes that were too long to copy (see TET_PRINT_DIRECT), which must
+// therefore stay alive until then. Without one, the buffer grows to hold everything
+// printed: 'len' bytes at 'buf', followed by a zero. Lists are gone through without
+// recursing, and values that contain themselves are printed up to where they do, the
+// rest elided as "...".
+typedef struct tprinter {
+    tsink sink;
+    void *ctx;
+    char *buf;
+    tsize len;
+    tsize cap;
+    tsize mark; // the buffered bytes before it are in 'iov' already
+    struct iovec iov[TET_PRINT_IOV];
+    tsize iovi;
+    bool failed; // the sink failed or memory ran out
+    tval **open; // the values being printed, a set
+    tsize openi;
+    tsize openl;
+    struct tprintframe *stack; // the lists being printed
+    tsize stacki;
+    tsize stackl;
+} tprinter;
+
+void tprinter_init(tprinter *p, tsink sink, void *ctx);
+void tprinter_del(tprinter *p);
+void tprinter_val(tprinter *p, tval *v);
+void tprinter_put(tprinter *p, const char *data, tsize len);
+// Hands everything printed so far to the sink. Returns false if anything failed.
+bool tprinter_flush(tprinter *p);
+// Sinks writing to a file descriptor (the int that 'ctx' is), with writev and waiting
+// for it if it's non-blocking, and to a FILE * ('ctx').
+bool tsink_fd(void *ctx, const struct iovec *iov, int n);
+bool tsink_file(void *ctx, const struct iovec *iov, int n);
+
+// Prints 'v' to stdout.
 void tval_print(tval *v);
 
 //   _______     ___    _
@@ -365,8 +973,47 @@ void tval_print(tval *v);
 #define EOFP(c) ((c) == '\0')
 
 tval *tet_eval(tstate *s, tframe *f);
+tval *tet_run(tstate *s, tframe *root, tframe **cur, tsize steps);
+tval *tet_unquote(tstate *s, tval *v);
+void tet_yield(tframe *f);
+bool tet_resumed(tframe *f);
+
+// Whether a builtin called with 'f' may suspend its task with tet_yield. Only a task's
+// outermost run can be suspended: a run nested in a builtin (a lambda mapped over a list,
+// say) is resumed right away by tet_eval, so builtins waiting on something there have to
+// block instead.
+bool tet_can_yield(tframe *f);
 tframe *tet_read(tstate *s, char *in);
 
+// Apply 'fn' (a lambda or a builtin) to the 'n' values in 'args', in the global env of
+// 's'. Like tet_eval, returns an error or NULL, in which case the (first) value the call
+// returned is in 'r'. The result is garbage as far as the collector is concerned.
+tval *tet_call(tstate *s, tval *fn, tval **args, tsize n, tval **r);
+
+// A lambda or builtin to be called from C again and again. The handle pins it, so it
+// survives collections for as long as the handle lives, and calls through the handle
+// (tcall_run, like tet_call) reuse one frame. The result of a call stays on that frame,
+// and alive, until the next one.
+typedef struct tcall {
+    tstate *state;
+    tval *fn;
+    tframe *frame;
+    tsize fnpin;
+    tsize framepin;
+    bool busy; // a call is running, so a call from within it needs a frame of its own
+} tcall;
+
+tcall *tcall_new(tstate *s, tval *fn);
+void tcall_del(tcall *c);
+tval *tcall_run(tcall *c, tval **args, tsize n, tval **r);
+
+// Optimize the expression 'f' (as returned by tet_read) is about to evaluate. Calls to
+// pure builtins (see tval_pure) on constants are folded into their results, and lambda
+// literals applied to constants are inlined. Symbols are resolved in the env of 'f' as it
+// is now, so optimize right before evaluating. Only what 'f' evaluates in that env is
+// touched: lambda bodies may be called with any of their free symbols rebound.
+void tet_optimize(tstate *s, tframe *f);
+
 tval *tet_parse(tstate *s, char *in, tsize *i);
 tval *tet_parse_num(tstate *s, char *in, tsize *i);
 tval *tet_parse_sym(tstate *s, char *in, tsize *i);
@@ -374,6 +1021,401 @@ tval *tet_parse_str(tstate *s, char *in, tsize *i);
 tval *tet_parse_sexpr(tstate *s, char *in, tsize *i);
 tval *tet_parse_qexpr(tstate *s, char *in, tsize *i);
 
+//   ____   ___   ___  _
+//  |  _ \ / _ \ / _ \| |
+//  | |_) | | | | | | | |
+//  |  __/| |_| | |_| | |___
+//  |_|    \___/ \___/|_____|
+//
+// A pool of worker threads, each owning a private tstate, used to apply a function to
+// every element of a list in parallel. Workers never change the caller's heap while it
+// is running: the function and the caller's environment are frozen once per map and
+// shared by every worker, the elements are deep-copied into the worker's heap
+// (tval_copy), and the results are copied back into the caller's heap once every worker
+// has finished. The caller blocks in the meantime.
+//
+// A pool with a single thread runs everything inline on the calling thread. This is
+// also what the workers use for their own state, so nested parallel maps don't spawn
+// pools of their own.
+struct tpool {
+    tsize n; // number of workers
+    tsize chunk; // elements per work item, 0 for automatic
+
+    struct tpool_worker {
+        tpool *pool;
+        pthread_t thread;
+        tstate *state;
+    } *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // signalled when a job is posted (or the pool stops)
+    pthread_cond_t done; // signalled when the last worker finishes a job
+    struct tpool_job *job;
+    tsize gen; // incremented for every job posted
+    tsize busy; // workers still working on the current job
+    bool stop;
+};
+
+tpool *tpool_new(tsize threads, tsize chunk);
+void tpool_del(tpool *p);
+tval *tpool_map(tstate *s, tpool *p, tenv *e, tval *fn, tval *list, tsize chunk);
+
+//   _____ ____   ___ __________ _   _
+//  |  ___|  _ \ / _ \__  / ____| \ | |
+//  | |_  | |_) | | | |/ /|  _| |  \| |
+//  |  _| |  _ <| |_| / /_| |___| |\  |
+//  |_|   |_| \_\\___/____|_____|_| \_|
+//
+// A frozen region is an immutable copy of a tval graph that any number of tstates (on
+// any number of threads) can reference without copying it. Frozen values carry the
+// TOBJ_FLAG_FROZEN flag, are not tracked by any tstate and are never marked or swept,
+// so nothing ever writes to them and concurrent reads need no locks.
+//
+// Regions are reference counted. A tstate keeps the regions it references alive by
+// holding them (tstate_hold); tval_copy does this automatically, as it shares frozen
+// values instead of copying them. A region that refers to values of another region
+// holds that region in turn.
+//
+// To share, say, a large lookup table between states, freeze it once and put the
+// resulting root into every state's env after having that state hold the region:
+//
+//      tfrozen *z = tfrozen_new(s, table);
+//      tstate_hold(other, z);
+//      tenv_put(other->env, tval_sym(other, "table"), z->root);
+//      tfrozen_release(z);
+struct tfrozen {
+    tsize refs; // atomic
+    tval *root;
+
+    // Values are bump-allocated from a list of chunks, each value being preceded by a
+    // pointer back to its region (see tfrozen_of).
+    struct tfrozen_chunk *chunks;
+
+    // Other regions referenced from this one.
+    tfrozen **deps;
+    tsize depi;
+    tsize depl;
+
+    // Values in this region that hold a reference to a task, mailbox or buffer.
+    tval **handles;
+    tsize handlei;
+    tsize handlel;
+};
+
+tfrozen *tfrozen_new(tstate *s, tval *v);
+tfrozen *tfrozen_of(tval *v);
+void tfrozen_retain(tfrozen *z);
+void tfrozen_release(tfrozen *z);
+
+//   ____   ____ _   _ _____ ____
+//  / ___| / ___| | | | ____|  _ \
+//  \___ \| |   | |_| |  _| | | | |
+//   ___) | |___|  _  | |___| |_| |
+//  |____/ \____|_| |_|_____|____/
+//
+// Green threads (tasks) scheduled across a fixed number of OS threads. A task is
+// nothing more than a suspended frame chain: tet_run evaluates a chain for a bounded
+// number of steps (or until a builtin calls tet_yield) and leaves it resumable, so
+// thousands of tasks cost thousands of frame chains rather than thousands of threads.
+//
+// Every worker thread owns a private tstate. New tasks are placed on a worker's deque;
+// workers pop their own deque LIFO and steal FIFO from the deques of others when they
+// run out of work. Once a task has started its frames live in its worker's heap, so it
+// stays on that worker until it finishes; its worker pins its frames in the meantime.
+//
+// The call a task makes is frozen when it is spawned, and its result is frozen when it
+// finishes, so tasks can be handed between threads and joined from any state. Joining
+// a task that has not finished suspends the joining task (or blocks the thread, when
+// joining from outside the scheduler).
+//
+// Worker states start out with a copy of the global env of the state that created the
+// scheduler, so definitions made after its creation are not visible to tasks.
+//
+// The I/O builtins (read, write, accept, ...) work on non-blocking file descriptors.
+// When a task would block on one, it is parked on its worker's epoll instance rather
+// than put back in its run queue, and resumed once the descriptor is ready. A worker
+// thus serves any number of connections without ever blocking on one of them. Outside
+// of a task the I/O builtins simply block until their descriptor is ready.
+typedef enum ttaskstatus {
+    TTASK_NEW,
+    TTASK_STARTED,
+    TTASK_DONE,
+    TTASK_FAILED,
+} ttaskstatus;
+
+struct ttask {
+    tsize refs; // atomic, one held by the scheduler and one by every handle
+    tsched *sched;
+    ttaskstatus status; // atomic
+
+    tfrozen *call; // (fn args...) to invoke, or NULL if it should evaluate 'src'
+    char *src;
+
+    // Root and current frame of the task once it has started, and their pin slots.
+    tframe *root;
+    tframe *cur;
+    tsize rootpin;
+    tsize curpin;
+
+    tfrozen *result; // frozen result (or error) once done
+    bool waiting; // set when the task suspended because it is waiting on another
+    ttask *next; // next task in its worker's run queue
+
+    int fd; // file descriptor the task is parked on, or -1
+    tsize parkedi; // index in its worker's parked tasks
+};
+
+struct tsched {
+    tstate *owner;
+    tsize n;
+
+    struct tsched_worker {
+        tsched *sched;
+        pthread_t thread;
+        tstate *state;
+
+        // Deque of tasks that have not started yet. The owning worker pushes and pops
+        // at the bottom, other workers steal from the top.
+        pthread_mutex_t lock;
+        ttask **deque;
+        tsize top;
+        tsize bottom;
+        tsize cap;
+
+        // Started tasks, only ever touched by the owning worker.
+        ttask *head;
+        ttask *tail;
+        tsize started;
+
+        // Started tasks parked until a file descriptor becomes ready, and the epoll
+        // instance we wait for them with. The eventfd is part of it, so tsched_wake can
+        // interrupt the wait while we're 'polling'.
+        ttask **parked;
+        tsize parkedi;
+        tsize parkedl;
+        int epfd;
+        int evfd;
+        bool polling; // atomic
+        tsize polls; // slices run since we last checked on parked tasks
+
+        tsize gc; // heap size at which to collect next
+        tsize seed; // for picking victims to steal from
+    } *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // signalled when tasks are spawned or finish
+    tsize pending; // tasks waiting in deques (atomic)
+    tsize next; // worker to place the next task from outside the scheduler on (atomic)
+    bool stop;
+};
+
+tsched *tsched_new(tstate *s, tsize threads);
+void tsched_del(tsched *c);
+ttask *tsched_spawn(tsched *c, char *src);
+tval *tsched_join(tstate *s, ttask *t, tval **r);
+void ttask_retain(ttask *t);
+void ttask_release(ttask *t);
+
+//   __  __    _    ___ _     ____   _____  __
+//  |  \/  |  / \  |_ _| |   | __ ) / _ \ \/ /
+//  | |\/| | / _ \  | || |   |  _ \| | | \  /
+//  | |  | |/ ___ \ | || |___| |_) | |_| /  \
+//  |_|  |_/_/   \_\___|_____|____/ \___/_/\_\
+//
+// A bounded queue of messages between tstates, which may live on different threads (or
+// be tasks on a scheduler). Any number of states may send to a mailbox and receive from
+// it, although the typical use is many senders and a single receiver. Mailboxes are
+// reference counted and shared between states by their handles: a handle copied into
+// another state (or frozen, or sent) refers to the same mailbox.
+//
+// Messages never share mutable memory. Numbers (and nil) are sent by value in the slot
+// itself. A frozen value is sent as it is and received by holding its region, so it is
+// never copied. Any other value is frozen by the sender into a region of its own, which
+// the receiver copies into its heap and then releases.
+//
+// The queue itself is lock-free: a ring of slots, each with a sequence number that says
+// whether it is free for the sender at a given position or holds the message for the
+// receiver at that position. Senders and receivers claim positions with a compare and
+// swap. Only when a mailbox is full (or empty) do senders (or receivers) that want to
+// wait fall back to a condition variable; timeouts are given in milliseconds, where 0
+// means not to wait at all and a negative timeout means to wait for as long as it takes.
+struct tmailbox {
+    tsize refs; // atomic
+    tsize mask; // capacity - 1
+
+    struct tmailbox_slot {
+        tsize seq; // atomic
+        tfrozen *msg; // region the message lives in, NULL for numbers and nil
+        tval *val; // the message itself
+        tnum num; // the message itself, if it's a number
+        bool number; // whether the message is num
+        bool copied; // whether msg was created for this message alone
+    } *slots;
+    tsize head; // atomic, next position to send to
+    tsize tail; // atomic, next position to receive from
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // signalled when a message is sent or received while waiting
+    tsize waiting; // atomic, number of threads waiting on wake
+};
+
+tmailbox *tmailbox_new(tsize cap);
+void tmailbox_retain(tmailbox *m);
+void tmailbox_release(tmailbox *m);
+bool tmailbox_send(tstate *s, tmailbox *m, tval *v, long timeout);
+bool tmailbox_recv(tstate *s, tmailbox *m, long timeout, tval **r);
+
+//   _   _ _____    _    ____  ____  ____   ___  _____
+//  | | | | ____|  / \  |  _ \|  _ \|  _ \ / _ \|  ___|
+//  | |_| |  _|   / _ \ | |_) | |_) | |_) | | | | |_
+//  |  _  | |___ / ___ \|  __/|  __/|  _ <| |_| |  _|
+//  |_| |_|_____/_/   \_\_|   |_|   |_| \_\\___/|_|
+//
+// An allocation-site heap profile. Every allocation counts down the bytes until the next
+// sample, and the allocation that reaches zero is sampled: we record where it came from
+// (the tet call stack, i.e. the functions being invoked by the running frame chain, and
+// the C functions that called its constructor) and flag the object, so we know to take
+// it off the live counts when it is freed. Samples stand in for the allocations that
+// weren't sampled, so the counts in the profile are estimates, scaled by the rate.
+struct theapprof {
+    tsize rate;
+    tsize next; // bytes left until the next sample
+    uint64_t seed;
+
+    // Allocation sites, identified by their tet and C stacks.
+    struct theapprof_site {
+        char *stack; // tet frames, outermost first, separated by ';'
+        void *pcs[TET_HEAPPROF_CDEPTH]; // C frames, innermost first
+        tsize pcn;
+        tsize allocs; // estimated objects allocated
+        tsize bytes; // estimated bytes allocated
+        tsize liveallocs; // of which are still live
+        tsize livebytes;
+    } *sites;
+    tsize sitei;
+    tsize sitel;
+
+    // Sampled objects which are still live.
+    struct theapprof_obj {
+        tobj *obj;
+        tsize site;
+        tsize allocs;
+        tsize bytes;
+    } *objs;
+    tsize obji;
+    tsize objl;
+};
+
+// Write the profile in the collapsed stack format read by flame graph tools: a line per
+// allocation site, its frames followed by the bytes it allocated, or of those the bytes
+// which are still live.
+void theapprof_dump(theapprof *p, FILE *out, bool live);
+
+//    ____ ____  _   _ ____  ____   ___  _____
+//   / ___|  _ \| | | |  _ \|  _ \ / _ \|  ___|
+//  | |   | |_) | | | | |_) | |_) | | | | |_
+//  | |___|  __/| |_| |  __/|  _ <| |_| |  _|
+//   \____|_|    \___/|_|   |_| \_\\___/|_|
+//
+// A sampling CPU profile. A timer on the CPU time of the profiled thread sends it a
+// signal 'hz' times per second, whose handler does no more than count it. tet_run looks
+// at that count every TET_CPUPROF_STEPS steps (only while profiling, it otherwise counts
+// its steps exactly as it did before) and charges the ticks it finds to the tet call
+// stack of the frame it is at. Time spent in a builtin is therefore charged to the
+// frame tet_run gets to next, which is usually the builtin's caller.
+struct tcpuprof {
+    tsize hz;
+    timer_t timer;
+    tsize seen; // ticks already charged
+
+    // Call stacks we have seen, and the number of ticks charged to them.
+    struct tcpuprof_site {
+        char *stack;
+        tsize ticks;
+    } *sites;
+    tsize sitei;
+    tsize sitel;
+};
+
+// Write the profile in the collapsed stack format read by flame graph tools: a line per
+// call stack, its frames followed by the number of samples taken in it.
+void tcpuprof_dump(tcpuprof *p, FILE *out);
+
+//       _ ___ _____
+//      | |_ _|_   _|
+//   _  | || |  | |
+//  | |_| || |  | |
+//   \___/|___| |_|
+//
+// A baseline compiler for lambda bodies. tet_run counts the invocations of every lambda
+// and once one gets hot, we translate its body into x86-64 code that evaluates it the
+// way tet_run would have, minus the dispatch: a call to a helper (or to tframe_push)
+// for every value, with the value as a constant. Lists in the body become calls to the
+// builtins they invoke. Invoking the function the body evaluates to is left to tet_run,
+// so lambdas called by the body (including tail calls) are simply interpreted.
+//
+// We compile a body only if every list in it invokes a builtin, so that nothing in
+// the compiled code can yield to a scheduler or replace the running frame. As scopes
+// are dynamic, those builtins are looked up whenever the code is run, and we interpret
+// the body instead if any of them resolves to anything else (nothing will have run by
+// then). The code lives in memory of its own, mapped executable only once written, and
+// is unmapped when the lambda is freed. Tasks are always interpreted, since they need
+// to count their steps.
+typedef void (*tjit_fn)(tframe *f);
+
+typedef struct tjit_code {
+    tjit_fn fn;
+    tsize len; // of the mapping
+    tsize guardi;
+    struct tjit_guard {
+        tval *sym;
+        tval *val; // the builtin 'sym' resolved to when compiled
+    } guards[];
+} tjit_code;
+
+struct tjit {
+    // Lambdas seen, an open addressing hash table. The slots of lambdas we forgot stay
+    // in use (so lookups probe past them) until they are reused or the table is rebuilt.
+    struct tjit_entry {
+        tval *fn;
+        tsize calls; // -1 once we know we can't compile it
+        tjit_code *code;
+    } *entries;
+    tsize entryi; // slots in use, including removed entries
+    tsize entryl;
+};
+
+// Evaluate the body of 'fn' into the frame 'f' (which tet_run set up to evaluate it) if
+// we have compiled it, or if it is hot enough to be compiled now. Returns whether we
+// did, otherwise the body is left for tet_run to interpret.
+bool tjit_run(tstate *s, tval *fn, tframe *f);
+
+// Forget lambda 'fn', which is being freed.
+void tjit_forget(tjit *j, tval *fn);
+void tjit_del(tjit *j);
+
+//   _____ ____      _    ____ _____
+//  |_   _|  _ \    / \  / ___| ____|
+//    | | | |_) |  / _ \| |   |  _|
+//    | | |  _ <  / ___ \ |___| |___
+//    |_| |_| \_\/_/   \_\____|_____|
+//
+// Every state records trace events into a ring buffer of its own, overwriting the oldest
+// ones. Recording never blocks or allocates, and it is only compiled in if TET_TRACE is
+// non-zero. The trace may be read from any thread while the state keeps running: every
+// event carries its sequence number, written last, so a reader can tell events it read
+// whole from those overwritten while it was reading them.
+
+void ttrace_record(tstate *s, ttracekind kind, uint64_t a, uint64_t b);
+
+// Copy the last (at most) 'n' events of the trace of 's' into 'buf', oldest first,
+// returning how many were copied. Always 0 if tracing is compiled out.
+tsize ttrace_read(tstate *s, ttrace_event *buf, tsize n);
+
+// Write the trace of 's' to 'out', one event per line.
+void ttrace_dump(tstate *s, FILE *out);
+char *ttracekind_print(ttracekind k);
+
 //   ____  _   _ ___ _   _____ ___ _   _ ____
 //  | __ )| | | |_ _| | |_   _|_ _| \ | / ___|
 //  |  _ \| | | || || |   | |  | ||  \| \___ \
@@ -388,5 +1430,69 @@ tsize builtin_add(tframe *f);
 tsize builtin_sub(tframe *f);
 tsize builtin_mul(tframe *f);
 tsize builtin_div(tframe *f);
+tsize builtin_map(tframe *f);
+tsize builtin_pmap(tframe *f);
+tsize builtin_freeze(tframe *f);
+tsize builtin_spawn(tframe *f);
+tsize builtin_join(tframe *f);
+tsize builtin_yield(tframe *f);
+tsize builtin_mailbox(tframe *f);
+tsize builtin_send(tframe *f);
+tsize builtin_recv(tframe *f);
+tsize builtin_listen(tframe *f);
+tsize builtin_connect(tframe *f);
+tsize builtin_listen_unix(tframe *f);
+tsize builtin_connect_unix(tframe *f);
+tsize builtin_accept(tframe *f);
+tsize builtin_open(tframe *f);
+tsize builtin_pipe(tframe *f);
+tsize builtin_read(tframe *f);
+tsize builtin_write(tframe *f);
+tsize builtin_close(tframe *f);
+tsize builtin_vec(tframe *f);
+tsize builtin_vec_list(tframe *f);
+tsize builtin_vec_len(tframe *f);
+tsize builtin_vec_sum(tframe *f);
+tsize builtin_vec_min(tframe *f);
+tsize builtin_vec_max(tframe *f);
+tsize builtin_vec_dot(tframe *f);
+tsize builtin_vec_add(tframe *f);
+tsize builtin_vec_sub(tframe *f);
+tsize builtin_vec_mul(tframe *f);
+tsize builtin_hash_map(tframe *f);
+tsize builtin_assoc(tframe *f);
+tsize builtin_dissoc(tframe *f);
+tsize builtin_get(tframe *f);
+tsize builtin_contains(tframe *f);
+tsize builtin_count(tframe *f);
+tsize builtin_keys(tframe *f);
+tsize builtin_vals(tframe *f);
+tsize builtin_transient(tframe *f);
+tsize builtin_assoc_mut(tframe *f);
+tsize builtin_dissoc_mut(tframe *f);
+tsize builtin_persistent(tframe *f);
+tsize builtin_range(tframe *f);
+tsize builtin_lazy_map(tframe *f);
+tsize builtin_lazy_filter(tframe *f);
+tsize builtin_take(tframe *f);
+tsize builtin_reduce(tframe *f);
+tsize builtin_seq_list(tframe *f);
+tsize builtin_mmap(tframe *f);
+tsize builtin_bytes(tframe *f);
+tsize builtin_bytes_len(tframe *f);
+tsize builtin_bytes_str(tframe *f);
+tsize builtin_bytes_slice(tframe *f);
+tsize builtin_bytes_count(tframe *f);
+tsize builtin_lines(tframe *f);
+tsize builtin_split(tframe *f);
+tsize builtin_repr(tframe *f);
+
+// Fast paths of the builtins above, see tval_fast.
+extern const tfast tfast_car;
+extern const tfast tfast_cdr;
+extern const tfast tfast_add;
+extern const tfast tfast_sub;
+extern const tfast tfast_mul;
+extern const tfast tfast_div;
 
 #endif //TET_H